@@ -1,18 +1,35 @@
 #include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cmath>
+#ifdef __cpp_impl_coroutine
+#include <coroutine>
+#endif
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <future>
+#include <iomanip>
 #include <iostream>
 #include <iterator>
 #include <list>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <numeric>
+#include <optional>
+#include <queue>
 #include <random>
+#include <sstream>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -23,7 +40,10 @@
 #pragma comment(lib, "Ws2_32.lib")
 #else
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <unistd.h>
 typedef int SOCKET;
@@ -37,250 +57,191 @@ void closesocket(SOCKET s)
 #include <signal.h>
 #endif
 
+#ifdef __linux__
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <nmmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 #include <cassert>
 
 using namespace std;
 #include "common.h"
+#include "checksum.h"
 #include "log.h"
 #include "tcp_util.h"
-
-namespace Protocal {
-struct LoginRequest
-{
-    char uuid[40];
-    uint32_t N;
-
-    // non 0 for restart
-    uint32_t packets_seen;
-};
-
-struct LoginConfirmed
-{
-    // non 0 for restart
-    uint32_t sending_from;
-
-    // same a N in LoginRequest
-    uint32_t sending_total;
-};
-
-struct DataPacket
-{
-    uint32_t payload;
-};
-
-struct DataComplete
-{
-    uint32_t checksum;
-};
-
-int g_port_number;
-}; // namespace Protocal
-
-namespace FaultInjection {
-int g_flaky_connection = 0;
-int g_flaky_data       = 0;
-
-bool FlakyConnection()
-{
-    if (g_flaky_connection) {
-        static random_device rng;
-        static uniform_int_distribution<int> dist(1, g_flaky_connection);
-        if (dist(rng) == 1) {
-            LogError("!!! INJECTING FLAKY CONNECTION");
-            return true;
-        }
-    }
-    return false;
-}
-
-uint32_t FlakyData()
-{
-    if (g_flaky_data) {
-        static random_device rng;
-        static uniform_int_distribution<int> dist(1, g_flaky_data);
-        if (dist(rng) == 1) {
-            LogError("!!! INJECTING FLAKY DATA");
-            return dist(rng);
-        }
-    }
-    return 0;
-}
-}; // namespace FaultInjection
+#include "pipe_stream.h"
+#include "local_stream.h"
+#include "uring_util.h"
+#include "event_loop.h"
+#include "timer_wheel.h"
+#include "pacing.h"
+#include "payload.h"
+#include "protocol.h"
+#include "mux.h"
+#include "fault_injection.h"
+#include "metrics.h"
+#include "session_store.h"
+#include "checkpoint.h"
+#include "sink.h"
+#include "shared_state.h"
+#include "remote_state.h"
+#include "session.h"
+#include "reactor.h"
 
 namespace Server {
-using Time = std::chrono::time_point<std::chrono::system_clock>;
-using namespace std::chrono_literals; // give me the s suffix for numbers. so 5s
-                                      // = 5 seconds
-
-class SharedState
-{
-  public:
-    struct ConnectionState
-    {
-        vector<uint32_t> payload;
-        Time last_seen;
-        uint32_t last_sent;
-
-        ~ConnectionState() {}
-        ConnectionState()
-          : payload{}
-          , last_sent{ 0 } {};
-        ConnectionState(const vector<uint32_t>& payload)
-          : payload(payload)
-          , last_sent{ 0 }
-        {}
-
-        template<class Archive>
-        void serialize(Archive& archive)
-        {
-            archive(last_sent, payload);
-        }
-    };
-
-    void RegisterNewTransmission(const string& id,
-                                 const vector<uint32_t>& payload)
-    {
-        lock_guard<mutex> scope_guard(lock);
-
-        client_id_2_state.emplace(id, payload);
-    }
-
-    ConnectionState GetTransmission(const string& id)
-    {
-        lock_guard<mutex> scope_guard(lock);
-
-        auto i = client_id_2_state.find(id);
-        if (i == end(client_id_2_state)) {
-            // log state not found for this id.
-            // returning an empty transmission.
-            // This will then be treated as a never before seen connection and
-            // the payload will be genorated.
-            return {};
-        }
-        return i->second;
-    }
-
-    void SetTransmissionLastSent(const string& id, uint32_t last_sent)
-    {
-        lock_guard<mutex> scope_guard(lock);
-
-        auto& i     = client_id_2_state.at(id);
-        i.last_sent = last_sent;
-        i.last_seen = chrono::system_clock::now();
-    }
-
-    void EraseTransmission(const string& id)
-    {
-        lock_guard<mutex> scope_guard(lock);
-
-        client_id_2_state.erase(id);
-    }
-
-    void RemoveExpiredSessions()
-    {
-        auto expired = chrono::system_clock::now() - 30s;
-
-        lock_guard<mutex> scope_guard(lock);
-
-        for (auto i = begin(client_id_2_state); i != end(client_id_2_state);) {
-            if (i->second.last_seen < expired) {
-                LogInfo("(" + i->first + ")", "Session expried, removing");
-                i = client_id_2_state.erase(i);
-            } else {
-                ++i;
-            }
-        }
-    }
-
-  private:
-    unordered_map<string, ConnectionState> client_id_2_state;
-    mutex lock;
-};
+void ServeMux(unique_ptr<INetStream> stream, ISharedState* shared);
 
 struct LocalClientState
 {
     string uuid;
     atomic<bool> done;
-    TCPStream stream;
+    unique_ptr<INetStream> stream;
+    // false for a stream of a multiplexed connection, which can't be one
+    // itself.
+    bool mux_allowed;
     thread process;
 
-    LocalClientState(TCPStream s, SharedState* ss)
+    LocalClientState(unique_ptr<INetStream> s, ISharedState* ss,
+                     bool mux_allowed = true)
       : uuid{ "unkown" }
       , done{ false }
-      , stream{ s }
+      , stream{ move(s) }
+      , mux_allowed{ mux_allowed }
       , process(&LocalClientState::ProcessTransmission, this, ss)
     {}
 
     ~LocalClientState() { process.join(); }
 
-    void ProcessTransmission(SharedState* server_shared)
+    void ProcessTransmission(ISharedState* server_shared)
     {
+        // a multiplexed connection is not a session, its streams are.
+        optional<Metrics::SessionScope> counted;
+        counted.emplace();
+        optional<AckTracker> acks;
         try {
-            auto conn = TSerialToStream{ stream };
+            // Everything goes through a buffer, and is flushed at the end
+            // of each pacing tick, and on close.
+            BufferedStream buffered(*stream);
+            auto conn = TSerialToStream{ buffered };
 
             // Step 1. Receive login.
-            auto login = conn.RecvN<Protocal::LoginRequest>();
-            uuid       = string(begin(login.uuid),
-                          find(begin(login.uuid), end(login.uuid), '\0'));
-
-            LogInfo("login for", uuid);
-            LogInfo("(" + uuid + ")", "requested", login.packets_seen, "to",
-                    login.N);
-
-            // Step 2. Get the previous state, if any.
-            auto to_transmit = server_shared->GetTransmission(uuid);
-            if (to_transmit.payload.size() == 0) {
-                // new transmission, or one that had time out and we've
-                // forgotten.
-                random_device random_src;
-                to_transmit.payload.reserve(login.N);
-                for (uint32_t i = 0; i < login.N; i++) {
-                    to_transmit.payload.emplace_back(random_src());
-                }
-                to_transmit.last_sent = 0;
-
-                server_shared->RegisterNewTransmission(uuid,
-                                                       to_transmit.payload);
-            } else {
-                LogInfo("(" + uuid + ")", "resumed. Last sent ",
-                        to_transmit.last_sent);
+            Protocal::Hello hello;
+            Protocal::LoginRequest login;
+            auto has_hello = RecvLogin(conn, hello, login);
+            auto logged_in = chrono::steady_clock::now();
+
+            if (mux_allowed && Protocal::IsMuxOpener(has_hello, hello, login)) {
+                vector<char> out;
+                EncodeMuxAccept(out);
+                buffered.SendN(out.size(), out.data());
+                conn.Flush();
+                counted.reset();
+                LogInfo("Multiplexed connection");
+                ServeMux(move(stream), server_shared);
+                done = true;
+                return;
             }
 
-            // Step 3. Calc where to start.
-            // This is the min of were both ends thought they had gotten to.
+            // Step 2 and 3. Get the previous state, if any, and where to
+            // start from.
+            auto start = ResolveLogin(server_shared, login,
+                                      has_hello ? &hello : nullptr);
+            uuid              = start.uuid;
+            auto& to_transmit = start.to_transmit;
+            auto sending_from = start.sending_from;
+
             // SendN this to the client. Confirming their log in, and where we
             // are starting from.
-            auto sending_from = min(to_transmit.last_sent, login.packets_seen);
-            conn.SendN(Protocal::LoginConfirmed{
-              sending_from,
-              static_cast<uint32_t>(to_transmit.payload.size()) });
+            vector<char> out;
+            EncodeConfirmation(start, out);
+            buffered.SendN(out.size(), out.data());
 
             // we test for N missmatch here, so we have told the client our
             // numbers they match in the client either, so both will terminate
             // this session
-            if (to_transmit.payload.size() != login.N) {
+            if (start.NMissmatch(login)) {
                 LogError("Request N Packet missmatch. server:",
-                         to_transmit.payload.size(), "client:", login.N);
+                         to_transmit.Size(), "client:", login.N);
+                Metrics::Add(Metrics::NMismatches);
                 conn.Close();
                 done = true;
                 return;
             }
 
-            LogInfo("(" + uuid + ")", "will send", sending_from, "to", login.N);
+            LogInfo("(" + uuid + ")", "will send", sending_from, "to",
+                    start.sending_to);
 
             // Step 4. do the actual stream of data.
-            auto time_acc = std::chrono::system_clock::now();
-            for (auto pi = sending_from; pi < to_transmit.payload.size();
-                 ++pi) {
-                auto data_to_send = to_transmit.payload[pi];
-                data_to_send += FaultInjection::FlakyData();
-                conn.SendN(Protocal::DataPacket{ data_to_send });
+            // Each wake up sends as many packets as the pacer allows, in as
+            // few frames as the client agreed to. Any Acks are read between
+            // sends, so a client that stops acking is only noticed while the
+            // socket still takes more.
+            acks.emplace(start);
+            auto total = start.sending_to;
+            Pacer pacer(g_rate, g_burst, Pacer::Clock::now());
+            vector<Protocal::DataBatch> headers;
+            vector<Protocal::ChunkChecksum> checks;
+            vector<IoSlice> slices;
+            for (auto pi = sending_from; pi < total;) {
+                if (acks->On()) {
+                    acks->ReadFrom(buffered);
+                    if (acks->Overdue(AckTracker::Clock::now())) {
+                        LogError("(" + uuid + ")", "No Ack after",
+                                 acks->Acked(), "closing");
+                        Metrics::Add(Metrics::AckTimeouts);
+                        conn.Close();
+                        done = true;
+                        return;
+                    }
+                }
+
+                auto n = pacer.Take(Pacer::Clock::now(), total - pi);
+                if (!n) {
+                    this_thread::sleep_until(pacer.Next(total - pi));
+                    continue;
+                }
 
-                LogTrace("(" + uuid + ")", "sent packet", pi, "value",
-                         to_transmit.payload[pi]);
+                auto send_start = chrono::steady_clock::now();
+                size_t bytes    = 0;
+                if (CanSendInPlace(start)) {
+                    SlicePackets(start, pi, n, headers, checks, slices);
+                    buffered.SendV(slices.data(), slices.size());
+                    for (auto& slice : slices) {
+                        bytes += slice.size;
+                    }
+                } else {
+                    out.clear();
+                    EncodePackets(start, pi, n, out);
+                    buffered.SendN(out.size(), out.data());
+                    bytes = out.size();
+                }
+                conn.Flush();
+                auto sent = chrono::steady_clock::now();
+                Metrics::Record(Metrics::SendCall, sent - send_start);
+                if (pi == sending_from) {
+                    Metrics::Record(Metrics::LoginToFirstPacket,
+                                    sent - logged_in);
+                }
+                Metrics::Add(Metrics::BytesSent, bytes);
+                Metrics::Add(Metrics::PacketsSent, n);
+                pi += n;
 
-                server_shared->SetTransmissionLastSent(uuid, pi);
-                this_thread::sleep_until(time_acc += 1s);
+                RecordProgress(start, pi);
+                acks->Sent(pi, sent);
 
                 if (FaultInjection::FlakyConnection()) {
                     LogError("(" + uuid + ")",
@@ -292,7 +253,8 @@ struct LocalClientState
             }
 
             // Step 5. Send the checksum and close everthing down.
-            auto checksum = Common::ComputeChecksum(to_transmit.payload);
+            auto checksum =
+              to_transmit.payload->Checksum(start.Checksum());
             LogInfo("(" + uuid + ")", "Payload sent, sending check sum",
                     checksum);
 
@@ -303,29 +265,239 @@ struct LocalClientState
                     "Complete transmission, closed connection.");
         } catch (socket_close_exception e) {
             LogError("(" + uuid + ")", "Socket closed early");
+        } catch (runtime_error& e) {
+            LogError("(" + uuid + ")", acks ? "Failed" : "Bad login",
+                     e.what());
+            if (stream) {
+                stream->Close();
+            }
         }
         // Either successful, or some socket error, this thread is done.
         done = true;
     }
 };
 
-int main(int , const char** )
+// Each stream the client opens is a session of its own, on a thread of its
+// own, just as a connection is. Returns once the connection has ended.
+void ServeMux(unique_ptr<INetStream> stream, ISharedState* shared)
+{
+    auto mux = make_shared<MuxConnection>(move(stream), true);
+    list<LocalClientState> sessions;
+    while (auto s = mux->Accept()) {
+        sessions.remove_if(
+          [](const auto& session) { return session.done.load(); });
+        sessions.emplace_back(move(s), shared, false);
+    }
+}
+
+// With a state file, sessions survive the server restarting.
+// Null without -state_file. Throws if the file can't be used.
+unique_ptr<SessionStore> StoreFromArgs(int argc, const char** argv)
+{
+    auto arg = Common::GetArg("-state_file", argc, argv);
+    if (!arg) {
+        return nullptr;
+    }
+    return make_unique<SessionStore>(
+      arg,
+      max(1, Common::GetIntArg("-state_slots", argc, argv,
+                               SessionStore::g_default_slot_count)),
+      chrono::milliseconds(
+        max(1, Common::GetIntArg("-state_sync_ms", argc, argv, 1000))));
+}
+
+chrono::seconds SessionTimeoutFromArgs(int argc, const char** argv)
 {
-    SharedState shared;
+    return chrono::seconds(max(
+      1, Common::GetIntArg(
+           "-session_timeout", argc, argv,
+           (int)LocalSharedState::g_default_session_timeout.count())));
+}
+
+int main(int argc, const char** argv)
+{
+    if (auto arg = Common::GetArg("-payload", argc, argv); arg) {
+        g_lazy_payloads = string(arg) == "lazy";
+    }
+    LogInfo("Payloads are", g_lazy_payloads ? "lazy" : "stored");
+    if (auto arg = Common::GetArg("-resume_key", argc, argv); arg) {
+        g_resume_key = arg;
+    }
+    g_ack_timeout = chrono::milliseconds(max(
+      0, Common::GetIntArg("-ack_timeout_ms", argc, argv,
+                           (int)g_ack_timeout.count())));
+
+    g_listen_backlog =
+      max(1, Common::GetIntArg("-backlog", argc, argv, g_listen_backlog));
+
+    // -listeners N accepts TCP connections on N threads, see AcceptThread,
+    // each with its own epoll reactor owning the sessions whose uuids hash to
+    // it. The state is split in to a multiple of N shards, so each shard
+    // belongs to one reactor.
+    auto listener_count =
+      max(0, Common::GetIntArg("-listeners", argc, argv, 0));
+#ifndef __linux__
+    if (listener_count) {
+        LogError("-listeners is not available on this platform");
+        listener_count = 0;
+    }
+#endif
+    auto shard_count = LocalSharedState::g_default_shard_count;
+    if (listener_count) {
+        shard_count = (shard_count + listener_count - 1) / listener_count
+                      * listener_count;
+    }
+
+    // Sessions are kept here, or with -state_server in a state_server
+    // shared with other servers.
+    unique_ptr<SessionStore> store;
+    unique_ptr<ISharedState> shared;
+    try {
+        if (auto port = Common::GetIntArg("-state_server", argc, argv, 0)) {
+            shared = make_unique<RemoteSharedState>(
+              "localhost", port, g_lazy_payloads,
+              chrono::milliseconds(max(
+                1, Common::GetIntArg("-state_flush_ms", argc, argv, 10))));
+            LogInfo("Sessions are kept by the state server on", port);
+        } else {
+            store  = StoreFromArgs(argc, argv);
+            shared = make_unique<LocalSharedState>(
+              shard_count, store.get(), SessionTimeoutFromArgs(argc, argv));
+        }
+    } catch (runtime_error& e) {
+        LogError(e.what());
+        return 1;
+    }
+    ExpiryThread expiry(shared.get(), 1s);
+
+    // Counters are always kept, these only say where they go.
+    unique_ptr<Metrics::Reporter> stats;
+    try {
+        stats = make_unique<Metrics::Reporter>(
+          [&shared] {
+              return vector<pair<string, uint64_t>>{
+                  { "shared_state_size", shared->Size() }
+              };
+          },
+          chrono::milliseconds(Common::GetIntArg("-stats_ms", argc, argv, 0)),
+          Common::GetIntArg("-stats_port", argc, argv, 0));
+    } catch (runtime_error& e) {
+        LogError("Could not start stats,", e.what());
+        return 1;
+    }
 
     LogInfo("Starting server");
 
-    TCPStream conn(Protocal::g_port_number);
+    // Clients on this host can skip TCP, see local_stream.h. Unless
+    // -transport tcp, there is a unix socket listener, and one handing out
+    // shared memory, as well. With -listeners, TCP is accepted on threads of
+    // its own, and only these are accepted here.
+    struct Listener
+    {
+        TCPStream socket;
+        bool shared_memory;
+    };
+    vector<Listener> listeners;
+    if (!listener_count) {
+        listeners.push_back({ TCPStream(Protocal::g_port_number), false });
+        LogInfo("Listening on", Protocal::g_port_number);
+    }
+#ifdef __linux__
+    if (auto arg = Common::GetArg("-transport", argc, argv);
+        !arg || string(arg) != "tcp") {
+        try {
+            for (auto shared_memory : { false, true }) {
+                auto name = LocalName(Protocal::g_port_number,
+                                      shared_memory ? "shm" : "unix");
+                listeners.push_back({ UnixListen(name), shared_memory });
+                LogInfo("Listening on", name);
+            }
+        } catch (runtime_error& e) {
+            LogError(e.what(), ", local clients will use TCP");
+        }
+    }
+#endif
+    vector<TCPStream*> sockets;
+    for (auto& l : listeners) {
+        sockets.push_back(&l.socket);
+    }
+
+#ifdef __linux__
+    string io = "epoll";
+#else
+    string io = "blocking";
+#endif
+    if (auto arg = Common::GetArg("-io", argc, argv); arg) {
+        io = arg;
+    }
+    if (listener_count && io != "epoll") {
+        LogError("-listeners always uses epoll, not", io);
+        io = "epoll";
+    }
+
+    g_rate  = max(1, Common::GetIntArg("-rate", argc, argv, 1));
+    g_burst = max(1, Common::GetIntArg("-burst", argc, argv, g_rate / 100));
+    LogInfo("Sending", g_rate, "packets a second, in bursts of up to", g_burst);
+
+    // With the epoll core, the loop below only accepts, and hands each new
+    // connection round robin to a reactor.
+    vector<unique_ptr<Reactor>> reactors;
+#ifdef __linux__
+    vector<unique_ptr<AcceptThread>> accept_threads;
+#endif
+    if (io == "epoll") {
+#ifdef __linux__
+        auto count = listener_count
+                       ? listener_count
+                       : max(1, Common::GetIntArg("-reactors", argc, argv, 1));
+        for (int i = 0; i < count; ++i) {
+            reactors.emplace_back(
+              make_unique<Reactor>(shared.get(), listener_count ? i : -1));
+        }
+        LogInfo("Using", count, "epoll reactor(s)");
 
-    LogInfo("Listening on", Protocal::g_port_number);
+        if (listener_count) {
+            vector<Reactor*> owners;
+            for (auto& reactor : reactors) {
+                owners.push_back(reactor.get());
+            }
+            try {
+                for (int i = 0; i < count; ++i) {
+                    reactors[i]->Route(owners);
+                    accept_threads.push_back(make_unique<AcceptThread>(
+                      Protocal::g_port_number, *reactors[i], i));
+                }
+            } catch (runtime_error& e) {
+                LogError(e.what());
+                return 1;
+            }
+            LogInfo("Listening on", Protocal::g_port_number, "with", count,
+                    "listeners, each on a core of its own");
+        }
+#else
+        LogError("epoll is not available on this platform, using blocking");
+        io = "blocking";
+#endif
+    } else if (io == "uring") {
+#ifdef __linux__
+        LogInfo("Using io_uring streams, a thread per connection");
+#else
+        LogError("io_uring is not available on this platform, using blocking");
+        io = "blocking";
+#endif
+    } else if (io != "blocking") {
+        LogError("Unknown -io", io, ", using blocking");
+        io = "blocking";
+    }
+    size_t next_reactor = 0;
 
     list<LocalClientState> active_clients;
 
     int trace_counter = 0;
     for (;;) {
-        if (!conn.WaitForDataToRecv(1s)) {
+        auto ready = WaitForAccept(sockets, 1s);
+        if (ready < 0) {
             LogTrace("Waiting on connection", trace_counter++);
-            shared.RemoveExpiredSessions();
 
             active_clients.remove_if([](const auto& client) {
                 if (client.done) {
@@ -340,17 +512,92 @@ int main(int , const char** )
 
         {
             LogInfo("accepting new connection");
-            active_clients.emplace_back(conn.Accept(), &shared);
+            auto& listener = listeners[ready];
+            if (listener.shared_memory) {
+#ifdef __linux__
+                // not a socket, so always a thread of its own.
+                try {
+                    active_clients.emplace_back(
+                      ShmStream::Offer(listener.socket.Accept()),
+                      shared.get());
+                } catch (runtime_error& e) {
+                    LogError("Shared memory connection failed,", e.what());
+                }
+#endif
+            } else if (reactors.empty()) {
+                // an io_uring stream can't be read on one thread while sent
+                // on another, as a multiplexed one is.
+                active_clients.emplace_back(
+                  MakeStream(io, listener.socket.Accept()), shared.get(),
+                  io != "uring");
+            } else {
+                reactors[next_reactor++ % reactors.size()]->Adopt(
+                  listener.socket.Accept());
+            }
             LogInfo("accepting new connection - done");
         }
     }
 
-    conn.Close();
+    for (auto& l : listeners) {
+        l.socket.Close();
+    }
 
     return 0;
 }
 } // namespace Server
 
+// Keeps sessions for any number of servers started with -state_server, so
+// they can resume each others sessions.
+namespace StateServer {
+struct Connection
+{
+    atomic<bool> done;
+    TCPStream stream;
+    thread process;
+
+    Connection(TCPStream s, Server::LocalSharedState* shared)
+      : done{ false }
+      , stream{ s }
+      , process([this, shared] {
+          Server::ServeStateConnection(shared, stream);
+          done = true;
+      })
+    {}
+
+    ~Connection() { process.join(); }
+};
+
+int main(int argc, const char** argv)
+{
+    unique_ptr<Server::SessionStore> store;
+    try {
+        store = Server::StoreFromArgs(argc, argv);
+    } catch (runtime_error& e) {
+        LogError(e.what());
+        return 1;
+    }
+    Server::LocalSharedState shared(
+      Server::LocalSharedState::g_default_shard_count, store.get(),
+      Server::SessionTimeoutFromArgs(argc, argv));
+    Server::ExpiryThread expiry(&shared, chrono::seconds(1));
+
+    TCPStream listener(Protocal::g_port_number);
+    LogInfo("State server listening on", Protocal::g_port_number);
+
+    list<Connection> connections;
+    for (;;) {
+        if (!listener.WaitForDataToRecv(chrono::seconds(1))) {
+            connections.remove_if([](const auto& c) { return c.done.load(); });
+            continue;
+        }
+
+        connections.emplace_back(listener.Accept(), &shared);
+        LogInfo("Server connected,", connections.size(), "connected");
+    }
+    return 0;
+}
+} // namespace StateServer
+
 namespace Client {
 enum class ReturnCode
 {
@@ -361,158 +608,1640 @@ enum class ReturnCode
     BadRequest,
 };
 
-ReturnCode ProcessTransmission(INetStream* stream, const string& uuid, uint32_t N,
-                               vector<uint32_t>& out_payload)
+const char* ToString(ReturnCode code)
 {
-    try {
-        auto conn = TSerialToStream{ *stream };
-
-        // Setp 1. Log in.
-        // send who we are, how many ints we want,
-        // And if this is a reconnect, how many its we've seen.
-        {
-            Protocal::LoginRequest r{};
-            if (uuid.size() > 40) {
-                LogError(uuid.size(),
-                         "is to many characters for the uuid. limit is 40");
-                return ReturnCode::BadUUID;
-            }
-            copy(begin(uuid), end(uuid), r.uuid);
-            r.N            = N;
-            r.packets_seen = out_payload.size();
+    switch (code) {
+        case ReturnCode::Success:
+            return "Success";
+        case ReturnCode::CorruptedDownload:
+            return "Corrupted";
+        case ReturnCode::ConnectionFailure:
+            return "ConnectionFailure";
+        case ReturnCode::BadUUID:
+            return "BadUUID";
+        case ReturnCode::BadRequest:
+            return "BadRequest";
+    }
+    return "Unknown";
+}
 
-            conn.SendN(r);
-        }
+// What the client asks of the server beyond the LoginRequest.
+struct Options
+{
+    // Most ints per DataBatch frame. 0 logs in the old way, without a Hello,
+    // and gets one DataPacket per int.
+    uint32_t batch_max = 4096;
 
-        // Step 2. Wait for loging confirmed.
-        auto session = conn.RecvN<Protocal::LoginConfirmed>();
-        if (session.sending_total != N) {
-            LogError("Request N Packet missmatch. client:", N,
-                     "server:", session.sending_total);
-            return ReturnCode::BadRequest;
-        }
+    // The checksum to ask for. A server that does not know it, or an old one,
+    // sends the legacy one.
+    Common::ChecksumAlgo checksum = Common::ChecksumAlgo::Crc32c;
 
-        out_payload.reserve(session.sending_total);
+    // Ints per ChunkChecksum, 0 for none. A chunk that fails is re-fetched on
+    // its own, rather than the whole download failing.
+    uint32_t chunk_size = 1 << 16;
 
-        LogInfo("to process from", session.sending_from, "of a total",
-                session.sending_total);
+    // How many re-fetches may come back bad before giving up.
+    int max_refetches = 8;
 
-        // Step 3. Recv loop.
-        for (auto pi = session.sending_from; pi < session.sending_total; ++pi) {
-            auto p = conn.RecvN<Protocal::DataPacket>();
-            p.payload += FaultInjection::FlakyData();
-            if (pi < out_payload.size()) {
-                out_payload[pi] = p.payload;
-            } else {
-                out_payload.push_back(p.payload);
-            }
-            LogTrace("packet", pi, ", value of ", p.payload);
+    // Where to keep a Checkpoint of each download, none if empty.
+    string checkpoint_dir;
 
-            if (FaultInjection::FlakyConnection()) {
-                LogError("(" + uuid + ")", "Fault injecting connection fail");
-                return ReturnCode::ConnectionFailure;
-            }
-        }
+    // Ints between Acks, 0 for none, see Protocal::Feature_Ack.
+    uint32_t ack_every = 0;
+};
 
-        // Step 4. Recv the checksum.
-        auto complete = conn.RecvN<Protocal::DataComplete>();
+// A download, kept across reconnects.
+struct Download
+{
+    // With FetchRanges, only [from, to) of the payload, the other ranges
+    // being fetched alongside. to is 0 for the whole payload.
+    uint32_t from = 0;
+    uint32_t to   = 0;
 
-        // Step 5. Compute checksum.
-        auto checksum = Common::ComputeChecksum(out_payload);
-        LogInfo("local checksum", checksum, ", remote checksum",
-                complete.checksum);
-        return checksum == complete.checksum ? ReturnCode::Success
-                                             : ReturnCode::CorruptedDownload;
+    // The ints from 'from' on.
+    PayloadBuffer payload;
 
-    } catch (socket_close_exception e) {
-        return ReturnCode::ConnectionFailure;
-    }
-}
+    // Kept up to date as ints arrive, so checking the DataComplete is O(1).
+    // Not kept for a range, whose DataComplete is checked once every range
+    // has arrived, with what is kept here.
+    Common::RunningChecksum checksum;
+    Common::ChecksumAlgo range_algo = Common::ChecksumAlgo::Legacy;
+    uint32_t range_checksum         = 0;
 
-int main(int argc, const char** argv)
-{
-    string uuid = "";
-    if (auto arg = Common::GetArg("-uuid", argc, argv); arg) {
-        uuid = arg;
-    } else {
-        uuid = Common::RandomUUID(40);
-    }
+    // Set when the server does not do ranges.
+    bool range_refused = false;
 
-    auto n = Common::GetIntArg("-n", argc, argv, 0);
-    if (!n) {
-        random_device rng;
-        uniform_int_distribution<int> dist(1, 0xffff);
-        n = dist(rng);
-    }
+    // The server's last resume token, handed back on each reconnect, see
+    // Protocal::Feature_ResumeToken.
+    uint32_t resume_token[4] = {};
 
-    LogInfo("connecting as", quoted(uuid), ", packets requested ", n);
+    // [from, to) ranges that failed their ChunkChecksum, in order.
+    vector<pair<uint32_t, uint32_t>> bad_ranges;
 
-    auto result = ReturnCode::Success;
-    vector<uint32_t> payload;
+    // Where payload, checksum and bad_ranges are kept, if anywhere but
+    // memory.
+    unique_ptr<Checkpoint> checkpoint;
 
-    do {
-        if (result == ReturnCode::ConnectionFailure) {
-            LogInfo("Connection failure, retry in:");
-            for (int i = 3; i > 0; i--) {
-                this_thread::sleep_for(1s);
-                LogInfo(i);
-            }
-            LogInfo("Attempting reconnect");
-        }
-        TCPStream conn("localhost", Protocal::g_port_number);
-        result = ProcessTransmission(&conn, uuid, n, payload);
-        conn.Close();
-    } while (result == ReturnCode::ConnectionFailure);
+    // If set, the ints go here once checked, in order, rather than in
+    // payload, and only those of the chunk being checked are held, in
+    // pending. Never for a range.
+    ISink* sink = nullptr;
+    vector<uint32_t> pending;
 
-    LogMessage("Result",
-               ((result == ReturnCode::Success) ? "Success" : "Corrupted"));
+    bool IsRange() const { return to != 0; }
 
-    return 0;
-}
-} // namespace Client
+    // Where this download stops, given the payload size.
+    uint32_t End(uint32_t N) const { return to ? to : N; }
 
-int main(int argc, const char** argv)
-{
-    Log(LogLevel::Message, "Simple Int stream server");
-    Log(LogLevel::Trace, vector<string>{ argv, argv + argc });
-#ifdef _WIN32
+    // How many ints from 'from' on are kept.
+    uint32_t Held() const
     {
-        // start up win sock 2.2 lib
-        WSADATA wsa_data;
-        if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
-            LogError("Windows Sockets failed to start");
-            return 1;
-        }
+        return static_cast<uint32_t>(sink ? sink->Committed() : payload.Size());
     }
-#else
+
+    // If every int has arrived, at least once.
+    bool Received(uint32_t N) const { return from + Held() >= End(N); }
+
+    // With a sink, keeps those of a frame's ints, the first of which is int
+    // at, that it doesn't already have, until they are checked.
+    void Stage(uint32_t at, const vector<uint32_t>& frame)
     {
-        // ignore sig pipe.
-        // if the client goes away and this is not ignored, then the server
-        // dissapears (crash, but no segfault).
-        // I deal with send to a broken pipe by reassigning an exception and
-        // closing as required, so I dont need this
-        struct sigaction tmp
-        {
-            SIG_IGN
-        };
-        sigaction(SIGPIPE, &tmp, NULL);
+        auto next = sink->Committed() + pending.size();
+        auto skip = min<uint64_t>(next > at ? next - at : 0, frame.size());
+        pending.insert(end(pending), begin(frame) + skip, end(frame));
     }
-#endif
 
-    // Common params
-    Protocal::g_port_number = Common::GetIntArg("-port", argc, argv, 9000);
-    g_log_level =
-      Common::HasArg("-v", argc, argv) ? LogLevel::Trace : LogLevel::Info;
+    // Hands what was staged on to the checksum and the sink.
+    void Commit()
+    {
+        checksum.Update(pending.data(), pending.size());
+        sink->Write(pending.data(), pending.size());
+        pending.clear();
+    }
 
-    FaultInjection::g_flaky_connection =
-      Common::GetIntArg("-flaky_connection", argc, argv, 0);
-    if (FaultInjection::g_flaky_connection) {
-        LogError("!!! FLAKY CONNECTION ACTIVE.. 1 in", FaultInjection::g_flaky_connection);
+    // Keeps the download in a Checkpoint in dir, carrying on from whatever
+    // it already holds.
+    void KeepIn(const string& dir, const string& uuid, uint32_t N)
+    {
+        auto path  = Checkpoint::PathFor(dir, uuid, from);
+        checkpoint = make_unique<Checkpoint>(path, uuid, N, from, End(N), 1s);
+        payload.Attach(checkpoint->Ints(), End(N) - from, checkpoint->Count());
+        checkpoint->RestoreChecksum(checksum, N);
+        bad_ranges = checkpoint->BadRanges();
     }
-    FaultInjection::g_flaky_data =
-      Common::GetIntArg("-flaky_data", argc, argv, 0);
-    if (FaultInjection::g_flaky_data) {
-        LogError("!!! FLAKY DATA ACTIVE.. 1 in", FaultInjection::g_flaky_data);
+
+    // The ints are saved as they arrive, the rest only when this is called.
+    void Save()
+    {
+        if (checkpoint) {
+            checkpoint->SaveChecksum(checksum);
+            checkpoint->SaveBadRanges(bad_ranges);
+        }
+    }
+
+    // Once there is nothing to carry on from.
+    void Forget()
+    {
+        if (checkpoint) {
+            checkpoint->Remove();
+        }
+    }
+
+    // Chunks are never split, so a chunk is either all in one range, or in
+    // none.
+    void ChunkChecked(uint32_t from, uint32_t to, bool good)
+    {
+        auto i = find_if(begin(bad_ranges), end(bad_ranges), [=](auto& r) {
+            return r.first <= from && to <= r.second;
+        });
+        if (good) {
+            if (i == end(bad_ranges)) {
+                return;
+            }
+            auto after = make_pair(to, i->second);
+            i->second  = from;
+            if (after.first < after.second) {
+                i = bad_ranges.insert(i + 1, after) - 1;
+            }
+            if (i->first == i->second) {
+                bad_ranges.erase(i);
+            }
+            return;
+        }
+        if (i != end(bad_ranges)) {
+            return;
+        }
+        auto next = lower_bound(begin(bad_ranges), end(bad_ranges),
+                                make_pair(from, to));
+        if (next != begin(bad_ranges) && prev(next)->second == from) {
+            prev(next)->second = to;
+        } else {
+            bad_ranges.insert(next, { from, to });
+        }
+    }
+};
+
+// One connection's worth of a download, ProcessTransmission's steps without
+// the reads and writes, so the same steps run over a blocking INetStream or
+// in a coroutine. A step that returns anything but Success ends the
+// connection with it.
+class Transfer
+{
+  public:
+    Transfer(const string& uuid, uint32_t N, Download& download,
+             const Options& options)
+      : uuid{ uuid }
+      , N{ N }
+      , download{ download }
+      , options{ options }
+      , base{ download.from } // payload[i] is int base + i.
+    {}
+
+    // If a Hello goes before the LoginRequest, and so comes back.
+    bool SendsHello() const { return options.batch_max != 0; }
+
+    // Setp 1. Log in.
+    // send who we are, how many ints we want,
+    // And if this is a reconnect, how many its we've seen.
+    // Any options go in a Hello just before, and both are sent together, from
+    // out.
+    // Once everything has arrived, any chunks that failed are asked for
+    // again, one range at a time.
+    ReturnCode Login(vector<char>& out)
+    {
+        auto fetch_from   = base + download.Held();
+        uint32_t fetch_to = 0;
+        if (download.Received(N) && !download.bad_ranges.empty()) {
+            tie(fetch_from, fetch_to) = download.bad_ranges.front();
+        }
+
+        Protocal::LoginRequest r{};
+        if (uuid.size() > 40) {
+            LogError(uuid.size(),
+                     "is to many characters for the uuid. limit is 40");
+            return ReturnCode::BadUUID;
+        }
+        copy(begin(uuid), end(uuid), r.uuid);
+        r.N            = N;
+        r.packets_seen = fetch_from;
+
+        if (SendsHello()) {
+            auto hello = Protocal::MakeHello(
+              Protocal::Feature_DataBatch | Protocal::Feature_Checksum
+              | Protocal::Feature_ResumeToken
+              | (options.chunk_size ? uint32_t(Protocal::Feature_ChunkCheck) : 0u)
+              | (AckEvery() && !fetch_to ? uint32_t(Protocal::Feature_Ack) : 0u)
+              | (download.IsRange() ? uint32_t(Protocal::Feature_Range) : 0u));
+            hello.batch_max  = options.batch_max;
+            hello.checksum   = static_cast<uint32_t>(options.checksum);
+            hello.chunk_size = options.chunk_size;
+            hello.fetch_to   = fetch_to;
+            hello.ack_every  = AckEvery();
+            if (download.IsRange()) {
+                // a re-fetch is a range of its own.
+                hello.range_from = fetch_to ? fetch_from : base;
+                hello.fetch_to   = fetch_to ? fetch_to : download.to;
+            }
+            copy(begin(download.resume_token), end(download.resume_token),
+                 hello.resume_token);
+            Protocal::AppendTo(out, hello);
+        }
+        Protocal::AppendTo(out, r);
+        return ReturnCode::Success;
+    }
+
+    // Step 2. Loging confirmed, and what was agreed to, which is all 0 when
+    // no Hello was sent.
+    ReturnCode Confirmed(const Protocal::Hello& agreed,
+                         const Protocal::LoginConfirmed& session)
+    {
+        batched = (agreed.features & Protocal::Feature_DataBatch) != 0;
+        chunk   = (agreed.features & Protocal::Feature_ChunkCheck)
+                  ? agreed.chunk_size
+                  : 0;
+
+        if (agreed.features & Protocal::Feature_ResumeToken) {
+            copy(begin(agreed.resume_token), end(agreed.resume_token),
+                 download.resume_token);
+        }
+
+        if (session.sending_total != N) {
+            LogError("Request N Packet missmatch. client:", N,
+                     "server:", session.sending_total);
+            return ReturnCode::BadRequest;
+        }
+
+        ranged = download.IsRange();
+        if (ranged && !(agreed.features & Protocal::Feature_Range)) {
+            LogInfo("(" + uuid + ")", "Server does not fetch ranges");
+            download.range_refused = true;
+            return ReturnCode::BadRequest;
+        }
+
+        streamed = download.sink != nullptr;
+        if (!streamed) {
+            download.payload.Reserve(download.End(N) - base);
+        }
+
+        algo = (agreed.features & Protocal::Feature_Checksum)
+                 ? static_cast<Common::ChecksumAlgo>(agreed.checksum)
+                 : Common::ChecksumAlgo::Legacy;
+        auto& checksum = download.checksum;
+        if (!ranged) {
+            if (checksum.Algo() != algo || checksum.Total() != N) {
+                checksum = Common::RunningChecksum(algo, N);
+            }
+            if (!streamed) {
+                checksum.SeekTo(session.sending_from, download.payload.Data());
+                // before any of the ints it covered are sent again.
+                download.Save();
+            } else if (checksum.Count() != download.sink->Committed()) {
+                // ints from before this run.
+                checksum = Common::RunningChecksum(algo, N);
+                download.sink->Replay([&](const uint32_t* ints, size_t n) {
+                    checksum.Update(ints, n);
+                });
+            }
+            download.pending.clear();
+        }
+
+        total = session.sending_total;
+        to    = chunk || ranged ? agreed.fetch_to : total;
+        if (to > total || session.sending_from < base
+            || session.sending_from > base + download.Held()) {
+            LogError("Bad range", session.sending_from, "to", to);
+            return ReturnCode::BadRequest;
+        }
+        pi        = session.sending_from;
+        ack_every = (agreed.features & Protocal::Feature_Ack)
+                      ? agreed.ack_every
+                      : 0;
+        acked     = pi;
+
+        LogInfo("to process from", session.sending_from, "to", to,
+                "of a total", total, batched ? "batched" : "");
+        return ReturnCode::Success;
+    }
+
+    // Step 3. Recv loop, a frame at a time while there are more to come.
+    // A frame is read whole before it is added to the payload, so a
+    // connection dropped mid frame never counts as seen.
+    bool More() const { return pi < to; }
+
+    // If each frame starts with a DataBatch, rather than being 1 int.
+    bool Batched() const { return batched; }
+
+    // Makes room for the next frame, of n ints.
+    ReturnCode Expect(uint32_t n)
+    {
+        if (batched
+            && (!n || n > options.batch_max || n > to - pi
+                || (chunk && pi / chunk != (pi + n - 1) / chunk))) {
+            LogError("Bad DataBatch of", n, "at packet", pi);
+            return ReturnCode::BadRequest;
+        }
+        frame.resize(n);
+        return ReturnCode::Success;
+    }
+
+    // Where the frame is read in to.
+    void* Frame() { return frame.data(); }
+    size_t FrameSize() const { return frame.size() * sizeof(uint32_t); }
+
+    // Once the frame has been read in.
+    void Received()
+    {
+        auto& out_payload = download.payload;
+        auto frame_from   = pi;
+        for (auto& p : frame) {
+            p += FaultInjection::FlakyData();
+            if (!streamed) {
+                if (pi - base < out_payload.Size()) {
+                    out_payload[pi - base] = p;
+                } else {
+                    out_payload.Append(p);
+                }
+            }
+            LogTrace("packet", pi, ", value of ", p);
+            ++pi;
+        }
+        if (streamed) {
+            download.Stage(frame_from, frame);
+        } else if (!ranged) {
+            download.checksum.Update(out_payload.Data() + frame_from,
+                                     frame.size());
+        }
+    }
+
+    // If a ChunkChecksum follows the frame.
+    bool ChunkDue() const { return chunk && (pi % chunk == 0 || pi == total); }
+
+    // The ChunkChecksum, with the server's checksum of the chunk.
+    ReturnCode Chunk(uint32_t remote)
+    {
+        // ranges start on a chunk, so hold all of it.
+        auto from = (pi - 1) / chunk * chunk;
+        auto good = true;
+        if (!streamed) {
+            good = remote
+                   == Common::Crc32c(download.payload.Data() + from - base,
+                                     (pi - from) * sizeof(uint32_t));
+        } else if (download.sink->Committed() == from) {
+            // a chunk resumed part way through can't be checked.
+            good = remote
+                   == Common::Crc32c(download.pending.data(),
+                                     download.pending.size()
+                                       * sizeof(uint32_t));
+        }
+        if (!good) {
+            LogError("(" + uuid + ")", "Chunk", from, "to", pi,
+                     "failed its checksum");
+        }
+        download.ChunkChecked(from, pi, good);
+        if (streamed && !good) {
+            // fetched again from the chunk, as nothing after it can be
+            // handed on before it.
+            return ReturnCode::CorruptedDownload;
+        }
+        return ReturnCode::Success;
+    }
+
+    // After each frame, and its ChunkChecksum.
+    ReturnCode Next()
+    {
+        if (streamed && (!chunk || pi % chunk == 0 || pi == total)) {
+            download.Commit();
+        }
+        download.Save();
+
+        if (FaultInjection::FlakyConnection()) {
+            LogError("(" + uuid + ")", "Fault injecting connection fail");
+            return ReturnCode::ConnectionFailure;
+        }
+        return ReturnCode::Success;
+    }
+
+    // Ints between the Acks asked for. A streamed download only keeps whole
+    // chunks, so can't Ack more often than once a chunk.
+    uint32_t AckEvery() const
+    {
+        uint64_t every = options.ack_every;
+        if (download.sink && options.chunk_size) {
+            auto chunks = (every + options.chunk_size - 1) / options.chunk_size;
+            every       = chunks * options.chunk_size;
+        }
+        return static_cast<uint32_t>(min<uint64_t>(every, UINT32_MAX));
+    }
+
+    // If the server is owed an Ack, after Next. Not after the last frame, as
+    // the server is finished with the connection by then.
+    bool AckDue() const
+    {
+        return ack_every && More() && Kept() / ack_every > acked / ack_every;
+    }
+
+    // How far the server can resume from. Only what is kept counts, so a
+    // streamed chunk still being checked is sent again after a reconnect.
+    Protocal::Ack Ack()
+    {
+        acked = Kept();
+        return { acked };
+    }
+
+    // Step 4. The DataComplete, once there are no more frames.
+    ReturnCode Complete(const Protocal::DataComplete& complete)
+    {
+        if (ranged) {
+            download.range_algo     = algo;
+            download.range_checksum = complete.checksum;
+            return download.bad_ranges.empty() ? ReturnCode::Success
+                                                : ReturnCode::CorruptedDownload;
+        }
+
+        // Step 5. Compare checksums.
+        // A re-fetch only covers part of the payload, the rest is as before.
+        auto& checksum = download.checksum;
+        if (!streamed) {
+            checksum.SeekTo(total, download.payload.Data());
+        }
+        LogInfo("local", Common::ToString(algo), "checksum", checksum.Value(),
+                ", remote checksum", complete.checksum);
+        return checksum.Value() == complete.checksum
+                 ? ReturnCode::Success
+                 : ReturnCode::CorruptedDownload;
+    }
+
+  private:
+    uint32_t Kept() const { return min(pi, base + download.Held()); }
+
+    const string& uuid;
+    uint32_t N;
+    Download& download;
+    const Options& options;
+    uint32_t base;
+
+    bool batched              = false;
+    uint32_t chunk            = 0;
+    bool ranged               = false;
+    bool streamed             = false;
+    Common::ChecksumAlgo algo = Common::ChecksumAlgo::Legacy;
+    uint32_t total            = 0;
+    uint32_t to               = 0;
+    uint32_t pi               = 0; // the next int to arrive
+    uint32_t ack_every        = 0;
+    uint32_t acked            = 0;
+
+    vector<uint32_t> frame;
+};
+
+ReturnCode ProcessTransmission(INetStream* stream, const string& uuid, uint32_t N,
+                               Download& download, const Options& options = {})
+{
+    Transfer transfer(uuid, N, download, options);
+    try {
+        // Reads come out of a buffer filled with as much as the socket has,
+        // rather than a recv per int.
+        BufferedStream buffered(*stream);
+        auto conn = TSerialToStream{ buffered };
+
+        vector<char> login;
+        auto result = transfer.Login(login);
+        if (result != ReturnCode::Success) {
+            return result;
+        }
+        buffered.SendN(login.size(), login.data());
+        conn.Flush();
+
+        Protocal::Hello agreed{};
+        if (transfer.SendsHello()) {
+            agreed = Protocal::RecvHello(conn);
+        }
+        result = transfer.Confirmed(
+          agreed, conn.RecvN<Protocal::LoginConfirmed>());
+        if (result != ReturnCode::Success) {
+            return result;
+        }
+
+        while (transfer.More()) {
+            uint32_t n = 1;
+            if (transfer.Batched()) {
+                n = conn.RecvN<Protocal::DataBatch>().count;
+            }
+            if ((result = transfer.Expect(n)) != ReturnCode::Success) {
+                return result;
+            }
+            buffered.RecvN(transfer.FrameSize(), transfer.Frame());
+            transfer.Received();
+
+            if (transfer.ChunkDue()) {
+                auto remote = conn.RecvN<Protocal::ChunkChecksum>().checksum;
+                if ((result = transfer.Chunk(remote)) != ReturnCode::Success) {
+                    return result;
+                }
+            }
+            if ((result = transfer.Next()) != ReturnCode::Success) {
+                return result;
+            }
+            if (transfer.AckDue()) {
+                conn.SendN(transfer.Ack());
+                conn.Flush();
+            }
+        }
+
+        return transfer.Complete(conn.RecvN<Protocal::DataComplete>());
+
+    } catch (socket_close_exception e) {
+        return ReturnCode::ConnectionFailure;
+    } catch (runtime_error& e) {
+        LogError("Protocol error", e.what());
+        return ReturnCode::BadRequest;
+    }
+}
+
+// How long to wait before reconnecting. The first reconnect after a
+// connection that got somewhere is straight away, as most drops are one
+// offs. Each after that waits twice as long as the last, from first_delay up
+// to max_delay, less a random part of up to jitter of it, so clients dropped
+// together don't all come back together.
+struct Backoff
+{
+    chrono::milliseconds first_delay = 100ms;
+    chrono::milliseconds max_delay   = 10s;
+    double jitter                    = 0.5;
+
+    // Failures in a row before giving up, -1 for never.
+    int max_failures = -1;
+
+    // failures is how many connections in a row have failed.
+    bool GivesUp(int failures) const
+    {
+        return max_failures >= 0 && failures > max_failures;
+    }
+
+    chrono::milliseconds Delay(int failures) const
+    {
+        if (failures <= 1) {
+            return 0ms;
+        }
+        auto delay = first_delay;
+        for (int i = 2; i < failures && delay < max_delay; ++i) {
+            delay *= 2;
+        }
+        thread_local mt19937_64 rng{ random_device{}() };
+        uniform_real_distribution<double> keep(1 - clamp(jitter, 0.0, 1.0), 1);
+        return chrono::duration_cast<chrono::milliseconds>(
+          min(delay, max_delay) * keep(rng));
+    }
+};
+
+// What Fetch does around each connection: carrying on from a Checkpoint,
+// saying what is re-fetched, and whether to go again.
+class Attempts
+{
+  public:
+    Attempts(const string& uuid, uint32_t n, const Options& options,
+             Download& download)
+      : uuid{ uuid }
+      , n{ n }
+      , options{ options }
+      , download{ download }
+      , refetches_failed{ 0 }
+      , refetching{ false }
+      , failures{ 0 }
+      , held{ 0 }
+    {
+        if (!options.checkpoint_dir.empty() && !download.checkpoint
+            && !download.sink) {
+            try {
+                download.KeepIn(options.checkpoint_dir, uuid, n);
+            } catch (runtime_error& e) {
+                LogError("(" + uuid + ")", e.what(), ", carrying on without");
+            }
+        }
+    }
+
+    // Before each connection.
+    void Begin()
+    {
+        // A re-fetch that comes back bad again counts towards giving up.
+        refetching = !download.bad_ranges.empty()
+                     && (download.Received(n) || download.sink);
+        range      = refetching ? download.bad_ranges.front()
+                                : pair<uint32_t, uint32_t>{};
+        if (refetching) {
+            LogInfo("Re-fetching", range.first, "to", range.second);
+        }
+        held = download.Held();
+    }
+
+    // After each connection, with what it came to. True to go again, after
+    // reconnecting if it was a ConnectionFailure.
+    bool Again(ReturnCode result)
+    {
+        if (result != ReturnCode::ConnectionFailure) {
+            failures = 0;
+        } else {
+            failures = download.Held() > held ? 1 : failures + 1;
+        }
+        if (refetching && result != ReturnCode::ConnectionFailure
+            && !download.bad_ranges.empty()
+            && download.bad_ranges.front().first == range.first) {
+            ++refetches_failed;
+        }
+        return result == ReturnCode::ConnectionFailure
+               || (result == ReturnCode::CorruptedDownload
+                   && !download.bad_ranges.empty()
+                   && refetches_failed < options.max_refetches);
+    }
+
+    // Connections in a row that have failed, 1 if the last failed after
+    // getting somewhere, for a Backoff.
+    int Failures() const { return failures; }
+
+    // Once there are no more connections, with what the last came to.
+    ReturnCode Finish(ReturnCode result)
+    {
+        // a range's checksum is only checked once all have arrived.
+        if (result != ReturnCode::ConnectionFailure && !download.IsRange()) {
+            download.Forget();
+        }
+        return result;
+    }
+
+  private:
+    const string& uuid;
+    uint32_t n;
+    const Options& options;
+    Download& download;
+
+    int refetches_failed;
+    bool refetching;
+    pair<uint32_t, uint32_t> range;
+
+    int failures;
+    uint32_t held; // when the connection started
+};
+
+// A whole download of n ints as uuid, resuming after connection failures
+// and re-fetching chunks that fail their checksum. Fetches only download's
+// range, if it has one.
+// connect opens each connection, and not being able to is a
+// ConnectionFailure like any other. reconnect is called before each resume,
+// with Attempts::Failures, and returning false gives up, with
+// ConnectionFailure.
+// With Options::checkpoint_dir it carries on from, and keeps, a Checkpoint,
+// which is removed once there is no point resuming, so only after giving up
+// on the connection.
+ReturnCode Fetch(const string& uuid, uint32_t n, const Options& options,
+                 const function<unique_ptr<INetStream>()>& connect,
+                 const function<bool(int)>& reconnect, Download& download)
+{
+    Attempts attempts(uuid, n, options, download);
+    auto result = ReturnCode::Success;
+    do {
+        if (result == ReturnCode::ConnectionFailure
+            && !reconnect(attempts.Failures())) {
+            break;
+        }
+        attempts.Begin();
+        unique_ptr<INetStream> conn;
+        try {
+            conn = connect();
+        } catch (runtime_error& e) {
+            LogTrace("(" + uuid + ")", e.what());
+            result = ReturnCode::ConnectionFailure;
+            continue;
+        }
+        result = ProcessTransmission(conn.get(), uuid, n, download, options);
+        conn->Close();
+    } while (attempts.Again(result));
+    return attempts.Finish(result);
+}
+
+ReturnCode Fetch(const string& uuid, uint32_t n, const Options& options,
+                 const function<unique_ptr<INetStream>()>& connect,
+                 const function<bool(int)>& reconnect)
+{
+    Download download;
+    return Fetch(uuid, n, options, connect, reconnect, download);
+}
+
+// Fetch, with the ints handed to sink as they are checked rather than kept,
+// so memory use is the same whatever n is. Carries on after whatever sink
+// already holds.
+ReturnCode FetchTo(ISink& sink, const string& uuid, uint32_t n,
+                   const Options& options,
+                   const function<unique_ptr<INetStream>()>& connect,
+                   const function<bool(int)>& reconnect)
+{
+    Download download;
+    download.sink = &sink;
+    auto result   = Fetch(uuid, n, options, connect, reconnect, download);
+    try {
+        sink.Flush();
+    } catch (runtime_error& e) {
+        LogError("(" + uuid + ")", e.what());
+        return ReturnCode::BadRequest;
+    }
+    return result;
+}
+
+// Fetch, with the payload split in to 'ranges' ranges fetched at once, each
+// over connections of its own, so at the same per connection rate a large
+// download takes about 1/ranges the time. connect and reconnect are called
+// from every range's thread.
+// Ranges start on a chunk, so each chunk is checked by one range. The
+// DataComplete checksum can only be checked once all are put back together.
+// With CRC32C each range's CRC is taken on its own thread as it finishes,
+// and they are joined with Crc32cCombine.
+// A server that doesn't do ranges gets a plain Fetch.
+ReturnCode FetchRanges(const string& uuid, uint32_t n, int ranges,
+                       const Options& options,
+                       const function<unique_ptr<INetStream>()>& connect,
+                       const function<bool(int)>& reconnect)
+{
+    ranges         = max(1, ranges);
+    uint64_t align = max<uint32_t>(1, options.chunk_size);
+    auto each      = ((uint64_t(n) + ranges - 1) / ranges + align - 1) / align
+                * align;
+    if (!options.batch_max || each >= n) {
+        return Fetch(uuid, n, options, connect, reconnect);
+    }
+
+    vector<Download> parts;
+    for (uint64_t from = 0; from < n; from += each) {
+        Download part;
+        part.from = static_cast<uint32_t>(from);
+        part.to   = static_cast<uint32_t>(min<uint64_t>(n, from + each));
+        parts.push_back(move(part));
+    }
+    LogInfo("(" + uuid + ")", "fetching in", parts.size(), "ranges");
+
+    vector<future<ReturnCode>> fetches;
+    vector<uint32_t> crcs(parts.size());
+    for (size_t i = 0; i < parts.size(); ++i) {
+        fetches.push_back(async(launch::async, [&, i] {
+            auto& part = parts[i];
+            auto r     = Fetch(uuid, n, options, connect, reconnect, part);
+            if (r == ReturnCode::Success
+                && part.range_algo == Common::ChecksumAlgo::Crc32c) {
+                crcs[i] = Common::Crc32c(part.payload.Data(),
+                                         part.payload.Size()
+                                           * sizeof(uint32_t));
+            }
+            return r;
+        }));
+    }
+    auto result  = ReturnCode::Success;
+    auto refused = false;
+    for (size_t i = 0; i < parts.size(); ++i) {
+        auto r = fetches[i].get();
+        refused |= parts[i].range_refused;
+        if (result == ReturnCode::Success) {
+            result = r;
+        }
+    }
+    auto forget = [&] {
+        for (auto& part : parts) {
+            part.Forget();
+        }
+    };
+    if (refused) {
+        LogInfo("(" + uuid + ")", "fetching it whole instead");
+        forget();
+        return Fetch(uuid, n, options, connect, reconnect);
+    }
+    if (result != ReturnCode::ConnectionFailure) {
+        forget();
+    }
+    if (result != ReturnCode::Success) {
+        return result;
+    }
+
+    auto remote = parts.front().range_checksum;
+    auto same   = true;
+    for (auto& part : parts) {
+        same &= part.range_checksum == remote;
+    }
+    auto algo      = parts.front().range_algo;
+    uint32_t local = 0;
+    if (algo == Common::ChecksumAlgo::Crc32c) {
+        local = crcs.front();
+        for (size_t i = 1; i < parts.size(); ++i) {
+            local = Common::Crc32cCombine(
+              local, crcs[i], parts[i].payload.Size() * sizeof(uint32_t));
+        }
+    } else {
+        // serial, so each range in turn, in place.
+        Common::RunningChecksum checksum(algo, n);
+        for (auto& part : parts) {
+            checksum.Update(part.payload.Data(), part.payload.Size());
+        }
+        local = checksum.Value();
+    }
+    if (!same) {
+        LogError("(" + uuid + ")", "Ranges disagree on the checksum");
+    }
+    LogInfo("local", Common::ToString(algo), "checksum", local,
+            ", remote checksum", remote);
+    return same && local == remote ? ReturnCode::Success
+                                   : ReturnCode::CorruptedDownload;
+}
+
+#ifdef ABLY_ASYNC
+// ProcessTransmission, as a coroutine on socket's EventLoop.
+Async::Task<ReturnCode> ProcessTransmission(Async::Socket& socket,
+                                            const string& uuid, uint32_t N,
+                                            Download& download,
+                                            const Options& options)
+{
+    Transfer transfer(uuid, N, download, options);
+    try {
+        vector<char> login;
+        auto result = transfer.Login(login);
+        if (result != ReturnCode::Success) {
+            co_return result;
+        }
+        co_await socket.Write(login.data(), login.size());
+
+        Protocal::Hello agreed{};
+        if (transfer.SendsHello()) {
+            char hello[Protocal::g_hello_max_size];
+            co_await socket.Read(hello, Protocal::g_hello_header_size);
+            auto size = Protocal::HelloSize(hello);
+            co_await socket.Read(hello + Protocal::g_hello_header_size,
+                                 size - Protocal::g_hello_header_size);
+            agreed = Protocal::DecodeHello(hello);
+        }
+        Protocal::LoginConfirmed session;
+        co_await socket.Read(&session, sizeof(session));
+        if ((result = transfer.Confirmed(agreed, session))
+            != ReturnCode::Success) {
+            co_return result;
+        }
+
+        while (transfer.More()) {
+            uint32_t n = 1;
+            if (transfer.Batched()) {
+                Protocal::DataBatch batch;
+                co_await socket.Read(&batch, sizeof(batch));
+                n = batch.count;
+            }
+            if ((result = transfer.Expect(n)) != ReturnCode::Success) {
+                co_return result;
+            }
+            co_await socket.Read(transfer.Frame(), transfer.FrameSize());
+            transfer.Received();
+
+            if (transfer.ChunkDue()) {
+                Protocal::ChunkChecksum remote;
+                co_await socket.Read(&remote, sizeof(remote));
+                if ((result = transfer.Chunk(remote.checksum))
+                    != ReturnCode::Success) {
+                    co_return result;
+                }
+            }
+            if ((result = transfer.Next()) != ReturnCode::Success) {
+                co_return result;
+            }
+            if (transfer.AckDue()) {
+                auto ack = transfer.Ack();
+                co_await socket.Write(&ack, sizeof(ack));
+            }
+        }
+
+        Protocal::DataComplete complete;
+        co_await socket.Read(&complete, sizeof(complete));
+        co_return transfer.Complete(complete);
+
+    } catch (socket_close_exception&) {
+        co_return ReturnCode::ConnectionFailure;
+    } catch (runtime_error& e) {
+        LogError("Protocol error", e.what());
+        co_return ReturnCode::BadRequest;
+    }
+}
+
+// Fetch, as a coroutine on loop, over TCP to the server on this host. Many
+// can run at once on the one thread that runs loop, each with a connection
+// of its own, and waiting on a Sleep between connections, rather than
+// blocking. With a sink, it is FetchTo.
+// Not being able to connect is a ConnectionFailure like any other, so it
+// is tried again.
+Async::Task<ReturnCode> FetchAsync(Async::EventLoop& loop, string uuid,
+                                   uint32_t n, Options options,
+                                   Backoff backoff = {},
+                                   ISink* sink     = nullptr)
+{
+    Download download;
+    download.sink = sink;
+    Attempts attempts(uuid, n, options, download);
+    auto result = ReturnCode::Success;
+    do {
+        if (result == ReturnCode::ConnectionFailure) {
+            if (backoff.GivesUp(attempts.Failures())) {
+                break;
+            }
+            auto delay = backoff.Delay(attempts.Failures());
+            LogInfo("(" + uuid + ")", "Connection failure, reconnecting in",
+                    delay.count(), "ms");
+            co_await loop.Sleep(delay);
+        }
+        attempts.Begin();
+
+        unique_ptr<Async::Socket> socket;
+        try {
+            socket = co_await Async::Socket::Connect(loop, "localhost",
+                                                     Protocal::g_port_number);
+        } catch (runtime_error& e) {
+            LogTrace("(" + uuid + ")", e.what());
+            result = ReturnCode::ConnectionFailure;
+            continue;
+        }
+        result = co_await ProcessTransmission(*socket, uuid, n, download,
+                                              options);
+    } while (attempts.Again(result));
+    result = attempts.Finish(result);
+
+    if (sink) {
+        try {
+            sink->Flush();
+        } catch (runtime_error& e) {
+            LogError("(" + uuid + ")", e.what());
+            co_return ReturnCode::BadRequest;
+        }
+    }
+    co_return result;
+}
+#endif // ABLY_ASYNC
+
+// -batch_max, -checksum, -chunk_size, -checkpoint_dir and -ack_every.
+Options OptionsFromArgs(int argc, const char** argv)
+{
+    Options options;
+    options.batch_max = Common::GetIntArg("-batch_max", argc, argv,
+                                          options.batch_max);
+    if (auto arg = Common::GetArg("-checksum", argc, argv); arg) {
+        options.checksum = 0 == strcmp(arg, "legacy")
+                             ? Common::ChecksumAlgo::Legacy
+                             : Common::ChecksumAlgo::Crc32c;
+    }
+    options.chunk_size = Common::GetIntArg("-chunk_size", argc, argv,
+                                           options.chunk_size);
+    if (auto arg = Common::GetArg("-checkpoint_dir", argc, argv); arg) {
+        options.checkpoint_dir = arg;
+    }
+    options.ack_every = Common::GetIntArg("-ack_every", argc, argv,
+                                          options.ack_every);
+    return options;
+}
+
+// -backoff_ms, -backoff_max_ms, -backoff_jitter (a percent) and
+// -max_reconnects.
+Backoff BackoffFromArgs(int argc, const char** argv)
+{
+    Backoff backoff;
+    auto first  = Common::GetIntArg("-backoff_ms", argc, argv,
+                                   (int)backoff.first_delay.count());
+    auto most   = Common::GetIntArg("-backoff_max_ms", argc, argv,
+                                  (int)backoff.max_delay.count());
+    auto jitter = Common::GetIntArg("-backoff_jitter", argc, argv,
+                                    (int)(backoff.jitter * 100));
+    backoff.first_delay  = chrono::milliseconds(first);
+    backoff.max_delay    = chrono::milliseconds(most);
+    backoff.jitter       = jitter / 100.0;
+    backoff.max_failures = Common::GetIntArg("-max_reconnects", argc, argv,
+                                             backoff.max_failures);
+    return backoff;
+}
+
+// A connection to the server on this host, over the first of transport's
+// streams that connects. auto tries a unix socket, then TCP, so a server
+// without local listeners is still reached. Shared memory is only used when
+// asked for, as the server runs each such session on a thread of its own,
+// even with a reactor.
+unique_ptr<INetStream> Connect(const string& transport, const string& io)
+{
+    auto port = Protocal::g_port_number;
+#ifdef __linux__
+    if (transport == "shm") {
+        try {
+            auto stream = ShmStream::Join(UnixConnect(LocalName(port, "shm")));
+            LogInfo("Connected over shared memory");
+            return stream;
+        } catch (runtime_error& e) {
+            LogTrace("No shared memory,", e.what());
+            throw;
+        }
+    }
+    if (transport == "unix" || transport == "auto") {
+        try {
+            auto stream = MakeStream(io, UnixConnect(LocalName(port, "unix")));
+            LogInfo("Connected over a unix socket");
+            return stream;
+        } catch (runtime_error& e) {
+            if (transport == "unix") {
+                throw;
+            }
+            LogTrace("No unix socket,", e.what());
+        }
+    }
+#endif
+    return MakeStream(io, TCPStream("localhost", port));
+}
+
+// Sessions sharing one connection to the server, see Protocal::MuxFrame, so
+// many at once don't each need a connection of their own.
+// The connection is made on the first Open, and again once it breaks. A
+// server that doesn't multiplex is remembered, and each Open is then a
+// connection of its own, as it would be without this.
+class Multiplexer
+{
+  public:
+    // connect must give a stream that can be read on one thread while sent
+    // on others, so not an io_uring one.
+    Multiplexer(function<unique_ptr<INetStream>()> connect)
+      : connect{ move(connect) }
+      , unsupported{ false }
+    {}
+
+    // A stream for one session, as Fetch's connect.
+    unique_ptr<INetStream> Open()
+    {
+        lock_guard<mutex> scope_guard(lock);
+        if (!unsupported && (!mux || mux->Broken())) {
+            mux.reset();
+            auto stream = connect();
+            try {
+                if (Handshake(*stream)) {
+                    mux = make_shared<MuxConnection>(move(stream), false);
+                } else {
+                    LogInfo("Server does not multiplex, a connection each");
+                    unsupported = true;
+                    stream->Close();
+                }
+            } catch (socket_close_exception&) {
+                // the session fails on this, and reconnects as usual.
+                return stream;
+            } catch (runtime_error& e) {
+                LogInfo("Server does not multiplex,", e.what());
+                unsupported = true;
+                stream->Close();
+            }
+        }
+        return unsupported ? connect() : mux->Open();
+    }
+
+  private:
+    // True if the server agreed to multiplex.
+    static bool Handshake(INetStream& stream)
+    {
+        auto conn = TSerialToStream{ stream };
+        conn.SendN(Protocal::MakeHello(Protocal::Feature_Mux));
+        conn.SendN(Protocal::LoginRequest{});
+        conn.Flush();
+
+        auto agreed = Protocal::RecvHello(conn);
+        conn.RecvN<Protocal::LoginConfirmed>();
+        return (agreed.features & Protocal::Feature_Mux) != 0;
+    }
+
+    function<unique_ptr<INetStream>()> connect;
+
+    mutex lock;
+    shared_ptr<MuxConnection> mux;
+    bool unsupported;
+};
+
+int main(int argc, const char** argv)
+{
+    string uuid = "";
+    auto named  = Common::GetArg("-uuid", argc, argv);
+    if (named) {
+        uuid = named;
+    } else {
+        uuid = Common::RandomUUID(40);
+    }
+
+    auto options = OptionsFromArgs(argc, argv);
+    if (!options.checkpoint_dir.empty() && !named) {
+        LogMessage("A checkpoint is only found again with the same -uuid");
+    }
+
+    // a restarted download is the size it was.
+    auto n = Common::GetIntArg("-n", argc, argv, 0);
+    if (!n && named && !options.checkpoint_dir.empty()) {
+        n = static_cast<int>(Checkpoint::SizeOf(
+          Checkpoint::PathFor(options.checkpoint_dir, uuid, 0)));
+    }
+    if (!n) {
+        random_device rng;
+        uniform_int_distribution<int> dist(1, 0xffff);
+        n = dist(rng);
+    }
+
+    string io = "blocking";
+    if (auto arg = Common::GetArg("-io", argc, argv); arg) {
+        io = arg;
+    }
+
+    string transport = "auto";
+    if (auto arg = Common::GetArg("-transport", argc, argv); arg) {
+        transport = arg;
+    }
+
+    // -ranges K splits each download over K connections.
+    auto ranges = Common::GetIntArg("-ranges", argc, argv, 1);
+
+    auto backoff   = BackoffFromArgs(argc, argv);
+    auto reconnect = [&](int failures) {
+        if (backoff.GivesUp(failures)) {
+            LogError("Giving up after", failures, "failed connections");
+            return false;
+        }
+        auto delay = backoff.Delay(failures);
+        LogInfo("Connection failure, reconnecting in", delay.count(), "ms");
+        this_thread::sleep_for(delay);
+        return true;
+    };
+    auto report = [](ReturnCode result) {
+        LogMessage("Result", ToString(result));
+    };
+
+    // -async K downloads at once, all on this thread, each over a TCP
+    // connection of its own. Each is -uuid with its index after it, or
+    // random.
+    if (auto count = Common::GetIntArg("-async", argc, argv, 0); count > 0) {
+#ifdef ABLY_ASYNC
+        Async::EventLoop loop;
+        for (int i = 0; i < count; ++i) {
+            auto id =
+              named ? uuid + "-" + to_string(i) : Common::RandomUUID(40);
+            LogInfo("connecting as", quoted(id), ", packets requested ", n);
+            loop.Spawn(FetchAsync(loop, id, n, options, backoff), report);
+        }
+        loop.Run();
+        return 0;
+#else
+        LogError("-async needs a C++20 build");
+        return 1;
+#endif
+    }
+
+    // -mux K downloads at once, all over one connection. Each is -uuid with
+    // its index after it, or random.
+    if (auto count = Common::GetIntArg("-mux", argc, argv, 0); count > 0) {
+        Multiplexer multiplexer([&] { return Connect(transport, "blocking"); });
+        vector<future<ReturnCode>> results;
+        for (int i = 0; i < count; ++i) {
+            auto id =
+              named ? uuid + "-" + to_string(i) : Common::RandomUUID(40);
+            LogInfo("connecting as", quoted(id), ", packets requested ", n);
+            results.push_back(async(launch::async, [&, id] {
+                return FetchRanges(
+                  id, n, ranges, options,
+                  [&] { return multiplexer.Open(); }, reconnect);
+            }));
+        }
+        for (auto& r : results) {
+            report(r.get());
+        }
+        return 0;
+    }
+
+    LogInfo("connecting as", quoted(uuid), ", packets requested ", n);
+
+    auto connect = [&] { return Connect(transport, io); };
+    auto result  = ReturnCode::Success;
+    // -out path appends the ints to path as they arrive, rather than keeping
+    // them, carrying on from whatever it already holds. They go in order, so
+    // never in -ranges.
+    if (auto out = Common::GetArg("-out", argc, argv); out) {
+#ifndef _WIN32
+        try {
+            auto sink = FileSink::Open(out, uuid, n);
+            LogInfo("Writing to", out, ", which holds", sink->Committed());
+            result = FetchTo(*sink, uuid, n, options, connect, reconnect);
+        } catch (runtime_error& e) {
+            LogError(e.what());
+            return 1;
+        }
+#else
+        LogError("-out is not available on this platform");
+        return 1;
+#endif
+    } else {
+        result = FetchRanges(uuid, n, ranges, options, connect, reconnect);
+    }
+    report(result);
+
+    return 0;
+}
+} // namespace Client
+
+// Many client sessions at once from one process, to load test a server.
+// Each session is a Client::Fetch on a worker thread, so the server sees what
+// as many client processes would send it.
+//
+// > Ably bench [-sessions 1..] [-concurrency 1..] [-n fixed:N|uniform:MIN:MAX|exp:MEAN] [-churn 0..100]
+namespace LoadTest {
+using Clock = chrono::steady_clock;
+
+// How many ints each session asks for.
+// "fixed:N", "uniform:MIN:MAX", or "exp:MEAN" for exponential, at least 1.
+class NDistribution
+{
+  public:
+    NDistribution(const string& spec)
+    {
+        auto kind = spec.substr(0, spec.find(':'));
+        vector<uint32_t> values;
+        for (auto at = spec.find(':'); at != string::npos;
+             at      = spec.find(':', at + 1)) {
+            values.push_back(static_cast<uint32_t>(stoul(spec.substr(at + 1))));
+        }
+
+        if (kind == "fixed" && values.size() == 1) {
+            type = Type::Uniform;
+            low = high = values[0];
+        } else if (kind == "uniform" && values.size() == 2) {
+            type = Type::Uniform;
+            low  = values[0];
+            high = values[1];
+        } else if (kind == "exp" && values.size() == 1) {
+            type = Type::Exponential;
+            low = high = values[0];
+        } else {
+            throw runtime_error("Unknown -n " + spec);
+        }
+        if (!low || low > high) {
+            throw runtime_error("Bad -n " + spec);
+        }
+    }
+
+    uint32_t operator()(mt19937_64& rng) const
+    {
+        if (type == Type::Uniform) {
+            return uniform_int_distribution<uint32_t>(low, high)(rng);
+        }
+        auto n = exponential_distribution<double>(1.0 / low)(rng);
+        return static_cast<uint32_t>(clamp(n, 1.0, (double)UINT32_MAX));
+    }
+
+  private:
+    enum class Type
+    {
+        Uniform,
+        Exponential,
+    };
+
+    Type type;
+    uint32_t low;
+    uint32_t high;
+};
+
+// Drops the connection, as a lost connection would, once cut_after bytes
+// have been received, and counts it in cuts. Calls on_data when the first
+// bytes arrive.
+class CutStream : public INetStream
+{
+  public:
+    static constexpr uint64_t g_never = UINT64_MAX;
+
+    CutStream(unique_ptr<INetStream> inner, uint64_t cut_after,
+              uint64_t& cuts, function<void()> on_data)
+      : inner{ move(inner) }
+      , cut_after{ cut_after }
+      , received{ 0 }
+      , cuts{ cuts }
+      , on_data{ move(on_data) }
+    {}
+
+    virtual void SendN(size_t n, const void* data) override
+    {
+        inner->SendN(n, data);
+    }
+
+    virtual void SendV(const IoSlice* slices, size_t count) override
+    {
+        inner->SendV(slices, count);
+    }
+
+    virtual void RecvN(size_t n, void* dst) override
+    {
+        Check(n);
+        inner->RecvN(n, dst);
+        Received(n);
+    }
+
+    virtual size_t RecvSome(size_t max, void* dst) override
+    {
+        Check(1);
+        auto r = inner->RecvSome(
+          static_cast<size_t>(min<uint64_t>(max, cut_after - received)), dst);
+        Received(r);
+        return r;
+    }
+
+    virtual int WaitForDataToRecv(chrono::seconds timeout) override
+    {
+        return inner->WaitForDataToRecv(timeout);
+    }
+
+    virtual void Flush() override { inner->Flush(); }
+    virtual void Close() override { inner->Close(); }
+
+  private:
+    void Check(size_t n)
+    {
+        if (received + n > cut_after) {
+            ++cuts;
+            throw socket_close_exception();
+        }
+    }
+
+    void Received(size_t n)
+    {
+        if (!received && n && on_data) {
+            on_data();
+        }
+        received += n;
+    }
+
+    unique_ptr<INetStream> inner;
+    uint64_t cut_after;
+    uint64_t received;
+    uint64_t& cuts;
+    function<void()> on_data;
+};
+
+struct Plan
+{
+    int sessions    = 1000;
+    int concurrency = 100;
+    NDistribution n{ "uniform:1:65535" };
+
+    // Percent of connections dropped part way, and resumed.
+    int churn = 0;
+
+    // Reconnects a session may make before it is given up on.
+    int max_retries = 10;
+    chrono::milliseconds retry_wait{ 0 };
+
+    string io        = "blocking";
+    string transport = "auto";
+    Client::Options options;
+
+    // With -mux, sessions share these connections, session i the i % size
+    // one.
+    vector<shared_ptr<Client::Multiplexer>> muxes;
+};
+
+// One workers results, merged once every session is done.
+struct Results
+{
+    uint64_t counts[5]      = {}; // by Client::ReturnCode
+    uint64_t connect_errors = 0;
+    uint64_t reconnects     = 0;
+    uint64_t cut            = 0;
+    uint64_t ints           = 0;
+    vector<double> completion_ms;
+    vector<double> resume_ms;
+
+    void Merge(const Results& other)
+    {
+        for (size_t i = 0; i < size(counts); ++i) {
+            counts[i] += other.counts[i];
+        }
+        connect_errors += other.connect_errors;
+        reconnects += other.reconnects;
+        cut += other.cut;
+        ints += other.ints;
+        completion_ms.insert(end(completion_ms), begin(other.completion_ms),
+                             end(other.completion_ms));
+        resume_ms.insert(end(resume_ms), begin(other.resume_ms),
+                         end(other.resume_ms));
+    }
+};
+
+// Takes sessions until all have been started.
+void Work(const Plan& plan, atomic<int>& next, Results& results, uint64_t seed)
+{
+    mt19937_64 rng(seed);
+    using ms = chrono::duration<double, milli>;
+
+    for (int session; (session = next.fetch_add(1)) < plan.sessions;) {
+        auto uuid    = Common::RandomUUID(40);
+        auto n       = plan.n(rng);
+        auto started = Clock::now();
+
+        int retries = 0;
+        Clock::time_point failed;
+        auto resuming = false;
+
+        auto connect = [&] {
+            auto cut_after = CutStream::g_never;
+            if (uniform_int_distribution<int>(1, 100)(rng) <= plan.churn) {
+                // somewhere in the ints, past the login.
+                cut_after = uniform_int_distribution<uint64_t>(
+                  64, 64 + uint64_t(n) * sizeof(uint32_t))(rng);
+            }
+            auto stream =
+              plan.muxes.empty()
+                ? Client::Connect(plan.transport, plan.io)
+                : plan.muxes[session % plan.muxes.size()]->Open();
+            return make_unique<CutStream>(
+              move(stream), cut_after, results.cut, [&] {
+                  if (resuming) {
+                      results.resume_ms.push_back(
+                        ms(Clock::now() - failed).count());
+                      resuming = false;
+                  }
+              });
+        };
+        auto reconnect = [&](int) {
+            failed   = Clock::now();
+            resuming = true;
+            ++results.reconnects;
+            if (plan.retry_wait.count()) {
+                this_thread::sleep_for(plan.retry_wait);
+            }
+            return ++retries <= plan.max_retries;
+        };
+
+        try {
+            auto result =
+              Client::Fetch(uuid, n, plan.options, connect, reconnect);
+            ++results.counts[static_cast<int>(result)];
+            if (result == Client::ReturnCode::Success) {
+                results.ints += n;
+                results.completion_ms.push_back(
+                  ms(Clock::now() - started).count());
+            }
+        } catch (runtime_error& e) {
+            LogError("(" + uuid + ")", e.what());
+            ++results.connect_errors;
+        }
+    }
+}
+
+// The value at quantile q of sorted, 0 if there are none.
+double Quantile(const vector<double>& sorted, double q)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    auto i = static_cast<size_t>(ceil(q * sorted.size()));
+    return sorted[min(sorted.size() - 1, i ? i - 1 : 0)];
+}
+
+string LatencyJson(vector<double>& values)
+{
+    sort(begin(values), end(values));
+    ostringstream json;
+    json << fixed << setprecision(3) << "{\"count\":" << values.size()
+         << ",\"p50\":" << Quantile(values, 0.5)
+         << ",\"p99\":" << Quantile(values, 0.99)
+         << ",\"p999\":" << Quantile(values, 0.999)
+         << ",\"max\":" << (values.empty() ? 0 : values.back()) << '}';
+    return json.str();
+}
+
+int main(int argc, const char** argv)
+{
+    Plan plan;
+    try {
+        if (auto arg = Common::GetArg("-n", argc, argv); arg) {
+            plan.n = NDistribution(arg);
+        }
+    } catch (exception& e) {
+        LogError(e.what());
+        return 1;
+    }
+    plan.sessions = max(1, Common::GetIntArg("-sessions", argc, argv,
+                                             plan.sessions));
+    plan.concurrency =
+      min(plan.sessions, max(1, Common::GetIntArg("-concurrency", argc, argv,
+                                                  plan.concurrency)));
+    plan.churn =
+      clamp(Common::GetIntArg("-churn", argc, argv, plan.churn), 0, 100);
+    plan.max_retries = max(0, Common::GetIntArg("-max_retries", argc, argv,
+                                                plan.max_retries));
+    plan.retry_wait =
+      chrono::milliseconds(max(0, Common::GetIntArg("-retry_ms", argc, argv, 0)));
+    if (auto arg = Common::GetArg("-io", argc, argv); arg) {
+        plan.io = arg;
+    }
+    if (auto arg = Common::GetArg("-transport", argc, argv); arg) {
+        plan.transport = arg;
+    }
+    plan.options = Client::OptionsFromArgs(argc, argv);
+    for (int i = 0; i < Common::GetIntArg("-mux", argc, argv, 0); ++i) {
+        plan.muxes.push_back(make_shared<Client::Multiplexer>(
+          [&plan] { return Client::Connect(plan.transport, "blocking"); }));
+    }
+
+    // thousands of sessions logging each step would swamp the results.
+    if (g_log_level < LogLevel::Trace) {
+        g_log_level = LogLevel::Message;
+    }
+    LogMessage("Running", plan.sessions, "sessions,", plan.concurrency,
+               "at a time, against port", Protocal::g_port_number);
+
+    atomic<int> next{ 0 };
+    vector<Results> results(plan.concurrency);
+    vector<thread> workers;
+    random_device seeds;
+    auto start = Clock::now();
+    for (int i = 0; i < plan.concurrency; ++i) {
+        workers.emplace_back(Work, cref(plan), ref(next), ref(results[i]),
+                             (uint64_t(seeds()) << 32) | seeds());
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+    chrono::duration<double> elapsed = Clock::now() - start;
+
+    Results total;
+    for (auto& r : results) {
+        total.Merge(r);
+    }
+
+    using Client::ReturnCode;
+    auto count = [&](ReturnCode c) { return total.counts[static_cast<int>(c)]; };
+    cout << fixed << setprecision(1) << "{\"bench\":\"load\""
+         << ",\"sessions\":" << plan.sessions
+         << ",\"concurrency\":" << plan.concurrency
+         << ",\"churn\":" << plan.churn
+         << ",\"seconds\":" << elapsed.count()
+         << ",\"succeeded\":" << count(ReturnCode::Success)
+         << ",\"corrupted\":" << count(ReturnCode::CorruptedDownload)
+         << ",\"bad_request\":"
+         << count(ReturnCode::BadRequest) + count(ReturnCode::BadUUID)
+         << ",\"gave_up\":" << count(ReturnCode::ConnectionFailure)
+         << ",\"connect_errors\":" << total.connect_errors
+         << ",\"connections_cut\":" << total.cut
+         << ",\"reconnects\":" << total.reconnects
+         << ",\"ints_per_sec\":" << total.ints / elapsed.count()
+         << ",\"mb_per_sec\":"
+         << total.ints * sizeof(uint32_t) / elapsed.count() / 1e6
+         << ",\"sessions_per_sec\":"
+         << count(ReturnCode::Success) / elapsed.count()
+         << ",\"completion_ms\":" << LatencyJson(total.completion_ms)
+         << ",\"resume_ms\":" << LatencyJson(total.resume_ms) << '}' << endl;
+
+    return count(ReturnCode::Success) == (uint64_t)plan.sessions ? 0 : 1;
+}
+} // namespace LoadTest
+
+// AblyBench.cc builds all of the above in to its own executable, with its own
+// main.
+#ifndef ABLY_NO_MAIN
+int main(int argc, const char** argv)
+{
+    Log(LogLevel::Message, "Simple Int stream server");
+    Log(LogLevel::Trace, vector<string>{ argv, argv + argc });
+#ifdef _WIN32
+    {
+        // start up win sock 2.2 lib
+        WSADATA wsa_data;
+        if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+            LogError("Windows Sockets failed to start");
+            return 1;
+        }
+    }
+#else
+    {
+        // ignore sig pipe.
+        // if the client goes away and this is not ignored, then the server
+        // dissapears (crash, but no segfault).
+        // I deal with send to a broken pipe by reassigning an exception and
+        // closing as required, so I dont need this
+        struct sigaction tmp
+        {
+            SIG_IGN
+        };
+        sigaction(SIGPIPE, &tmp, NULL);
+    }
+#endif
+
+    // Common params
+    Protocal::g_port_number = Common::GetIntArg("-port", argc, argv, 9000);
+    g_log_level =
+      Common::HasArg("-v", argc, argv) ? LogLevel::Trace : LogLevel::Info;
+    if (Common::HasArg("-log_async", argc, argv)) {
+        StartAsyncLog();
+    }
+
+    FaultInjection::g_flaky_connection =
+      Common::GetIntArg("-flaky_connection", argc, argv, 0);
+    if (FaultInjection::g_flaky_connection) {
+        LogError("!!! FLAKY CONNECTION ACTIVE.. 1 in", FaultInjection::g_flaky_connection);
+    }
+    FaultInjection::g_flaky_data =
+      Common::GetIntArg("-flaky_data", argc, argv, 0);
+    if (FaultInjection::g_flaky_data) {
+        LogError("!!! FLAKY DATA ACTIVE.. 1 in", FaultInjection::g_flaky_data);
     }
 
     if (0 == strcmp("client", argv[1])) {
@@ -521,9 +2250,16 @@ int main(int argc, const char** argv)
     if (0 == strcmp("server", argv[1])) {
         Server::main(argc - 1, argv + 1);
     }
+    if (0 == strcmp("state_server", argv[1])) {
+        StateServer::main(argc - 1, argv + 1);
+    }
+    if (0 == strcmp("bench", argv[1])) {
+        return LoadTest::main(argc - 1, argv + 1);
+    }
 
 #ifdef _WIN32
     WSACleanup();
 #endif // _WIN32
     return 0;
 }
+#endif // ABLY_NO_MAIN
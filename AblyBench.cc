@@ -0,0 +1,392 @@
+// Benchmarks for the hot parts of Ably, built as their own executable.
+// Each result is printed as one line of JSON, so runs can be compared between
+// versions.
+//
+// > AblyBench [-filter name] [-ms 1..] [-runs 1..]
+#define ABLY_NO_MAIN
+#include "Ably.cc"
+
+namespace Bench {
+using Clock = chrono::steady_clock;
+
+// How long each timed run is, and how many there are. Every result is the
+// median of the runs, after one run to warm up, so one run the scheduler
+// upset doesn't move it.
+chrono::milliseconds g_duration{ 100 };
+int g_runs = 5;
+
+// Stops the compiler dropping work whose result is otherwise unused.
+volatile uint64_t g_sink;
+
+void Report(const string& name, const vector<pair<string, double>>& fields)
+{
+    cout << "{\"bench\":\"" << name << '"';
+    for (auto& f : fields) {
+        cout << ",\"" << f.first << "\":";
+        if (f.second == floor(f.second)) {
+            cout << (long long)f.second;
+        } else {
+            cout << fixed << setprecision(1) << f.second;
+        }
+    }
+    cout << '}' << endl;
+}
+
+double Median(vector<double> values)
+{
+    sort(begin(values), end(values));
+    return values[values.size() / 2];
+}
+
+// Ops a second, over threads each calling batch until told to stop. batch
+// does some ops, and returns how many. thread is which thread calls it.
+double OpsPerSecond(int threads, const function<uint64_t(int thread)>& batch)
+{
+    vector<double> rates;
+    for (int run = -1; run < g_runs; ++run) {
+        atomic<bool> go{ false };
+        atomic<bool> stop{ false };
+        vector<uint64_t> ops(threads);
+        vector<thread> workers;
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t] {
+                while (!go) {
+                    this_thread::yield();
+                }
+                uint64_t count = 0;
+                while (!stop.load(memory_order_relaxed)) {
+                    count += batch(t);
+                }
+                ops[t] = count;
+            });
+        }
+
+        auto start = Clock::now();
+        go         = true;
+        this_thread::sleep_for(g_duration);
+        stop = true;
+        for (auto& w : workers) {
+            w.join();
+        }
+        chrono::duration<double> elapsed = Clock::now() - start;
+
+        if (run >= 0) {
+            rates.push_back(accumulate(begin(ops), end(ops), 0.0)
+                            / elapsed.count());
+        }
+    }
+    return Median(rates);
+}
+
+// Common::ComputeChecksum over n ints.
+void Checksum(Common::ChecksumAlgo algo, uint32_t n)
+{
+    vector<uint32_t> data(n);
+    PayloadGen::Fill(7, 0, n, data.data());
+
+    auto rate = OpsPerSecond(1, [&](int) {
+        g_sink = Common::ComputeChecksum(algo, data.data(), n);
+        return 1;
+    });
+    Report("checksum", { { "algo", (double)algo },
+                         { "n", (double)n },
+                         { "ns_per_call", 1e9 / rate },
+                         { "mb_per_sec", rate * n * sizeof(uint32_t) / 1e6 } });
+}
+
+// Making n ints, on their own, and as a whole stored Payload.
+void PayloadGeneration(uint32_t n)
+{
+    vector<uint32_t> out(n);
+    auto fill = OpsPerSecond(1, [&](int) {
+        PayloadGen::Fill(g_sink, 0, n, out.data());
+        return 1;
+    });
+    Report("payload_fill", { { "n", (double)n },
+                             { "ns_per_call", 1e9 / fill },
+                             { "ints_per_sec", fill * n } });
+
+    auto stored = OpsPerSecond(1, [&](int) {
+        g_sink = Payload::Stored(g_sink, n)->Size();
+        return 1;
+    });
+    Report("payload_stored", { { "n", (double)n },
+                               { "ns_per_call", 1e9 / stored },
+                               { "ints_per_sec", stored * n } });
+}
+
+void ReportThreaded(const string& name, size_t shards, int threads,
+                    double rate)
+{
+    Report(name, { { "shards", (double)shards },
+                   { "threads", (double)threads },
+                   { "ops_per_sec", rate },
+                   { "ns_per_op", 1e9 * threads / rate } });
+}
+
+// Many threads resuming, and reporting progress on, 'sessions' transmissions
+// at once. Each op is a GetTransmission, or a progress update through its
+// handle, the mix a resumed session makes.
+void SharedStateContention(size_t shards, int threads, int sessions,
+                           uint32_t n)
+{
+    Server::LocalSharedState state(shards);
+
+    vector<string> ids;
+    auto payload = Payload::Stored(7, n);
+    for (int i = 0; i < sessions; ++i) {
+        ids.push_back("bench-" + to_string(i));
+        state.RegisterNewTransmission(ids.back(), payload);
+    }
+
+    vector<mt19937> rngs;
+    for (int t = 0; t < threads; ++t) {
+        rngs.emplace_back(t);
+    }
+    uniform_int_distribution<int> pick(0, sessions - 1);
+
+    auto rate = OpsPerSecond(threads, [&](int t) {
+        auto s = state.GetTransmission(ids[pick(rngs[t])]);
+        for (uint32_t i = 0; i < 8; ++i) {
+            s.progress->Set(s.last_sent + i);
+        }
+        return 9;
+    });
+    ReportThreaded("shared_state_contention", shards, threads, rate);
+}
+
+// Each op on its own: registering new sessions, looking them up, and
+// recording progress by uuid.
+void SharedStateOps(size_t shards, int threads, int sessions)
+{
+    auto payload = Payload::Lazy(7, 0xffff);
+
+    {
+        // fresh ids every op, so the maps grow as a busy server's would.
+        Server::LocalSharedState state(shards);
+        vector<uint64_t> next(threads);
+        auto rate = OpsPerSecond(threads, [&](int t) {
+            state.RegisterNewTransmission(
+              to_string(t) + "-" + to_string(next[t]++), payload);
+            return 1;
+        });
+        ReportThreaded("shared_state_register", shards, threads, rate);
+    }
+
+    Server::LocalSharedState state(shards);
+    vector<string> ids;
+    for (int i = 0; i < sessions; ++i) {
+        ids.push_back("bench-" + to_string(i));
+        state.RegisterNewTransmission(ids.back(), payload);
+    }
+    vector<mt19937> rngs;
+    for (int t = 0; t < threads; ++t) {
+        rngs.emplace_back(t);
+    }
+    uniform_int_distribution<int> pick(0, sessions - 1);
+
+    auto get = OpsPerSecond(threads, [&](int t) {
+        g_sink = state.GetTransmission(ids[pick(rngs[t])]).last_sent;
+        return 1;
+    });
+    ReportThreaded("shared_state_get", shards, threads, get);
+
+    auto set = OpsPerSecond(threads, [&](int t) {
+        state.SetTransmissionLastSent(ids[pick(rngs[t])], t);
+        return 1;
+    });
+    ReportThreaded("shared_state_set", shards, threads, set);
+}
+
+// A trace line with trace off, through the macro, which checks the level
+// first, and through Log, which builds its arguments first.
+void LogDisabled()
+{
+    auto saved  = g_log_level;
+    g_log_level = LogLevel::Error;
+    string uuid = Common::RandomUUID(40);
+
+    auto macro = OpsPerSecond(1, [&](int) {
+        for (uint32_t i = 0; i < 64; ++i) {
+            LogTrace("(" + uuid + ")", "sent packet", i, "value", g_sink);
+        }
+        return 64;
+    });
+    Report("log_disabled_macro", { { "ns_per_call", 1e9 / macro } });
+
+    auto call = OpsPerSecond(1, [&](int) {
+        for (uint32_t i = 0; i < 64; ++i) {
+            Log(LogLevel::Trace, "(" + uuid + ")", "sent packet", i, "value",
+                g_sink);
+        }
+        return 64;
+    });
+    Report("log_disabled_call", { { "ns_per_call", 1e9 / call } });
+    g_log_level = saved;
+}
+
+using StreamPair = pair<unique_ptr<INetStream>, unique_ptr<INetStream>>;
+
+// A connected client and server end, over transport.
+StreamPair Connected(const string& transport)
+{
+#ifdef __linux__
+    if (transport == "tcp") {
+        static TCPStream listener(0);
+        sockaddr_storage address{};
+        socklen_t size = sizeof(address);
+        getsockname(listener.Handle(), reinterpret_cast<sockaddr*>(&address),
+                    &size);
+        auto port = ntohs(reinterpret_cast<sockaddr_in&>(address).sin_port);
+        auto client = make_unique<TCPStream>("localhost", port);
+        return { move(client), make_unique<TCPStream>(listener.Accept()) };
+    }
+
+    int handles[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, handles) != 0) {
+        throw runtime_error("socketpair failed");
+    }
+    if (transport == "unix") {
+        return { make_unique<TCPStream>(TCPStream::FromHandle(handles[0])),
+                 make_unique<TCPStream>(TCPStream::FromHandle(handles[1])) };
+    }
+    if (transport == "shm") {
+        auto server = ShmStream::Offer(TCPStream::FromHandle(handles[1]));
+        return { ShmStream::Join(TCPStream::FromHandle(handles[0])),
+                 move(server) };
+    }
+#endif
+    return PipeStream::MakePair();
+}
+
+// Whole downloads of n ints, the server's LocalClientState to the client's
+// ProcessTransmission, unpaced. Over a PipeStream only the protocol is timed,
+// over the others the transport as well.
+void Exchange(uint32_t n, uint32_t batch_max, bool lazy,
+              const string& transport = "pipe")
+{
+    Server::LocalSharedState state;
+    Server::g_lazy_payloads = lazy;
+
+    Client::Options options;
+    options.batch_max = batch_max;
+
+    uint64_t failed = 0;
+    auto rate       = OpsPerSecond(1, [&](int) {
+        auto ends = Connected(transport);
+        auto uuid = Common::RandomUUID(40);
+        Server::LocalClientState server(move(ends.second), &state);
+
+        Client::Download download;
+        auto result = Client::ProcessTransmission(ends.first.get(), uuid, n,
+                                                  download, options);
+        ends.first->Close();
+        failed += result != Client::ReturnCode::Success;
+        return 1;
+    });
+    Server::g_lazy_payloads = false;
+
+    Report(transport == "pipe" ? "exchange" : "exchange_" + transport,
+           { { "n", (double)n },
+             { "batch_max", (double)batch_max },
+             { "lazy", (double)lazy },
+             { "failed", (double)failed },
+             { "us_per_exchange", 1e6 / rate },
+             { "ints_per_sec", rate * n } });
+}
+
+// Exchange, with the ints handed to a Client::CallbackSink as they are
+// checked, rather than kept.
+void ExchangeToSink(uint32_t n, uint32_t batch_max)
+{
+    Server::LocalSharedState state;
+
+    Client::Options options;
+    options.batch_max = batch_max;
+
+    uint64_t failed = 0;
+    auto rate       = OpsPerSecond(1, [&](int) {
+        auto ends = Connected("pipe");
+        auto uuid = Common::RandomUUID(40);
+        Server::LocalClientState server(move(ends.second), &state);
+
+        Client::CallbackSink sink([](uint64_t, const uint32_t* ints, size_t) {
+            g_sink = ints[0];
+        });
+        Client::Download download;
+        download.sink = &sink;
+        auto result   = Client::ProcessTransmission(ends.first.get(), uuid, n,
+                                                    download, options);
+        ends.first->Close();
+        failed += result != Client::ReturnCode::Success;
+        return 1;
+    });
+
+    Report("exchange_sink", { { "n", (double)n },
+                              { "batch_max", (double)batch_max },
+                              { "failed", (double)failed },
+                              { "us_per_exchange", 1e6 / rate },
+                              { "ints_per_sec", rate * n } });
+}
+} // namespace Bench
+
+int main(int argc, const char** argv)
+{
+    g_log_level = LogLevel::Error;
+
+    string filter;
+    if (auto arg = Common::GetArg("-filter", argc, argv); arg) {
+        filter = arg;
+    }
+    Bench::g_duration = chrono::milliseconds(
+      max(1, Common::GetIntArg("-ms", argc, argv, 100)));
+    Bench::g_runs = max(1, Common::GetIntArg("-runs", argc, argv, 5));
+    auto wanted   = [&](const string& name) {
+        return name.find(filter) != string::npos;
+    };
+
+    if (wanted("checksum")) {
+        for (auto algo :
+             { Common::ChecksumAlgo::Legacy, Common::ChecksumAlgo::Crc32c }) {
+            for (uint32_t n : { 1 << 10, 1 << 16, 1 << 20 }) {
+                Bench::Checksum(algo, n);
+            }
+        }
+    }
+    if (wanted("payload")) {
+        Bench::PayloadGeneration(1 << 16);
+    }
+    if (wanted("shared_state_contention")) {
+        for (size_t shards : { 1, 16, 64 }) {
+            for (int threads : { 1, 2, 4, 8, 16 }) {
+                Bench::SharedStateContention(shards, threads, 1024, 0xffff);
+            }
+        }
+    }
+    if (wanted("shared_state_ops")) {
+        for (int threads : { 1, 4, 16 }) {
+            Bench::SharedStateOps(Server::LocalSharedState::g_default_shard_count,
+                                  threads, 1024);
+        }
+    }
+    if (wanted("log_disabled")) {
+        Bench::LogDisabled();
+    }
+    if (wanted("exchange")) {
+        // as fast as the server can send.
+        Server::g_rate  = 1000000000;
+        Server::g_burst = 1 << 16;
+        for (auto lazy : { false, true }) {
+            Bench::Exchange(1 << 16, 4096, lazy);
+        }
+        Bench::Exchange(1 << 12, 0, false);
+        Bench::ExchangeToSink(1 << 16, 4096);
+#ifdef __linux__
+        for (auto transport : { "tcp", "unix", "shm" }) {
+            Bench::Exchange(1 << 16, 4096, false, transport);
+            Bench::Exchange(1 << 20, 4096, false, transport);
+        }
+#endif
+    }
+    return 0;
+}
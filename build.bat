@@ -44,6 +44,7 @@ if NOT DEFINED VCINSTALLDIR (
 )
 
 cl.exe Ably.cc /nologo /O2 /EHsc /std:c++17 /W4 /link /out:Ably.exe
+cl.exe AblyBench.cc /nologo /O2 /EHsc /std:c++17 /W4 /link /out:AblyBench.exe
 
 :end
 pause
\ No newline at end of file
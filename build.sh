@@ -1,3 +1,4 @@
 #!/bin/bash
 
-gcc -O2 -std=c++17 Ably.cc -lstdc++ -lpthread -o Ably
+gcc -O2 -std=c++17 Ably.cc -lstdc++ -lm -lpthread -o Ably
+gcc -O2 -std=c++17 AblyBench.cc -lstdc++ -lm -lpthread -o AblyBench
@@ -0,0 +1,333 @@
+#pragma once
+
+namespace Client {
+// A download's ints, as they arrive. Either in memory, growing as needed, or
+// in memory it is given, such as a Checkpoint's, of a fixed size, where the
+// count is kept up to date as well.
+class PayloadBuffer
+{
+  public:
+    PayloadBuffer()
+      : ints{ nullptr }
+      , count{ 0 }
+      , room{ 0 }
+      , shared_count{ nullptr }
+    {}
+
+    size_t Size() const { return count; }
+    uint32_t* Data() { return ints; }
+    const uint32_t* Data() const { return ints; }
+    uint32_t& operator[](size_t i) { return ints[i]; }
+    const uint32_t* begin() const { return ints; }
+    const uint32_t* end() const { return ints + count; }
+
+    // Makes room for n ints in all.
+    void Reserve(size_t n)
+    {
+        if (n <= room) {
+            return;
+        }
+        if (shared_count) {
+            throw runtime_error("Payload is larger than its checkpoint");
+        }
+        // left uninitialised, as every int is written before it is read.
+        unique_ptr<uint32_t[]> grown(new uint32_t[n]);
+        copy(ints, ints + count, grown.get());
+        owned = move(grown);
+        ints  = owned.get();
+        room  = n;
+    }
+
+    void Append(uint32_t p)
+    {
+        if (count == room) {
+            Reserve(max<size_t>(1024, room * 2));
+        }
+        ints[count++] = p;
+        if (shared_count) {
+            *shared_count = count;
+        }
+    }
+
+    // From now on keeps the ints in memory, room of them, of which the first
+    // *held are already there. *held is kept up to date, after each int.
+    void Attach(uint32_t* memory, size_t room, uint64_t* held)
+    {
+        owned.reset();
+        ints         = memory;
+        count        = static_cast<size_t>(*held);
+        this->room   = room;
+        shared_count = held;
+    }
+
+  private:
+    unique_ptr<uint32_t[]> owned;
+    uint32_t* ints;
+    size_t count;
+    size_t room;
+    uint64_t* shared_count;
+};
+
+#ifndef _WIN32
+// A download kept in a memory mapped file, so a client that dies part way
+// through carries on from where it got to when run again, rather than from 0.
+// The file is a header, the RunningChecksum's snapshots, then the ints
+// themselves, which a PayloadBuffer writes straight in to the mapping. So
+// keeping it costs the receive loop nothing more than a store per int, and a
+// background thread msyncs it every sync_interval. Only then is the count
+// they got to published as synced, in a second msync of the header, as one
+// msync does not order its pages. A restart carries on from synced, so a
+// crash of the client or the machine loses at most that interval.
+// A file for some other download, or of an older version, is started over.
+class Checkpoint
+{
+  public:
+    // The file for uuid's ints from 'from' on, in dir.
+    static string PathFor(const string& dir, const string& uuid, uint32_t from)
+    {
+        char name[40];
+        snprintf(name, sizeof(name), "%016llx-%u.ckpt",
+                 static_cast<unsigned long long>(Common::Fnv1a(uuid)), from);
+        return dir + "/" + name;
+    }
+
+    // The N of the download in path, or 0 if there is none.
+    static uint32_t SizeOf(const string& path)
+    {
+        auto handle = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (handle < 0) {
+            return 0;
+        }
+        Header header{};
+        auto got = read(handle, &header, sizeof(header));
+        close(handle);
+        return got == sizeof(header) && IsCheckpoint(header) ? header.n : 0;
+    }
+
+    // Opens path for uuid's ints [from, to) of N, or makes it.
+    Checkpoint(const string& path, const string& uuid, uint32_t N,
+               uint32_t from, uint32_t to, chrono::milliseconds sync_interval)
+      : path{ path }
+      , file_handle{ open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644) }
+      , running{ true }
+    {
+        if (file_handle < 0) {
+            throw runtime_error("Could not open checkpoint " + path);
+        }
+
+        auto snapshot_max = N / Common::RunningChecksum::g_snapshot_every;
+        map_size          = sizeof(Header) + snapshot_max * sizeof(uint32_t)
+                   + size_t(to - from) * sizeof(uint32_t);
+        auto existing = lseek(file_handle, 0, SEEK_END);
+        if (existing != static_cast<off_t>(map_size)
+            && (ftruncate(file_handle, 0) != 0
+                || ftruncate(file_handle, map_size) != 0)) {
+            close(file_handle);
+            throw runtime_error("Could not size checkpoint " + path);
+        }
+
+        map = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   file_handle, 0);
+        if (map == MAP_FAILED) {
+            close(file_handle);
+            throw runtime_error("Could not map checkpoint " + path);
+        }
+        header    = reinterpret_cast<Header*>(map);
+        snapshots = reinterpret_cast<uint32_t*>(header + 1);
+        ints      = snapshots + snapshot_max;
+
+        if (!IsCheckpoint(*header) || header->n != N || header->from != from
+            || header->to != to || UUIDOf(*header) != uuid
+            || header->synced > to - from
+            || header->snapshot_count > snapshot_max
+            || header->bad_count > g_bad_range_max) {
+            *header = Header{};
+            copy(begin(g_magic), end(g_magic), header->magic);
+            header->version = g_version;
+            header->n       = N;
+            header->from    = from;
+            header->to      = to;
+            copy_n(uuid.data(), min(uuid.size(), sizeof(header->uuid)),
+                   header->uuid);
+            LogInfo("Checkpoint", path, "started");
+        } else {
+            // anything past the last sync may not have reached the disk.
+            auto every             = Common::RunningChecksum::g_snapshot_every;
+            header->count          = header->synced;
+            header->snapshot_count = min<uint32_t>(
+              { header->snapshot_count, header->synced_snapshots,
+                static_cast<uint32_t>(header->synced / every) });
+            LogInfo("Checkpoint", path, "holds", header->count, "of",
+                    to - from, "ints");
+        }
+
+        sync = thread([this, sync_interval] {
+            unique_lock<mutex> wait_lock(sync_lock);
+            while (running) {
+                sync_wake.wait_for(wait_lock, sync_interval);
+                Sync();
+            }
+        });
+    }
+
+    ~Checkpoint()
+    {
+        {
+            lock_guard<mutex> scope_guard(sync_lock);
+            running = false;
+        }
+        sync_wake.notify_one();
+        sync.join();
+
+        Sync();
+        munmap(map, map_size);
+        close(file_handle);
+    }
+
+    Checkpoint(const Checkpoint&) = delete;
+    Checkpoint& operator=(const Checkpoint&) = delete;
+
+    // For a PayloadBuffer to Attach to.
+    uint32_t* Ints() { return ints; }
+    uint64_t* Count() { return &header->count; }
+
+    // Makes checksum what was saved, for a download of N ints.
+    void RestoreChecksum(Common::RunningChecksum& checksum, uint32_t N) const
+    {
+        // only snapshots of ints that are held.
+        auto held = min<size_t>(header->snapshot_count,
+                                header->count
+                                  / Common::RunningChecksum::g_snapshot_every);
+        checksum = Common::RunningChecksum(
+          static_cast<Common::ChecksumAlgo>(header->checksum_algo), N);
+        checksum.Restore(snapshots, held);
+    }
+
+    // Saves any snapshots checksum has that were not saved yet, or forgets
+    // those it has gone back past.
+    void SaveChecksum(const Common::RunningChecksum& checksum)
+    {
+        auto& taken = checksum.Snapshots();
+        auto algo   = static_cast<uint32_t>(checksum.Algo());
+        if (header->checksum_algo != algo) {
+            header->checksum_algo  = algo;
+            header->snapshot_count = 0;
+        }
+        auto saved = min<size_t>(header->snapshot_count, taken.size());
+        copy(taken.begin() + saved, taken.end(), snapshots + saved);
+        header->snapshot_count = static_cast<uint32_t>(taken.size());
+    }
+
+    vector<pair<uint32_t, uint32_t>> BadRanges() const
+    {
+        vector<pair<uint32_t, uint32_t>> ranges;
+        for (uint32_t i = 0; i < header->bad_count; ++i) {
+            ranges.emplace_back(header->bad_ranges[i][0],
+                                header->bad_ranges[i][1]);
+        }
+        return ranges;
+    }
+
+    // Any beyond g_bad_range_max are left to the DataComplete checksum.
+    void SaveBadRanges(const vector<pair<uint32_t, uint32_t>>& ranges)
+    {
+        auto n = min<size_t>(ranges.size(), g_bad_range_max);
+        for (size_t i = 0; i < n; ++i) {
+            header->bad_ranges[i][0] = ranges[i].first;
+            header->bad_ranges[i][1] = ranges[i].second;
+        }
+        header->bad_count = static_cast<uint32_t>(n);
+    }
+
+    // Once the download is over, there is nothing left to carry on from.
+    void Remove() { unlink(path.c_str()); }
+
+    // The ints and snapshots first, then the header saying how many of
+    // them there are.
+    void Sync()
+    {
+        auto count     = header->count;
+        auto snapshots = header->snapshot_count;
+        msync(map, map_size, MS_SYNC);
+        header->synced           = count;
+        header->synced_snapshots = snapshots;
+        msync(map, sizeof(Header), MS_SYNC);
+    }
+
+  private:
+    static constexpr char g_magic[8] = { 'A', 'B', 'L', 'Y',
+                                         'C', 'K', 'P', 'T' };
+    static const uint32_t g_version       = 2;
+    static const uint32_t g_bad_range_max = 64;
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t n;
+        uint32_t from;
+        uint32_t to;
+        char uuid[40];  // zero padded.
+        uint64_t count;  // ints held, from 'from'.
+        uint64_t synced; // of those, ints known to be on disk.
+        uint32_t checksum_algo;
+        uint32_t snapshot_count;
+        uint32_t synced_snapshots;
+        uint32_t bad_count;
+        uint32_t bad_ranges[g_bad_range_max][2];
+    };
+
+    static bool IsCheckpoint(const Header& header)
+    {
+        return equal(begin(g_magic), end(g_magic), header.magic)
+               && header.version == g_version;
+    }
+
+    static string UUIDOf(const Header& header)
+    {
+        return string(begin(header.uuid),
+                      find(begin(header.uuid), end(header.uuid), '\0'));
+    }
+
+    string path;
+    int file_handle;
+    void* map;
+    size_t map_size;
+    Header* header;
+    uint32_t* snapshots;
+    uint32_t* ints;
+
+    mutex sync_lock;
+    condition_variable sync_wake;
+    bool running;
+    thread sync;
+};
+#else
+// No mmap here, so downloads only ever live in memory.
+class Checkpoint
+{
+  public:
+    static string PathFor(const string& dir, const string& uuid, uint32_t from)
+    {
+        return dir + "/" + uuid + "-" + to_string(from) + ".ckpt";
+    }
+
+    static uint32_t SizeOf(const string&) { return 0; }
+
+    Checkpoint(const string& path, const string&, uint32_t, uint32_t,
+               uint32_t, chrono::milliseconds)
+    {
+        throw runtime_error("A checkpoint is not available on this "
+                            "platform, " + path);
+    }
+
+    uint32_t* Ints() { return nullptr; }
+    uint64_t* Count() { return nullptr; }
+    void RestoreChecksum(Common::RunningChecksum&, uint32_t) const {}
+    void SaveChecksum(const Common::RunningChecksum&) {}
+    vector<pair<uint32_t, uint32_t>> BadRanges() const { return {}; }
+    void SaveBadRanges(const vector<pair<uint32_t, uint32_t>>&) {}
+    void Remove() {}
+};
+#endif // _WIN32
+} // namespace Client
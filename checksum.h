@@ -0,0 +1,284 @@
+#pragma once
+
+namespace Common {
+// Which checksum a DataComplete holds.
+enum class ChecksumAlgo : uint32_t
+{
+    // ComputeChecksum. Serial, every step needs the one before.
+    Legacy = 0,
+
+    // CRC32C (Castagnoli) over the bytes of the ints. Hardware accelerated
+    // where the cpu has it, and CRCs of neighbouring chunks can be combined,
+    // so a payload can be checked a chunk at a time, or chunks in parallel.
+    Crc32c = 1,
+};
+
+const char* ToString(ChecksumAlgo algo)
+{
+    return algo == ChecksumAlgo::Crc32c ? "crc32c" : "legacy";
+}
+
+namespace Crc32cDetail {
+const uint32_t g_polynomial = 0x82f63b78; // reversed Castagnoli
+
+struct Table
+{
+    uint32_t entries[256];
+
+    Table()
+    {
+        for (uint32_t i = 0; i < 256; ++i) {
+            auto c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? (c >> 1) ^ g_polynomial : c >> 1;
+            }
+            entries[i] = c;
+        }
+    }
+};
+
+uint32_t Software(uint32_t crc, const uint8_t* p, size_t n)
+{
+    static const Table table;
+    while (n--) {
+        crc = table.entries[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2"))) uint32_t Hardware(uint32_t crc,
+                                                    const uint8_t* p, size_t n)
+{
+    uint64_t c = crc;
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = static_cast<uint32_t>(c);
+    for (; n; --n) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+
+bool HasHardware()
+{
+    static const bool has = __builtin_cpu_supports("sse4.2");
+    return has;
+}
+#elif defined(_M_X64)
+uint32_t Hardware(uint32_t crc, const uint8_t* p, size_t n)
+{
+    uint64_t c = crc;
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = static_cast<uint32_t>(c);
+    for (; n; --n) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+
+bool HasHardware()
+{
+    static const bool has = [] {
+        int info[4];
+        __cpuid(info, 1);
+        return (info[2] & (1 << 20)) != 0;
+    }();
+    return has;
+}
+#else
+uint32_t Hardware(uint32_t crc, const uint8_t* p, size_t n)
+{
+    return Software(crc, p, n);
+}
+
+bool HasHardware()
+{
+    return false;
+}
+#endif
+
+// For Crc32cCombine. Multiplies a 32x32 GF(2) matrix by a vector.
+uint32_t Times(const uint32_t* matrix, uint32_t vec)
+{
+    uint32_t sum = 0;
+    for (; vec; vec >>= 1, ++matrix) {
+        if (vec & 1) {
+            sum ^= *matrix;
+        }
+    }
+    return sum;
+}
+
+void Square(uint32_t* square, const uint32_t* matrix)
+{
+    for (int n = 0; n < 32; ++n) {
+        square[n] = Times(matrix, matrix[n]);
+    }
+}
+} // namespace Crc32cDetail
+
+// Carries on a raw (not inverted) CRC32C over more bytes.
+uint32_t Crc32cUpdate(uint32_t crc, const void* data, size_t n)
+{
+    auto p = reinterpret_cast<const uint8_t*>(data);
+    return Crc32cDetail::HasHardware() ? Crc32cDetail::Hardware(crc, p, n)
+                                       : Crc32cDetail::Software(crc, p, n);
+}
+
+// The CRC32C of the bytes.
+uint32_t Crc32c(const void* data, size_t n)
+{
+    return ~Crc32cUpdate(0xffffffff, data, n);
+}
+
+// The CRC32C of A followed by B, from the CRC32C of each, and the length of
+// B. This is zlib's crc32_combine, with the Castagnoli polynomial.
+uint32_t Crc32cCombine(uint32_t crc_a, uint32_t crc_b, size_t length_b)
+{
+    if (!length_b) {
+        return crc_a;
+    }
+
+    uint32_t even[32]; // operator for an even number of zero bits
+    uint32_t odd[32];  // and an odd one.
+
+    odd[0]       = Crc32cDetail::g_polynomial;
+    uint32_t row = 1;
+    for (int n = 1; n < 32; ++n) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    Crc32cDetail::Square(even, odd); // 2 zero bits
+    Crc32cDetail::Square(odd, even); // 4 zero bits
+
+    // apply length_b zero bytes to crc_a.
+    do {
+        Crc32cDetail::Square(even, odd);
+        if (length_b & 1) {
+            crc_a = Crc32cDetail::Times(even, crc_a);
+        }
+        length_b >>= 1;
+        if (!length_b) {
+            break;
+        }
+        Crc32cDetail::Square(odd, even);
+        if (length_b & 1) {
+            crc_a = Crc32cDetail::Times(odd, crc_a);
+        }
+        length_b >>= 1;
+    } while (length_b);
+
+    return crc_a ^ crc_b;
+}
+
+// A checksum built up as ints arrive, so finishing a transfer is O(1) rather
+// than a pass over the whole payload.
+// It keeps a snapshot of itself every g_snapshot_every ints. A resume that
+// starts earlier than the checksum has got to (the server resends the last
+// packet or so) then only replays from the nearest snapshot.
+class RunningChecksum
+{
+  public:
+    static const size_t g_snapshot_every = 1 << 16;
+
+    RunningChecksum(ChecksumAlgo algo = ChecksumAlgo::Legacy,
+                    size_t total      = 0)
+      : algo{ algo }
+      , total{ total }
+      , count{ 0 }
+      , state{ Begin() }
+    {}
+
+    ChecksumAlgo Algo() const { return algo; }
+
+    // How many ints it is the checksum of, once finished.
+    size_t Total() const { return total; }
+
+    // How many ints it covers so far.
+    size_t Count() const { return count; }
+
+    // Feeds in the next n ints.
+    void Update(const uint32_t* data, size_t n)
+    {
+        while (n) {
+            // stop at each snapshot boundary.
+            auto step = min(n, g_snapshot_every - count % g_snapshot_every);
+            state     = Step(state, data, step);
+            count += step;
+            data += step;
+            n -= step;
+            if (count % g_snapshot_every == 0) {
+                snapshots.push_back(state);
+            }
+        }
+    }
+
+    // Makes it cover exactly the first 'to' ints of payload, going back to
+    // a snapshot, or on, as needed.
+    // The ints it already covers are taken to still be the same in payload.
+    void SeekTo(size_t to, const uint32_t* payload)
+    {
+        if (to < count) {
+            auto keep = min(to / g_snapshot_every, snapshots.size());
+            snapshots.resize(keep);
+            state = keep ? snapshots.back() : Begin();
+            count = keep * g_snapshot_every;
+        }
+        Update(payload + count, to - count);
+    }
+
+    uint32_t Value() const
+    {
+        return algo == ChecksumAlgo::Crc32c ? ~state : state;
+    }
+
+    // The state after every g_snapshot_every ints so far. Saved with a
+    // checkpoint, so a restarted download need not go over every int again.
+    const vector<uint32_t>& Snapshots() const { return snapshots; }
+
+    // Carries on from the first n Snapshots of one over the same ints, at
+    // the last of them.
+    void Restore(const uint32_t* saved, size_t n)
+    {
+        snapshots.assign(saved, saved + n);
+        count = n * g_snapshot_every;
+        state = n ? snapshots.back() : Begin();
+    }
+
+  private:
+    uint32_t Begin() const
+    {
+        return algo == ChecksumAlgo::Crc32c ? 0xffffffff
+                                            : ChecksumBegin(total);
+    }
+
+    uint32_t Step(uint32_t s, const uint32_t* data, size_t n) const
+    {
+        return algo == ChecksumAlgo::Crc32c
+                 ? Crc32cUpdate(s, data, n * sizeof(uint32_t))
+                 : ChecksumUpdate(s, data, n);
+    }
+
+    ChecksumAlgo algo;
+    size_t total;
+    size_t count;
+    uint32_t state;
+    vector<uint32_t> snapshots;
+};
+
+// The whole checksum of ints, in one go.
+uint32_t ComputeChecksum(ChecksumAlgo algo, const uint32_t* data, size_t n)
+{
+    RunningChecksum c(algo, n);
+    c.Update(data, n);
+    return c.Value();
+}
+} // namespace Common
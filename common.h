@@ -12,6 +12,22 @@ uint32_t ComputeChecksum(std::vector<uint32_t> const& vec)
     return seed;
 }
 
+// ComputeChecksum in pieces, for when the ints are not all in one vector.
+// Start from ChecksumBegin, with the total count, and feed every int, in
+// order, through ChecksumUpdate.
+uint32_t ChecksumBegin(size_t total)
+{
+    return static_cast<uint32_t>(total);
+}
+
+uint32_t ChecksumUpdate(uint32_t seed, const uint32_t* data, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        seed ^= data[i] + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+    }
+    return seed;
+}
+
 const char* GetArg(const char* tag, int argc, const char** argv)
 {
     auto i = find_if(argv, argv + argc,
@@ -36,16 +52,43 @@ bool HasArg(const char* tag, int argc, const char** argv)
 
 string RandomUUID(int len)
 {
-    static random_device dev;
-    static mt19937 rng(dev());
+    thread_local mt19937 rng(random_device{}());
     static const char alphabet[] = "0123456789"
                                    "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
                                    "abcdefghijklmnopqrstuvwxyz";
 
-    uniform_int_distribution<int> dist(0, size(alphabet) - 1);
+    // less the terminating 0, which would cut the uuid short.
+    uniform_int_distribution<int> dist(0, size(alphabet) - 2);
 
     string res(len, 0);
     generate(begin(res), end(res), [&]() { return alphabet[dist(rng)]; });
     return res;
 }
+
+// FNV-1a. Unlike std::hash, the same from one build to the next, for
+// anything that outlives the process.
+uint64_t Fnv1a(const string& s)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (auto c : s) {
+        h = (h ^ static_cast<uint8_t>(c)) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+// Keeps the calling thread on core, modulo the cores there are. False where
+// that can't be done.
+bool PinToCore(int core)
+{
+#ifdef __linux__
+    auto cores = max(1u, thread::hardware_concurrency());
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(static_cast<unsigned>(core) % cores, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)core;
+    return false;
+#endif
+}
 } // namespace Common
\ No newline at end of file
@@ -0,0 +1,520 @@
+#pragma once
+
+// Coroutines, and a single threaded event loop for them to wait on sockets
+// and timers in, so one thread can drive thousands of connections, each
+// written as if it blocked.
+// Needs C++20 and epoll, so ABLY_ASYNC is only defined where both are there.
+#if defined(__cpp_impl_coroutine) && defined(__linux__)
+#define ABLY_ASYNC 1
+
+namespace Async {
+// What a Task's coroutine co_returns.
+template<typename T>
+struct TaskResult
+{
+    optional<T> value;
+
+    void return_value(T v) { value.emplace(move(v)); }
+    T Take() { return move(*value); }
+};
+
+template<>
+struct TaskResult<void>
+{
+    void return_void() {}
+    void Take() {}
+};
+
+// A coroutine that starts when it is co_awaited, and resumes whoever awaited
+// it once it is done, so Tasks nest like calls, and an exception thrown in one
+// comes out of the co_await. Resuming is a symmetric transfer, so however
+// deep they nest the stack never grows.
+template<typename T>
+class Task
+{
+  public:
+    struct promise_type : TaskResult<T>
+    {
+        coroutine_handle<> awaiting;
+        exception_ptr error;
+
+        Task get_return_object()
+        {
+            return Task(coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        suspend_always initial_suspend() noexcept { return {}; }
+
+        auto final_suspend() noexcept
+        {
+            struct Resume
+            {
+                bool await_ready() noexcept { return false; }
+
+                coroutine_handle<> await_suspend(
+                  coroutine_handle<promise_type> done) noexcept
+                {
+                    auto awaiting = done.promise().awaiting;
+                    return awaiting ? awaiting : noop_coroutine();
+                }
+
+                void await_resume() noexcept {}
+            };
+            return Resume{};
+        }
+
+        void unhandled_exception() { error = current_exception(); }
+    };
+
+    Task(Task&& other) noexcept
+      : handle{ exchange(other.handle, nullptr) }
+    {}
+
+    ~Task()
+    {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    bool await_ready() const noexcept { return false; }
+
+    coroutine_handle<> await_suspend(coroutine_handle<> awaiting) noexcept
+    {
+        handle.promise().awaiting = awaiting;
+        return handle;
+    }
+
+    T await_resume()
+    {
+        auto& promise = handle.promise();
+        if (promise.error) {
+            rethrow_exception(promise.error);
+        }
+        return promise.Take();
+    }
+
+  private:
+    explicit Task(coroutine_handle<promise_type> handle)
+      : handle{ handle }
+    {}
+
+    coroutine_handle<promise_type> handle;
+};
+
+// Something with a handle in an EventLoop's epoll.
+class IPollable
+{
+  public:
+    virtual ~IPollable() {}
+
+    // The epoll events that have happened since it last waited.
+    virtual void OnEvents(uint32_t events) = 0;
+};
+
+// Runs Tasks on the thread that calls Run, resuming each when what it waits
+// on, a Socket or a Sleep, is ready.
+class EventLoop
+{
+  public:
+    using Clock = chrono::steady_clock;
+
+    EventLoop()
+      : epoll_handle{ epoll_create1(EPOLL_CLOEXEC) }
+      , running{ 0 }
+    {
+        if (epoll_handle < 0) {
+            throw runtime_error("Could not create an epoll");
+        }
+    }
+
+    ~EventLoop() { close(epoll_handle); }
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    // Starts task, which runs until it first waits, and the rest of the way
+    // in Run. done is called with what it returns. A task that throws is
+    // logged, and done is not called.
+    template<typename T, typename F>
+    void Spawn(Task<T> task, F done)
+    {
+        ++running;
+        Start(move(task), move(done));
+    }
+
+    // Until every Spawned task is done.
+    void Run()
+    {
+        epoll_event events[256];
+        while (running) {
+            auto timeout = -1;
+            if (!timers.empty()) {
+                auto wait = chrono::ceil<chrono::milliseconds>(
+                  timers.begin()->first - Clock::now());
+                timeout = static_cast<int>(max<int64_t>(0, wait.count()));
+            }
+            auto n = epoll_wait(epoll_handle, events, size(events), timeout);
+            if (n < 0 && errno != EINTR) {
+                throw runtime_error("epoll_wait failed");
+            }
+            for (int i = 0; i < n; ++i) {
+                static_cast<IPollable*>(events[i].data.ptr)
+                  ->OnEvents(events[i].events);
+            }
+
+            auto now = Clock::now();
+            while (!timers.empty() && timers.begin()->first <= now) {
+                auto sleeper = timers.begin()->second;
+                timers.erase(timers.begin());
+                sleeper.resume();
+            }
+        }
+    }
+
+    // co_await Sleep(delay) resumes after delay.
+    auto Sleep(chrono::milliseconds delay)
+    {
+        struct Sleeper
+        {
+            EventLoop& loop;
+            Clock::time_point when;
+
+            bool await_ready() const { return false; }
+
+            void await_suspend(coroutine_handle<> sleeper)
+            {
+                loop.timers.emplace(when, sleeper);
+            }
+
+            void await_resume() {}
+        };
+        return Sleeper{ *this, Clock::now() + delay };
+    }
+
+    // Edge triggered, so pollable must read or write until it would block
+    // before it waits.
+    void Add(int handle, IPollable* pollable)
+    {
+        epoll_event e{};
+        e.events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        e.data.ptr = pollable;
+        if (epoll_ctl(epoll_handle, EPOLL_CTL_ADD, handle, &e) != 0) {
+            throw runtime_error("Could not add to the epoll");
+        }
+    }
+
+    void Remove(int handle)
+    {
+        epoll_ctl(epoll_handle, EPOLL_CTL_DEL, handle, nullptr);
+    }
+
+  private:
+    // A coroutine nobody awaits, which frees itself once it is done.
+    struct Detached
+    {
+        struct promise_type
+        {
+            Detached get_return_object() { return {}; }
+            suspend_never initial_suspend() noexcept { return {}; }
+            suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { terminate(); }
+        };
+    };
+
+    template<typename T, typename F>
+    Detached Start(Task<T> task, F done)
+    {
+        try {
+            if constexpr (is_void_v<T>) {
+                co_await task;
+                done();
+            } else {
+                done(co_await task);
+            }
+        } catch (exception& e) {
+            LogError("Task failed,", e.what());
+        }
+        --running;
+    }
+
+    int epoll_handle;
+    size_t running;
+    multimap<Clock::time_point, coroutine_handle<>> timers;
+};
+
+// A non blocking TCP connection on an EventLoop. Reads come out of a buffer
+// filled with as much as the socket has. A Socket does one thing at a time,
+// as a coroutine would.
+class Socket : public IPollable
+{
+  public:
+    // Takes ownership of handle, which must be non blocking.
+    Socket(EventLoop& loop, int handle)
+      : loop{ loop }
+      , handle{ handle }
+      , in(g_buffer_size)
+      , in_begin{ 0 }
+      , in_end{ 0 }
+      , broken{ false }
+      , waiting_for{ Op::None }
+      , wanted{ 0 }
+    {
+        try {
+            loop.Add(handle, this);
+        } catch (runtime_error&) {
+            close(handle);
+            throw;
+        }
+    }
+
+    ~Socket()
+    {
+        loop.Remove(handle);
+        close(handle);
+    }
+
+    Socket(const Socket&) = delete;
+    Socket& operator=(const Socket&) = delete;
+
+    // A connection to host on port, throwing if there is none.
+    static Task<unique_ptr<Socket>> Connect(EventLoop& loop, string host,
+                                            int port)
+    {
+        addrinfo hints{};
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* found   = nullptr;
+        if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &found)
+            != 0) {
+            throw runtime_error("Cannot resolve hostname");
+        }
+        unique_ptr<addrinfo, decltype(&freeaddrinfo)> scope_guard(
+          found, freeaddrinfo);
+
+        for (auto r = found; r; r = r->ai_next) {
+            auto handle = ::socket(r->ai_family,
+                                   r->ai_socktype | SOCK_NONBLOCK
+                                     | SOCK_CLOEXEC,
+                                   r->ai_protocol);
+            if (handle < 0) {
+                continue;
+            }
+            auto stream = make_unique<Socket>(loop, handle);
+            if (co_await Connector{ *stream, r->ai_addr, r->ai_addrlen, 0 }) {
+                co_return move(stream);
+            }
+        }
+        throw runtime_error("Cannot connect to host");
+    }
+
+    // co_await Read(dst, n) fills dst with the next n bytes, throwing
+    // socket_close_exception if the connection ends first.
+    auto Read(void* dst, size_t n)
+    {
+        struct Reader
+        {
+            Socket& socket;
+            void* dst;
+            size_t n;
+
+            bool await_ready() { return socket.Fill(n); }
+
+            void await_suspend(coroutine_handle<> reader)
+            {
+                socket.Wait(Op::Read, n, reader);
+            }
+
+            void await_resume() { socket.Take(dst, n); }
+        };
+        return Reader{ *this, dst, n };
+    }
+
+    // co_await Write(data, n) sends all n bytes, throwing
+    // socket_close_exception if it can't.
+    auto Write(const void* data, size_t n)
+    {
+        struct Writer
+        {
+            Socket& socket;
+
+            bool await_ready() { return socket.Send(); }
+
+            void await_suspend(coroutine_handle<> writer)
+            {
+                socket.Wait(Op::Write, 0, writer);
+            }
+
+            void await_resume()
+            {
+                if (socket.broken) {
+                    throw socket_close_exception();
+                }
+            }
+        };
+        auto c = static_cast<const char*>(data);
+        out.insert(end(out), c, c + n);
+        return Writer{ *this };
+    }
+
+    virtual void OnEvents(uint32_t events) override
+    {
+        (void)events;
+        // whatever happened, trying again says if it is done.
+        auto done = false;
+        switch (waiting_for) {
+            case Op::None:
+                return;
+            case Op::Connect:
+                done = true;
+                break;
+            case Op::Read:
+                done = Fill(wanted);
+                break;
+            case Op::Write:
+                done = Send();
+                break;
+        }
+        if (done) {
+            waiting_for = Op::None;
+            exchange(waiting, nullptr).resume();
+        }
+    }
+
+  private:
+    static const size_t g_buffer_size = 1 << 16;
+
+    enum class Op
+    {
+        None,
+        Connect,
+        Read,
+        Write,
+    };
+
+    void Wait(Op op, size_t n, coroutine_handle<> waiter)
+    {
+        waiting_for = op;
+        wanted      = n;
+        waiting     = waiter;
+    }
+
+    // co_await Connector{ *this, address, size } is true once connected.
+    struct Connector
+    {
+        Socket& socket;
+        const sockaddr* address;
+        socklen_t size;
+        int error;
+
+        bool await_ready()
+        {
+            error = connect(socket.handle, address, size) == 0 ? 0 : errno;
+            return error != EINPROGRESS;
+        }
+
+        void await_suspend(coroutine_handle<> connector)
+        {
+            socket.Wait(Op::Connect, 0, connector);
+        }
+
+        bool await_resume()
+        {
+            if (error == EINPROGRESS) {
+                socklen_t length = sizeof(error);
+                if (getsockopt(socket.handle, SOL_SOCKET, SO_ERROR, &error,
+                               &length)
+                    != 0) {
+                    error = errno;
+                }
+            }
+            return error == 0;
+        }
+    };
+
+    // Reads until n bytes are held, the socket would block, or the
+    // connection ends. False only if it would block.
+    bool Fill(size_t n)
+    {
+        if (in_end - in_begin >= n) {
+            return true;
+        }
+        if (in.size() - in_begin < n) {
+            memmove(in.data(), in.data() + in_begin, in_end - in_begin);
+            in_end -= in_begin;
+            in_begin = 0;
+            if (in.size() < n) {
+                in.resize(n);
+            }
+        }
+        while (in_end - in_begin < n) {
+            auto r = recv(handle, in.data() + in_end, in.size() - in_end, 0);
+            if (r > 0) {
+                in_end += r;
+            } else if (r < 0 && errno == EINTR) {
+                continue;
+            } else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return false;
+            } else {
+                // closed, which Take finds.
+                return true;
+            }
+        }
+        return true;
+    }
+
+    void Take(void* dst, size_t n)
+    {
+        if (in_end - in_begin < n) {
+            throw socket_close_exception();
+        }
+        memcpy(dst, in.data() + in_begin, n);
+        in_begin += n;
+        if (in_begin == in_end) {
+            in_begin = in_end = 0;
+        }
+    }
+
+    // Sends out until it is empty, the socket would block, or the
+    // connection breaks. False only if it would block.
+    bool Send()
+    {
+        size_t sent = 0;
+        while (sent < out.size()) {
+            auto r = send(handle, out.data() + sent, out.size() - sent,
+                          MSG_NOSIGNAL);
+            if (r >= 0) {
+                sent += r;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            } else {
+                broken = true;
+                out.clear();
+                return true;
+            }
+        }
+        out.erase(begin(out), begin(out) + sent);
+        return out.empty();
+    }
+
+    EventLoop& loop;
+    int handle;
+
+    vector<char> in;
+    size_t in_begin;
+    size_t in_end;
+
+    vector<char> out;
+    bool broken;
+
+    Op waiting_for;
+    size_t wanted; // bytes, for a Read
+    coroutine_handle<> waiting;
+};
+} // namespace Async
+#endif // __cpp_impl_coroutine && __linux__
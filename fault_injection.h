@@ -0,0 +1,34 @@
+#pragma once
+
+namespace FaultInjection {
+int g_flaky_connection = 0;
+int g_flaky_data       = 0;
+
+bool FlakyConnection()
+{
+    if (g_flaky_connection) {
+        // per thread, as any number of sessions may be asking at once.
+        thread_local mt19937 rng(random_device{}());
+        thread_local uniform_int_distribution<int> dist(1, g_flaky_connection);
+        if (dist(rng) == 1) {
+            LogError("!!! INJECTING FLAKY CONNECTION");
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t FlakyData()
+{
+    if (g_flaky_data) {
+        // per thread, as any number of sessions may be asking at once.
+        thread_local mt19937 rng(random_device{}());
+        thread_local uniform_int_distribution<int> dist(1, g_flaky_data);
+        if (dist(rng) == 1) {
+            LogError("!!! INJECTING FLAKY DATA");
+            return dist(rng);
+        }
+    }
+    return 0;
+}
+}; // namespace FaultInjection
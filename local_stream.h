@@ -0,0 +1,434 @@
+#pragma once
+
+// Streams for clients on the same host as the server, which never need TCP.
+// A server listens, as well as on its TCP port, on two unix sockets named for
+// the port. One carries the protocol as TCP would. The other only hands each
+// client a ShmStream, shared memory rings that the protocol then runs over
+// without a syscall per send. Clients try them in that order, and fall back
+// to TCP when a server has neither.
+#ifdef __linux__
+// The sockets are in the abstract namespace, so there are no files to clean
+// up after a crash, and only clients in the server's network namespace, which
+// are those that could reach it on localhost, can find them.
+string LocalName(int port, const char* kind)
+{
+    return "ably-" + to_string(port) + "-" + kind;
+}
+
+sockaddr_un LocalAddress(const string& name, socklen_t& size)
+{
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (name.size() + 1 > sizeof(address.sun_path)) {
+        throw runtime_error("Local socket name too long");
+    }
+    // a leading 0 is the abstract namespace.
+    memcpy(address.sun_path + 1, name.data(), name.size());
+    size = offsetof(sockaddr_un, sun_path) + 1 + name.size();
+    return address;
+}
+
+TCPStream UnixListen(const string& name)
+{
+    socklen_t size;
+    auto address = LocalAddress(name, size);
+    auto handle  = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (handle < 0) {
+        throw runtime_error("Could not create unix socket");
+    }
+    if (::bind(handle, reinterpret_cast<sockaddr*>(&address), size) < 0
+        || listen(handle, g_listen_backlog) == SOCKET_ERROR) {
+        closesocket(handle);
+        throw runtime_error("Could not listen on unix socket " + name);
+    }
+    return TCPStream::FromHandle(handle);
+}
+
+TCPStream UnixConnect(const string& name)
+{
+    socklen_t size;
+    auto address = LocalAddress(name, size);
+    auto handle  = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (handle < 0) {
+        throw runtime_error("Could not create unix socket");
+    }
+    if (connect(handle, reinterpret_cast<sockaddr*>(&address), size) != 0) {
+        closesocket(handle);
+        throw runtime_error("Cannot connect to " + name);
+    }
+    return TCPStream::FromHandle(handle);
+}
+
+// A stream over two single producer, single consumer byte rings, one each
+// way, in memory shared by the client and server.
+// The server makes the memory, and passes it to the client over a unix
+// socket, which is then kept only so each end notices the other going away.
+// A send copies in to the ring and a receive copies out, with no syscall
+// while the other end keeps up. An end that has to wait spins a little, then
+// sleeps on a futex the other end wakes only when told someone is asleep.
+class ShmStream : public INetStream
+{
+    using Clock = chrono::steady_clock;
+
+  public:
+    // Per direction.
+    static constexpr size_t g_default_capacity = 1 << 18;
+
+    // Server side, makes the rings and hands them to the client on socket.
+    // Never waits on the client.
+    static unique_ptr<ShmStream> Offer(TCPStream socket,
+                                       size_t capacity = g_default_capacity)
+    {
+        auto size = sizeof(Header) + 2 * capacity;
+        auto fd   = memfd_create("ably-shm", MFD_CLOEXEC);
+        if (fd < 0) {
+            socket.Close();
+            throw runtime_error("Could not create shared memory");
+        }
+        void* memory = MAP_FAILED;
+        if (ftruncate(fd, size) == 0) {
+            memory =
+              mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        if (memory == MAP_FAILED) {
+            close(fd);
+            socket.Close();
+            throw runtime_error("Could not map shared memory");
+        }
+
+        auto header      = new (memory) Header{};
+        header->magic    = g_magic;
+        header->capacity = static_cast<uint32_t>(capacity);
+        unique_ptr<ShmStream> stream(
+          new ShmStream(socket, header, size, true));
+
+        auto sent = SendHandle(socket.Handle(), fd);
+        close(fd);
+        if (!sent) {
+            throw runtime_error("Could not offer shared memory");
+        }
+        return stream;
+    }
+
+    // Client side, waits for the rings offered on socket.
+    static unique_ptr<ShmStream> Join(TCPStream socket)
+    {
+        auto fd = RecvHandle(socket.Handle());
+        if (fd < 0) {
+            socket.Close();
+            throw runtime_error("No shared memory offered");
+        }
+
+        struct stat info;
+        void* memory = MAP_FAILED;
+        if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(Header)) {
+            memory = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (memory == MAP_FAILED) {
+            socket.Close();
+            throw runtime_error("Could not map shared memory");
+        }
+
+        size_t size = info.st_size;
+        auto header = static_cast<Header*>(memory);
+        if (header->magic != g_magic || !header->capacity
+            || size != sizeof(Header) + 2 * size_t(header->capacity)) {
+            munmap(memory, size);
+            socket.Close();
+            throw runtime_error("Bad shared memory");
+        }
+        return unique_ptr<ShmStream>(
+          new ShmStream(socket, header, size, false));
+    }
+
+    ~ShmStream()
+    {
+        Close();
+        munmap(header, size);
+        socket.Close();
+    }
+
+    virtual void SendN(size_t n, const void* data) override
+    {
+        auto src = static_cast<const char*>(data);
+        // a receiver that has gone would otherwise only be noticed once the
+        // ring filled.
+        auto now = Clock::now();
+        if (now >= next_check) {
+            next_check = now + g_liveness_check;
+            CheckPeer();
+        }
+        while (n) {
+            if (Closed()) {
+                throw socket_close_exception();
+            }
+            size_t room;
+            if (!Wait(out.writer, out.reader,
+                      [&] { return (room = capacity - Used(out)) > 0; },
+                      Clock::time_point::max())) {
+                throw socket_close_exception();
+            }
+
+            auto pos  = out.writer.pos.load(memory_order_relaxed);
+            auto copy = min(n, room);
+            for (size_t done = 0; done < copy;) {
+                auto at    = (pos + done) % capacity;
+                auto piece = min(copy - done, capacity - at);
+                memcpy(out_data + at, src + done, piece);
+                done += piece;
+            }
+            out.writer.pos.store(pos + copy);
+            Notify(out.writer, out.reader);
+            src += copy;
+            n -= copy;
+        }
+    }
+
+    virtual void RecvN(size_t n, void* dst) override
+    {
+        auto to = static_cast<char*>(dst);
+        while (n) {
+            auto got = RecvSome(n, to);
+            to += got;
+            n -= got;
+        }
+    }
+
+    // What was sent before the other end closed is still received, and only
+    // after that does this throw.
+    virtual size_t RecvSome(size_t max, void* dst) override
+    {
+        size_t have;
+        if (!Wait(in.reader, in.writer,
+                  [&] { return (have = Used(in)) > 0; },
+                  Clock::time_point::max())) {
+            throw socket_close_exception();
+        }
+
+        auto pos  = in.reader.pos.load(memory_order_relaxed);
+        auto copy = min(max, have);
+        auto to   = static_cast<char*>(dst);
+        for (size_t done = 0; done < copy;) {
+            auto at    = (pos + done) % capacity;
+            auto piece = min(copy - done, capacity - at);
+            memcpy(to + done, in_data + at, piece);
+            done += piece;
+        }
+        in.reader.pos.store(pos + copy);
+        Notify(in.reader, in.writer);
+        return copy;
+    }
+
+    // As a socket, a closed stream counts as having something to receive.
+    virtual int WaitForDataToRecv(chrono::seconds timeout) override
+    {
+        Wait(in.reader, in.writer, [&] { return Used(in) > 0; },
+             Clock::now() + timeout);
+        return Used(in) > 0 || Closed() ? 1 : 0;
+    }
+
+    virtual void Close() override
+    {
+        header->closed.store(1);
+        for (auto side : { &in.reader, &in.writer, &out.reader, &out.writer }) {
+            side->seq.fetch_add(1);
+            FutexWake(side->seq);
+        }
+        shutdown(socket.Handle(), SHUT_RDWR);
+    }
+
+  private:
+    static constexpr uint32_t g_magic = 0x6d687341; // "Ashm"
+
+    // Loads of the ring before sleeping.
+    static constexpr int g_spin = 256;
+
+    // How long a sleep goes before checking the other end is still there.
+    static constexpr chrono::milliseconds g_liveness_check{ 100 };
+
+    // One end of a ring. pos counts every byte it has written, or read, and
+    // seq goes up after each time pos moves. waiting is set while this end
+    // sleeps on the other end's seq.
+    struct alignas(64) Side
+    {
+        atomic<uint64_t> pos;
+        atomic<uint32_t> seq;
+        atomic<uint32_t> waiting;
+    };
+
+    struct Ring
+    {
+        Side writer;
+        Side reader;
+    };
+
+    // At the start of the shared memory, followed by the bytes of to_server,
+    // then those of to_client.
+    struct Header
+    {
+        uint32_t magic;
+        uint32_t capacity;
+        atomic<uint32_t> closed;
+        Ring to_server;
+        Ring to_client;
+    };
+
+    ShmStream(TCPStream socket, Header* header, size_t size, bool server)
+      : socket{ socket }
+      , header{ header }
+      , size{ size }
+      , capacity{ header->capacity }
+      , in{ server ? header->to_server : header->to_client }
+      , out{ server ? header->to_client : header->to_server }
+      , in_data{ reinterpret_cast<char*>(header + 1)
+                 + (server ? 0 : capacity) }
+      , out_data{ reinterpret_cast<char*>(header + 1)
+                  + (server ? capacity : 0) }
+      , peer_gone{ false }
+      , next_check{ Clock::now() + g_liveness_check }
+    {}
+
+    // The other end shares the memory, so is not trusted to keep the ring
+    // sane.
+    size_t Used(const Ring& ring) const
+    {
+        auto used = ring.writer.pos.load() - ring.reader.pos.load();
+        if (used > capacity) {
+            throw runtime_error("Shared memory ring corrupted");
+        }
+        return used;
+    }
+
+    bool Closed() const { return header->closed.load() || peer_gone; }
+
+    // Until ready is true, the stream is closed, or deadline, returning
+    // ready. mine is this end of the ring, and other the end that will make
+    // it ready.
+    // Setting waiting before checking ready, as the other end moves pos
+    // before checking waiting, means one of the two always sees the other.
+    template<typename F>
+    bool Wait(Side& mine, Side& other, F ready, Clock::time_point deadline)
+    {
+        for (int i = 0; i < g_spin; ++i) {
+            if (ready()) {
+                return true;
+            }
+        }
+
+        for (;;) {
+            auto seq = other.seq.load();
+            mine.waiting.store(1);
+            if (ready() || Closed()) {
+                mine.waiting.store(0);
+                return ready();
+            }
+            auto now = Clock::now();
+            if (now >= deadline) {
+                mine.waiting.store(0);
+                return false;
+            }
+
+            auto nap = min<Clock::duration>(g_liveness_check, deadline - now);
+            FutexWait(other.seq, seq,
+                      chrono::duration_cast<chrono::nanoseconds>(nap));
+            mine.waiting.store(0);
+            CheckPeer();
+        }
+    }
+
+    void CheckPeer()
+    {
+        pollfd fd{ socket.Handle(), POLLRDHUP, 0 };
+        if (poll(&fd, 1, 0) > 0
+            && (fd.revents & (POLLRDHUP | POLLHUP | POLLERR))) {
+            peer_gone = true;
+        }
+    }
+
+    static void Notify(Side& mine, Side& other)
+    {
+        mine.seq.fetch_add(1);
+        if (other.waiting.load()) {
+            FutexWake(mine.seq);
+        }
+    }
+
+    // Not private futexes, as the other end is another process.
+    static void FutexWait(atomic<uint32_t>& word, uint32_t expected,
+                          chrono::nanoseconds timeout)
+    {
+        timespec ts{ (time_t)(timeout.count() / 1000000000),
+                     (long)(timeout.count() % 1000000000) };
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT,
+                expected, &ts, nullptr, 0);
+    }
+
+    static void FutexWake(atomic<uint32_t>& word)
+    {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE,
+                INT32_MAX, nullptr, nullptr, 0);
+    }
+
+    // The memory's fd goes to the other process as ancillary data, on a 1
+    // byte message.
+    static bool SendHandle(SOCKET s, int fd)
+    {
+        char byte = 0;
+        iovec iov{ &byte, 1 };
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+
+        msghdr msg{};
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+
+        auto c        = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type  = SCM_RIGHTS;
+        c->cmsg_len   = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c), &fd, sizeof(int));
+        return sendmsg(s, &msg, MSG_NOSIGNAL) == 1;
+    }
+
+    // -1 if no fd came.
+    static int RecvHandle(SOCKET s)
+    {
+        char byte;
+        iovec iov{ &byte, 1 };
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+
+        msghdr msg{};
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(s, &msg, MSG_CMSG_CLOEXEC) != 1) {
+            return -1;
+        }
+
+        int fd = -1;
+        auto c = CMSG_FIRSTHDR(&msg);
+        if (c && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS
+            && c->cmsg_len == CMSG_LEN(sizeof(int))) {
+            memcpy(&fd, CMSG_DATA(c), sizeof(int));
+        }
+        return fd;
+    }
+
+    TCPStream socket;
+    Header* header;
+    size_t size;
+    size_t capacity;
+
+    Ring& in;
+    Ring& out;
+    char* in_data;
+    char* out_data;
+
+    bool peer_gone;
+    Clock::time_point next_check;
+};
+#endif // __linux__
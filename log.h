@@ -10,6 +10,14 @@ enum class LogLevel
     Trace
 };
 
+// The least severe level compiled in at all, 0 (errors only) to 3 (trace,
+// the default). Log macros above it are removed, arguments and all, so
+// building with -DABLY_MIN_LOG_LEVEL=2 takes every LogTrace out of the hot
+// loops.
+#ifndef ABLY_MIN_LOG_LEVEL
+#define ABLY_MIN_LOG_LEVEL 3
+#endif
+
 struct helper
 {
     template<typename T>
@@ -32,29 +40,311 @@ struct helper
 
 LogLevel g_log_level = LogLevel::Info;
 
+const char* LogTag(LogLevel lvl)
+{
+    static const char* lvl_tags[] = {
+        "[ERR]",
+        "[MSG]",
+        "[INF]",
+        "[TRC]",
+    };
+    return lvl_tags[(int)lvl];
+}
+
+namespace LogDetail {
+// Text is kept as its size, then its chars.
+bool WriteText(char*& p, char* end, string_view text)
+{
+    uint32_t size = static_cast<uint32_t>(text.size());
+    if (static_cast<size_t>(end - p) < sizeof(size) + size) {
+        return false;
+    }
+    memcpy(p, &size, sizeof(size));
+    memcpy(p + sizeof(size), text.data(), size);
+    p += sizeof(size) + size;
+    return true;
+}
+
+string_view ReadText(const char*& p)
+{
+    uint32_t size;
+    memcpy(&size, p, sizeof(size));
+    string_view text(p + sizeof(size), size);
+    p += sizeof(size) + size;
+    return text;
+}
+
+// How one argument is kept in a log record, until the logging thread formats
+// it. Write copies it in at p, and returns false if there is not room before
+// end. Read formats it, as helper::op would have, and moves p past it.
+// Anything without its own Arg is formatted on the calling thread, and kept as
+// text.
+template<typename T, typename = void>
+struct Arg
+{
+    static bool Write(char*& p, char* end, const T& v)
+    {
+        ostringstream text;
+        helper::op(text, v);
+        return WriteText(p, end, text.str());
+    }
+
+    static void Read(ostream& o, const char*& p) { o << ReadText(p); }
+};
+
+// Numbers, bools and chars, as they are.
+template<typename T>
+struct Arg<T, enable_if_t<is_arithmetic_v<T>>>
+{
+    static bool Write(char*& p, char* end, T v)
+    {
+        if (static_cast<size_t>(end - p) < sizeof(v)) {
+            return false;
+        }
+        memcpy(p, &v, sizeof(v));
+        p += sizeof(v);
+        return true;
+    }
+
+    static void Read(ostream& o, const char*& p)
+    {
+        T v;
+        memcpy(&v, p, sizeof(v));
+        p += sizeof(v);
+        helper::op(o, v);
+    }
+};
+
+// Strings, copied, as the caller's may be gone by the time it is formatted.
+template<typename T>
+struct Arg<T, enable_if_t<is_same_v<T, string> || is_same_v<T, string_view>
+                          || is_same_v<T, const char*>
+                          || is_same_v<T, char*>>>
+{
+    static bool Write(char*& p, char* end, string_view v)
+    {
+        return WriteText(p, end, v);
+    }
+
+    static void Read(ostream& o, const char*& p)
+    {
+        helper::op(o, ReadText(p));
+    }
+};
+
+template<typename... Args>
+void Format(ostream& o, const char* p)
+{
+    (Arg<Args>::Read(o, p), ...);
+}
+
+// A line that did not fit in a record, formatted by the caller and cut short.
+void FormatText(ostream& o, const char* p)
+{
+    o << ReadText(p);
+}
+} // namespace LogDetail
+
+// Log lines queued by any thread, and written by one thread of its own, so a
+// thread logging never waits on the console.
+// The queue is a bounded ring of fixed size records, each claimed by a
+// compare and swap on the write position, and handed over by its sequence
+// number, so logging takes no lock and allocates nothing. Arguments are copied
+// in as they are, and only formatted on the logging thread. When the ring is
+// full, loggers wait for room rather than drop lines.
+class AsyncLog
+{
+  public:
+    static constexpr size_t g_default_capacity = 4096;
+
+    AsyncLog(size_t capacity)
+      : records(RoundUpToPowerOf2(capacity))
+      , mask{ records.size() - 1 }
+      , write_pos{ 0 }
+      , read_pos{ 0 }
+      , sleeping{ false }
+      , running{ true }
+    {
+        for (size_t i = 0; i < records.size(); ++i) {
+            records[i].sequence.store(i, memory_order_relaxed);
+        }
+        writer = thread(&AsyncLog::WriteLines, this);
+    }
+
+    ~AsyncLog();
+
+    AsyncLog(const AsyncLog&) = delete;
+    AsyncLog& operator=(const AsyncLog&) = delete;
+
+    template<typename... Args>
+    void Push(LogLevel lvl, const Args&... args)
+    {
+        size_t pos;
+        auto& r = Claim(pos);
+        r.level = lvl;
+
+        char* p   = r.data;
+        char* end = r.data + sizeof(r.data);
+        if ((LogDetail::Arg<decay_t<Args>>::Write(p, end, args) && ...)) {
+            r.format = &LogDetail::Format<decay_t<Args>...>;
+        } else {
+            ostringstream text;
+            (helper::op(text, args), ...);
+            auto line = text.str();
+            line.resize(min(line.size(), sizeof(r.data) - sizeof(uint32_t)));
+
+            p = r.data;
+            LogDetail::WriteText(p, end, line);
+            r.format = &LogDetail::FormatText;
+        }
+
+        r.sequence.store(pos + 1, memory_order_seq_cst);
+        if (sleeping.load(memory_order_seq_cst)) {
+            lock_guard<mutex> scope_guard(lock);
+            wake.notify_one();
+        }
+    }
+
+  private:
+    struct alignas(64) Record
+    {
+        // pos when free for the write at pos, pos + 1 once written.
+        atomic<size_t> sequence;
+        LogLevel level;
+        void (*format)(ostream&, const char*);
+        char data[256 - 24];
+    };
+
+    static size_t RoundUpToPowerOf2(size_t n)
+    {
+        size_t size = 2;
+        while (size < n) {
+            size *= 2;
+        }
+        return size;
+    }
+
+    Record& Claim(size_t& pos)
+    {
+        pos = write_pos.load(memory_order_relaxed);
+        for (;;) {
+            auto& r  = records[pos & mask];
+            auto seq = r.sequence.load(memory_order_acquire);
+            auto ahead = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (ahead == 0) {
+                if (write_pos.compare_exchange_weak(pos, pos + 1,
+                                                    memory_order_relaxed)) {
+                    return r;
+                }
+            } else if (ahead < 0) {
+                // full, the logging thread is a lap behind.
+                this_thread::yield();
+                pos = write_pos.load(memory_order_relaxed);
+            } else {
+                pos = write_pos.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    void WriteLines()
+    {
+        for (;;) {
+            auto& r = records[read_pos & mask];
+            if (r.sequence.load(memory_order_acquire) == read_pos + 1) {
+                cout << LogTag(r.level);
+                r.format(cout, r.data);
+                cout << '\n';
+                r.sequence.store(read_pos + records.size(),
+                                 memory_order_release);
+                ++read_pos;
+                continue;
+            }
+
+            // caught up, so out it goes.
+            cout.flush();
+            if (!running.load()) {
+                return;
+            }
+
+            // a logger seeing sleeping wakes this, and one that races it
+            // is picked up on the timeout.
+            unique_lock<mutex> wait_lock(lock);
+            sleeping.store(true, memory_order_seq_cst);
+            if (r.sequence.load(memory_order_seq_cst) != read_pos + 1
+                && running.load()) {
+                wake.wait_for(wait_lock, chrono::milliseconds(50));
+            }
+            sleeping.store(false, memory_order_relaxed);
+        }
+    }
+
+    vector<Record> records;
+    size_t mask;
+    atomic<size_t> write_pos;
+    size_t read_pos; // only the logging thread uses this
+
+    mutex lock;
+    condition_variable wake;
+    atomic<bool> sleeping;
+    atomic<bool> running;
+    thread writer;
+};
+
+// Set by StartAsyncLog. Until then, and after exit, lines are written as they
+// are logged.
+atomic<AsyncLog*> g_async_log{ nullptr };
+
+// Lines queued at exit are written before it.
+AsyncLog::~AsyncLog()
+{
+    AsyncLog* self = this;
+    g_async_log.compare_exchange_strong(self, nullptr);
+    {
+        lock_guard<mutex> scope_guard(lock);
+        running = false;
+    }
+    wake.notify_one();
+    writer.join();
+}
+
+void StartAsyncLog(size_t capacity = AsyncLog::g_default_capacity)
+{
+    static AsyncLog log(capacity);
+    g_async_log = &log;
+}
+
 template<typename... Args>
 void Log(LogLevel lvl, Args&&... args)
 {
     if (lvl > g_log_level)
         return;
 
+    if (auto async = g_async_log.load(memory_order_acquire)) {
+        async->Push(lvl, args...);
+        return;
+    }
+
     // only 1 log line at a time please
     static mutex lock;
     lock_guard<mutex> scope_guard(lock);
 
-    static const char* lvl_tags[] = {
-        "[ERR]",
-        "[MSG]",
-        "[INF]",
-        "[TRC]",
-    };
-
-    cout << lvl_tags[(int)lvl];
+    cout << LogTag(lvl);
     (helper::op(cout, args), ...);
     cout << endl;
 }
 
-#define LogError(...) Log(LogLevel::Error, __VA_ARGS__)
-#define LogMessage(...) Log(LogLevel::Message, __VA_ARGS__)
-#define LogInfo(...) Log(LogLevel::Info, __VA_ARGS__)
-#define LogTrace(...) Log(LogLevel::Trace, __VA_ARGS__)
+// The level is checked before the arguments are evaluated, so a line that is
+// not logged never builds its strings.
+#define ABLY_LOG(lvl, ...)                                                     \
+    do {                                                                       \
+        if constexpr ((int)(lvl) <= ABLY_MIN_LOG_LEVEL) {                      \
+            if ((lvl) <= g_log_level) {                                        \
+                Log((lvl), __VA_ARGS__);                                       \
+            }                                                                  \
+        }                                                                      \
+    } while (false)
+
+#define LogError(...) ABLY_LOG(LogLevel::Error, __VA_ARGS__)
+#define LogMessage(...) ABLY_LOG(LogLevel::Message, __VA_ARGS__)
+#define LogInfo(...) ABLY_LOG(LogLevel::Info, __VA_ARGS__)
+#define LogTrace(...) ABLY_LOG(LogLevel::Trace, __VA_ARGS__)
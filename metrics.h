@@ -0,0 +1,379 @@
+#pragma once
+
+// Server counters and latency histograms, cheap enough for the send loop.
+// Each thread counts in to a block of its own, so counting is a relaxed load
+// and store, with no lock and no cache line shared with another thread.
+// Blocks are only summed when a snapshot is taken. When a thread ends its
+// block goes back to a free list, and the next new thread carries on counting
+// in it, so no counts are lost and a thread per connection server doesn't
+// grow a block per connection.
+namespace Metrics {
+enum Counter
+{
+    BytesSent, // in data frames
+    PacketsSent,
+    Logins,
+    Resumes,
+    NMismatches,
+    Expiries,
+    SessionsStarted,
+    SessionsEnded,
+    Handovers, // logins passed to the reactor owning their uuid
+    TokenResumes, // sessions made again from a resume token
+    AckTimeouts,  // connections closed for not acking
+    Counter_Count
+};
+
+const char* g_counter_names[Counter_Count] = {
+    "bytes_sent",       "packets_sent",   "logins",
+    "resumes",          "n_mismatches",   "expiries",
+    "sessions_started", "sessions_ended", "handovers",
+    "token_resumes",    "ack_timeouts",
+};
+
+// In nanoseconds. Bucket i counts values below 2^i, and at least 2^(i-1).
+enum Histogram
+{
+    LoginToFirstPacket,
+    SendCall,
+    Histogram_Count
+};
+
+const char* g_histogram_names[Histogram_Count] = {
+    "login_to_first_packet_ns",
+    "send_call_ns",
+};
+
+static constexpr int g_bucket_count = 64;
+
+struct alignas(64) Block
+{
+    atomic<uint64_t> counters[Counter_Count];
+    atomic<uint64_t> buckets[Histogram_Count][g_bucket_count];
+    atomic<uint64_t> sums[Histogram_Count];
+};
+
+// Every block ever handed out, and those free for a new thread.
+class Registry
+{
+  public:
+    Block* Acquire()
+    {
+        lock_guard<mutex> scope_guard(lock);
+        if (!free.empty()) {
+            auto b = free.back();
+            free.pop_back();
+            return b;
+        }
+        blocks.push_back(make_unique<Block>());
+        return blocks.back().get();
+    }
+
+    void Release(Block* b)
+    {
+        lock_guard<mutex> scope_guard(lock);
+        free.push_back(b);
+    }
+
+    template<typename F>
+    void ForEach(F&& f)
+    {
+        lock_guard<mutex> scope_guard(lock);
+        for (auto& b : blocks) {
+            f(*b);
+        }
+    }
+
+  private:
+    mutex lock;
+    vector<unique_ptr<Block>> blocks;
+    vector<Block*> free;
+};
+
+Registry& GetRegistry()
+{
+    static Registry registry;
+    return registry;
+}
+
+// This threads block.
+Block& Local()
+{
+    struct Owner
+    {
+        Block* block;
+        Owner()
+          : block{ GetRegistry().Acquire() }
+        {}
+        ~Owner() { GetRegistry().Release(block); }
+    };
+    thread_local Owner owner;
+    return *owner.block;
+}
+
+// Only the owning thread writes a block, so no read-modify-write is needed.
+void Bump(atomic<uint64_t>& a, uint64_t n)
+{
+    a.store(a.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+void Add(Counter c, uint64_t n = 1)
+{
+    Bump(Local().counters[c], n);
+}
+
+void Record(Histogram h, chrono::nanoseconds d)
+{
+    auto ns    = static_cast<uint64_t>(max<int64_t>(0, d.count()));
+    int bucket = 0;
+    for (auto v = ns; v; v >>= 1) {
+        ++bucket;
+    }
+
+    auto& b = Local();
+    Bump(b.buckets[h][min(bucket, g_bucket_count - 1)], 1);
+    Bump(b.sums[h], ns);
+}
+
+// Counts a session as started, and ended when this goes.
+struct SessionScope
+{
+    SessionScope() { Add(SessionsStarted); }
+    ~SessionScope() { Add(SessionsEnded); }
+};
+
+// Every thread's counts, summed.
+struct Snapshot
+{
+    uint64_t counters[Counter_Count]                  = {};
+    uint64_t buckets[Histogram_Count][g_bucket_count] = {};
+    uint64_t sums[Histogram_Count]                    = {};
+
+    // Upper bound of the bucket holding the q'th quantile.
+    uint64_t Quantile(Histogram h, double q) const
+    {
+        uint64_t count = Count(h);
+        if (!count) {
+            return 0;
+        }
+        auto want     = static_cast<uint64_t>(ceil(q * count));
+        uint64_t seen = 0;
+        for (int i = 0; i < g_bucket_count; ++i) {
+            seen += buckets[h][i];
+            if (seen >= max<uint64_t>(1, want)) {
+                return i < 63 ? (uint64_t(1) << i) : ~uint64_t(0);
+            }
+        }
+        return ~uint64_t(0);
+    }
+
+    uint64_t Count(Histogram h) const
+    {
+        return accumulate(begin(buckets[h]), end(buckets[h]), uint64_t(0));
+    }
+};
+
+Snapshot Take()
+{
+    Snapshot s;
+    GetRegistry().ForEach([&](const Block& b) {
+        for (int c = 0; c < Counter_Count; ++c) {
+            s.counters[c] += b.counters[c].load(memory_order_relaxed);
+        }
+        for (int h = 0; h < Histogram_Count; ++h) {
+            for (int i = 0; i < g_bucket_count; ++i) {
+                s.buckets[h][i] += b.buckets[h][i].load(memory_order_relaxed);
+            }
+            s.sums[h] += b.sums[h].load(memory_order_relaxed);
+        }
+    });
+    return s;
+}
+
+// Values read when a snapshot is dumped, such as how many sessions are kept.
+using Gauges = function<vector<pair<string, uint64_t>>()>;
+
+// One line of JSON. Histogram buckets are listed up to the last one used.
+string ToJson(const Snapshot& s, const vector<pair<string, uint64_t>>& gauges)
+{
+    ostringstream json;
+    json << "{\"time_ms\":"
+         << chrono::duration_cast<chrono::milliseconds>(
+              chrono::system_clock::now().time_since_epoch())
+              .count();
+    for (int c = 0; c < Counter_Count; ++c) {
+        json << ",\"" << g_counter_names[c] << "\":" << s.counters[c];
+    }
+    json << ",\"active_sessions\":"
+         << s.counters[SessionsStarted] - s.counters[SessionsEnded];
+    for (auto& g : gauges) {
+        json << ",\"" << g.first << "\":" << g.second;
+    }
+
+    for (int h = 0; h < Histogram_Count; ++h) {
+        auto hist = static_cast<Histogram>(h);
+        json << ",\"" << g_histogram_names[h] << "\":{\"count\":"
+             << s.Count(hist) << ",\"sum\":" << s.sums[h]
+             << ",\"p50\":" << s.Quantile(hist, 0.5)
+             << ",\"p99\":" << s.Quantile(hist, 0.99) << ",\"buckets\":[";
+        int used = g_bucket_count;
+        while (used && !s.buckets[h][used - 1]) {
+            --used;
+        }
+        for (int i = 0; i < used; ++i) {
+            json << (i ? "," : "") << s.buckets[h][i];
+        }
+        json << "]}";
+    }
+    json << '}';
+    return json.str();
+}
+
+// Dumps a snapshot to the log every interval, and to anything connecting to
+// port, each on a thread of its own. A 0 interval or port turns that off.
+// The port answers as an HTTP server would, so curl can read it. Each
+// connection gets g_client_time to send its request and take the reply, so
+// one that never does only holds up the port that long.
+class Reporter
+{
+  public:
+    Reporter(Gauges gauges, chrono::milliseconds interval, int port)
+      : gauges{ move(gauges) }
+      , running{ true }
+    {
+        // first, as it throws if the port is taken.
+        if (port) {
+            listener = make_unique<TCPStream>(port);
+            LogInfo("Stats on port", port);
+        }
+
+        if (interval.count() > 0) {
+            dumper = thread([this, interval] {
+                unique_lock<mutex> wait_lock(lock);
+                while (running) {
+                    wake.wait_for(wait_lock, interval);
+                    if (running) {
+                        wait_lock.unlock();
+                        LogMessage("stats", Json());
+                        wait_lock.lock();
+                    }
+                }
+            });
+        }
+        if (listener) {
+            server = thread(&Reporter::Serve, this);
+        }
+    }
+
+    ~Reporter()
+    {
+        {
+            lock_guard<mutex> scope_guard(lock);
+            running = false;
+        }
+        wake.notify_one();
+        if (dumper.joinable()) {
+            dumper.join();
+        }
+        if (server.joinable()) {
+            server.join();
+            listener->Close();
+        }
+    }
+
+    // Without the gauges, if they can't be read.
+    string Json()
+    {
+        vector<pair<string, uint64_t>> values;
+        try {
+            if (gauges) {
+                values = gauges();
+            }
+        } catch (runtime_error& e) {
+            LogError("Stats gauges", e.what());
+        }
+        return ToJson(Take(), values);
+    }
+
+  private:
+    static constexpr chrono::seconds g_client_time = 2s;
+    static const size_t g_request_max              = 8192;
+
+    void Serve()
+    {
+        while (running) {
+            if (!listener->WaitForDataToRecv(chrono::seconds(1))) {
+                continue;
+            }
+            try {
+                auto conn = listener->Accept();
+                try {
+                    Answer(conn);
+                } catch (socket_close_exception&) {
+                }
+                conn.Close();
+            } catch (runtime_error& e) {
+                LogError("Stats port", e.what());
+            }
+        }
+    }
+
+    // Reads the request before replying, and what follows it before
+    // closing, as closing with anything unread resets the connection, and
+    // the client can lose the reply.
+    void Answer(TCPStream& conn)
+    {
+        auto deadline = chrono::steady_clock::now() + g_client_time;
+        auto timeout  = chrono::duration_cast<chrono::milliseconds>(
+          g_client_time);
+#ifdef _WIN32
+        DWORD send_timeout = static_cast<DWORD>(timeout.count());
+#else
+        timeval send_timeout{};
+        send_timeout.tv_sec  = timeout.count() / 1000;
+        send_timeout.tv_usec = (timeout.count() % 1000) * 1000;
+#endif
+        setsockopt(conn.Handle(), SOL_SOCKET, SO_SNDTIMEO,
+                   reinterpret_cast<const char*>(&send_timeout),
+                   sizeof(send_timeout));
+
+        string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == string::npos) {
+            if (request.size() >= g_request_max
+                || chrono::steady_clock::now() >= deadline) {
+                LogError("Stats port, no request in time");
+                return;
+            }
+            if (!conn.WaitForDataToRecv(1s)) {
+                continue;
+            }
+            request.append(buffer, conn.RecvSome(sizeof(buffer), buffer));
+        }
+
+        auto body  = Json() + "\n";
+        auto reply = "HTTP/1.0 200 OK\r\nContent-Type: "
+                     "application/json\r\nContent-Length: "
+                     + to_string(body.size()) + "\r\n\r\n" + body;
+        conn.SendN(reply.size(), reply.data());
+
+        // 1, SHUT_WR or SD_SEND, sends a FIN, then waits for the clients.
+        shutdown(conn.Handle(), 1);
+        // recv rather than RecvSome, as the clients FIN is no error here.
+        while (chrono::steady_clock::now() < deadline
+               && conn.WaitForDataToRecv(1s)
+               && recv(conn.Handle(), buffer, sizeof(buffer), 0) > 0) {
+        }
+    }
+
+    Gauges gauges;
+
+    mutex lock;
+    condition_variable wake;
+    atomic<bool> running;
+    thread dumper;
+
+    unique_ptr<TCPStream> listener;
+    thread server;
+};
+} // namespace Metrics
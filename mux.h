@@ -0,0 +1,338 @@
+#pragma once
+
+// The server's record of which streams the client has opened, as their first
+// frames can arrive out of order, see Protocal::MuxFrame. Ids skipped over
+// are remembered until their stream opens or closes, so a late frame for a
+// stream already gone is never taken for a new one.
+class MuxStreamIds
+{
+  public:
+    // If a frame for id, which has no stream, opens one. Throws on an id
+    // further ahead than a client would ever get, or once more ids are
+    // skipped than a client could ever have in flight.
+    bool Opens(uint32_t id, bool has_data)
+    {
+        if (id <= last) {
+            return skipped.erase(id) && has_data;
+        }
+        if (id - last > Protocal::g_mux_skip_max
+            || skipped.size() + (id - last - 1) > Protocal::g_mux_skip_max) {
+            throw runtime_error("Bad MuxFrame stream " + to_string(id));
+        }
+        while (++last < id) {
+            skipped.insert(last);
+        }
+        return has_data;
+    }
+
+  private:
+    uint32_t last = 0;
+    unordered_set<uint32_t> skipped;
+};
+
+// One end of a connection carrying many streams, see Protocal::MuxFrame.
+// The client opens streams with Open, and the server takes each new one with
+// Accept. Either way a stream is an INetStream of its own, so the protocol
+// runs over it just as it would over a connection.
+// A thread of its own reads frames, and queues each stream's bytes for it.
+// Sends from any stream go straight out, a whole frame at a time, under a
+// lock. A stream that falls behind reading holds up the others once it has
+// g_stream_buffer_max bytes waiting, rather than queueing without limit.
+class MuxConnection : public enable_shared_from_this<MuxConnection>
+{
+  public:
+    static constexpr size_t g_stream_buffer_max = 1 << 22;
+
+    // stream has already been through the opening Hello. server takes
+    // streams the other end opens, rather than opening them.
+    MuxConnection(unique_ptr<INetStream> stream, bool server)
+      : stream{ move(stream) }
+      , server{ server }
+      , last_id{ 0 }
+      , broken{ false }
+      , running{ true }
+    {
+        reader = thread(&MuxConnection::Read, this);
+    }
+
+    ~MuxConnection()
+    {
+        running = false;
+        reader.join();
+        stream->Close();
+    }
+
+    // Client side, a new stream.
+    unique_ptr<INetStream> Open()
+    {
+        lock_guard<mutex> scope_guard(lock);
+        auto id = ++last_id;
+        return make_unique<Stream>(shared_from_this(), id, AddChannel(id));
+    }
+
+    // Server side, waits for the other end to open a stream. Null once the
+    // connection has ended.
+    unique_ptr<INetStream> Accept()
+    {
+        unique_lock<mutex> wait_lock(lock);
+        opened.wait(wait_lock, [this] { return !pending.empty() || broken; });
+        if (pending.empty()) {
+            return nullptr;
+        }
+        auto id = pending.front();
+        pending.pop();
+        // not yet closed this end, so still there.
+        return make_unique<Stream>(shared_from_this(), id, channels.at(id));
+    }
+
+    bool Broken()
+    {
+        lock_guard<mutex> scope_guard(lock);
+        return broken;
+    }
+
+  private:
+    struct Channel
+    {
+        condition_variable changed;
+        vector<char> in;
+        size_t in_begin;
+        bool remote_closed;
+        bool local_closed;
+
+        Channel(bool remote_closed = false)
+          : in_begin{ 0 }
+          , remote_closed{ remote_closed }
+          , local_closed{ false }
+        {}
+
+        size_t Waiting() const { return in.size() - in_begin; }
+    };
+
+    class Stream : public INetStream
+    {
+      public:
+        Stream(shared_ptr<MuxConnection> mux, uint32_t id,
+               shared_ptr<Channel> channel)
+          : mux{ move(mux) }
+          , id{ id }
+          , channel{ move(channel) }
+        {}
+
+        ~Stream() { Close(); }
+
+        virtual void SendN(size_t n, const void* data) override
+        {
+            mux->Send(id, *channel, n, data);
+        }
+
+        virtual void RecvN(size_t n, void* dst) override
+        {
+            auto to = static_cast<char*>(dst);
+            while (n) {
+                auto got = RecvSome(n, to);
+                to += got;
+                n -= got;
+            }
+        }
+
+        virtual size_t RecvSome(size_t max, void* dst) override
+        {
+            return mux->Recv(*channel, max, dst);
+        }
+
+        virtual int WaitForDataToRecv(chrono::seconds timeout) override
+        {
+            return mux->WaitForData(*channel, timeout);
+        }
+
+        virtual void Close() override { mux->Close(id, *channel); }
+
+      private:
+        shared_ptr<MuxConnection> mux;
+        uint32_t id;
+        shared_ptr<Channel> channel;
+    };
+
+    // With lock held.
+    shared_ptr<Channel> AddChannel(uint32_t id)
+    {
+        auto channel = make_shared<Channel>(broken);
+        channels.emplace(id, channel);
+        return channel;
+    }
+
+    void Send(uint32_t id, Channel& channel, size_t n, const void* data)
+    {
+        {
+            lock_guard<mutex> scope_guard(lock);
+            if (broken || channel.remote_closed || channel.local_closed) {
+                throw socket_close_exception();
+            }
+        }
+        SendFrames(id, n, data);
+    }
+
+    // As many frames as it takes, 1 of size 0 for n of 0.
+    void SendFrames(uint32_t id, size_t n, const void* data)
+    {
+        lock_guard<mutex> scope_guard(send_lock);
+        auto c = static_cast<const char*>(data);
+        try {
+            do {
+                auto size = static_cast<uint32_t>(
+                  min<size_t>(n, Protocal::g_mux_frame_max));
+                Protocal::MuxFrame frame{ id, size };
+                IoSlice slices[2] = { { &frame, sizeof(frame) }, { c, size } };
+                stream->SendV(slices, size ? 2 : 1);
+                c += size;
+                n -= size;
+            } while (n);
+        } catch (socket_close_exception&) {
+            Break();
+            throw;
+        }
+    }
+
+    size_t Recv(Channel& channel, size_t max, void* dst)
+    {
+        unique_lock<mutex> wait_lock(lock);
+        channel.changed.wait(wait_lock, [&] {
+            return channel.Waiting() || channel.remote_closed;
+        });
+        if (!channel.Waiting()) {
+            throw socket_close_exception();
+        }
+
+        auto n = min(max, channel.Waiting());
+        memcpy(dst, channel.in.data() + channel.in_begin, n);
+        channel.in_begin += n;
+        if (channel.in_begin == channel.in.size()) {
+            channel.in.clear();
+            channel.in_begin = 0;
+        }
+        // the reader may be waiting for room.
+        channel.changed.notify_all();
+        return n;
+    }
+
+    int WaitForData(Channel& channel, chrono::seconds timeout)
+    {
+        unique_lock<mutex> wait_lock(lock);
+        return channel.changed.wait_for(wait_lock, timeout, [&] {
+            return channel.Waiting() || channel.remote_closed;
+        })
+                 ? 1
+                 : 0;
+    }
+
+    // Each end sends its close once, whichever closed first, so both know
+    // when the stream can be forgotten.
+    void Close(uint32_t id, Channel& channel)
+    {
+        {
+            lock_guard<mutex> scope_guard(lock);
+            if (channel.local_closed) {
+                return;
+            }
+            channel.local_closed = true;
+            channel.changed.notify_all();
+            if (channel.remote_closed) {
+                channels.erase(id);
+            }
+            if (broken) {
+                return;
+            }
+        }
+        try {
+            SendFrames(id, 0, nullptr);
+        } catch (socket_close_exception&) {
+        }
+    }
+
+    void Break()
+    {
+        lock_guard<mutex> scope_guard(lock);
+        broken = true;
+        for (auto& c : channels) {
+            c.second->remote_closed = true;
+            c.second->changed.notify_all();
+        }
+        opened.notify_all();
+    }
+
+    void Read()
+    {
+        BufferedStream buffered(*stream);
+        vector<char> data;
+        try {
+            while (running) {
+                if (!buffered.WaitForDataToRecv(1s)) {
+                    continue;
+                }
+                Protocal::MuxFrame frame;
+                buffered.RecvN(sizeof(frame), &frame);
+                if (frame.size > Protocal::g_mux_frame_max) {
+                    throw runtime_error("Bad MuxFrame");
+                }
+                data.resize(frame.size);
+                buffered.RecvN(frame.size, data.data());
+                Deliver(frame.stream, data);
+            }
+        } catch (runtime_error& e) {
+            LogTrace("Multiplexed connection ended,", e.what());
+        }
+        Break();
+    }
+
+    void Deliver(uint32_t id, const vector<char>& data)
+    {
+        unique_lock<mutex> wait_lock(lock);
+        auto found = channels.find(id);
+        if (found == end(channels)) {
+            // a server takes new streams, anything else is for a stream
+            // already gone.
+            if (!server || !opened_ids.Opens(id, !data.empty())) {
+                return;
+            }
+            found = channels.emplace(id, make_shared<Channel>()).first;
+            pending.push(id);
+            opened.notify_one();
+        }
+
+        auto channel = found->second;
+        if (data.empty()) {
+            channel->remote_closed = true;
+            channel->changed.notify_all();
+            if (channel->local_closed) {
+                channels.erase(found);
+            }
+            return;
+        }
+
+        channel->changed.wait(wait_lock, [&] {
+            return channel->Waiting() < g_stream_buffer_max
+                   || channel->local_closed || !running;
+        });
+        if (!channel->local_closed) {
+            channel->in.insert(end(channel->in), begin(data), end(data));
+            channel->changed.notify_all();
+        }
+    }
+
+    unique_ptr<INetStream> stream;
+    bool server;
+
+    mutex send_lock;
+
+    mutex lock;
+    unordered_map<uint32_t, shared_ptr<Channel>> channels;
+    uint32_t last_id; // the last stream opened, client side
+    MuxStreamIds opened_ids; // server side
+    queue<uint32_t> pending;
+    condition_variable opened;
+    bool broken;
+
+    atomic<bool> running;
+    thread reader;
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+// Token bucket rate limiter for the data packets of one session.
+// Tokens accrue at 'per_second', up to 'burst' of them, and each packet sent
+// takes one. With a rate and burst of 1 this is the original one packet a
+// second.
+class Pacer
+{
+  public:
+    using Clock = chrono::steady_clock;
+
+    // Rates above one a nanosecond are taken as one a nanosecond.
+    Pacer(uint32_t per_second, uint32_t burst, Clock::time_point now)
+      : interval{ max(chrono::nanoseconds(1),
+                      chrono::nanoseconds(chrono::seconds(1))
+                        / max<uint32_t>(1, per_second)) }
+      , burst{ max<uint32_t>(1, burst) }
+      , tokens{ this->burst }
+      , refilled{ now }
+    {}
+
+    // How many packets may go out now, up to 'want'. These are taken.
+    uint32_t Take(Clock::time_point now, uint32_t want)
+    {
+        Refill(now);
+        auto n = min(tokens, want);
+        tokens -= n;
+        return n;
+    }
+
+    // When there will be 'count' packets allowed, or a full burst if that is
+    // less. Waiting for more than one at a time keeps high rates from waking
+    // up for every packet.
+    Clock::time_point Next(uint32_t count = 1) const
+    {
+        count = min(count, burst);
+        if (tokens >= count) {
+            return refilled;
+        }
+        return refilled + interval * (count - tokens);
+    }
+
+  private:
+    void Refill(Clock::time_point now)
+    {
+        if (now <= refilled) {
+            return;
+        }
+        auto gained = static_cast<uint64_t>((now - refilled) / interval);
+        if (tokens + gained >= burst) {
+            // a full bucket does not bank any more time.
+            tokens   = burst;
+            refilled = now;
+        } else {
+            tokens += static_cast<uint32_t>(gained);
+            refilled += interval * gained;
+        }
+    }
+
+    chrono::nanoseconds interval;
+    uint32_t burst;
+    uint32_t tokens;
+    Clock::time_point refilled;
+};
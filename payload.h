@@ -0,0 +1,180 @@
+#pragma once
+
+// Multi versioned for the widest SIMD the cpu has, where the toolchain can.
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+#define ABLY_TARGET_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define ABLY_TARGET_CLONES
+#endif
+
+namespace PayloadGen {
+// Counter based generator. The int at any index is a pure function of the
+// seed and the index, so a payload can be produced from anywhere, in any
+// order, without keeping it.
+// This is a multiply xorshift hash of the index, keyed by the two halves of
+// the seed.
+inline uint32_t At(uint64_t seed, uint32_t index)
+{
+    auto x = index * 0x9e3779b9u + static_cast<uint32_t>(seed);
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= static_cast<uint32_t>(seed >> 32);
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    return x ^ (x >> 16);
+}
+
+// Writes the ints [from, from + count) to dst.
+// Whole blocks of 8 are written lane by lane, a step at a time, which the
+// compiler turns in to SIMD.
+ABLY_TARGET_CLONES
+void Fill(uint64_t seed, uint32_t from, uint32_t count, uint32_t* dst)
+{
+    const auto k0 = static_cast<uint32_t>(seed);
+    const auto k1 = static_cast<uint32_t>(seed >> 32);
+
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        uint32_t x[8];
+        for (uint32_t l = 0; l < 8; ++l) {
+            x[l] = (from + i + l) * 0x9e3779b9u + k0;
+        }
+        for (uint32_t l = 0; l < 8; ++l) {
+            x[l] ^= x[l] >> 16;
+        }
+        for (uint32_t l = 0; l < 8; ++l) {
+            x[l] *= 0x7feb352du;
+        }
+        for (uint32_t l = 0; l < 8; ++l) {
+            x[l] ^= k1;
+        }
+        for (uint32_t l = 0; l < 8; ++l) {
+            x[l] ^= x[l] >> 15;
+        }
+        for (uint32_t l = 0; l < 8; ++l) {
+            x[l] *= 0x846ca68bu;
+        }
+        for (uint32_t l = 0; l < 8; ++l) {
+            dst[i + l] = x[l] ^ (x[l] >> 16);
+        }
+    }
+    for (; i < count; ++i) {
+        dst[i] = At(seed, from + i);
+    }
+}
+
+uint64_t RandomSeed()
+{
+    random_device random_src;
+    return (static_cast<uint64_t>(random_src()) << 32) | random_src();
+}
+} // namespace PayloadGen
+
+// The ints of one transmission. Immutable once made.
+// A stored payload holds every int. A lazy one holds only its seed and size,
+// and makes ints as they are read, so it costs the same memory whatever N is.
+class Payload
+{
+  public:
+    static shared_ptr<const Payload> Stored(uint64_t seed, uint32_t size)
+    {
+        auto p = make_shared<Payload>(seed, size);
+        p->values.resize(size);
+        PayloadGen::Fill(seed, 0, size, p->values.data());
+        return p;
+    }
+
+    static shared_ptr<const Payload> Lazy(uint64_t seed, uint32_t size)
+    {
+        return make_shared<Payload>(seed, size);
+    }
+
+    Payload(uint64_t seed, uint32_t size)
+      : seed{ seed }
+      , size{ size }
+    {}
+
+    uint32_t Size() const { return size; }
+    uint64_t Seed() const { return seed; }
+    bool IsLazy() const { return values.empty() && size; }
+
+    uint32_t operator[](uint32_t i) const
+    {
+        return values.empty() ? PayloadGen::At(seed, i) : values[i];
+    }
+
+    // Copies, or makes, the ints [from, from + count) in to dst.
+    void Read(uint32_t from, uint32_t count, uint32_t* dst) const
+    {
+        if (values.empty()) {
+            PayloadGen::Fill(seed, from, count, dst);
+        } else {
+            copy_n(values.data() + from, count, dst);
+        }
+    }
+
+    // The ints in memory, or null for a lazy payload.
+    const uint32_t* Data() const
+    {
+        return values.empty() ? nullptr : values.data();
+    }
+
+    // The checksum of the whole payload. Worked out the first time it is
+    // asked for, and kept, so every later session finishing on this payload
+    // gets it for nothing. A lazy payload is made a block at a time, so this
+    // never needs all of it at once.
+    uint32_t Checksum(
+      Common::ChecksumAlgo algo = Common::ChecksumAlgo::Legacy) const
+    {
+        auto& cached = checksums[static_cast<size_t>(algo)];
+        call_once(cached.once, [&] {
+            if (!values.empty()) {
+                cached.value =
+                  Common::ComputeChecksum(algo, values.data(), size);
+                return;
+            }
+
+            uint32_t block[4096];
+            Common::RunningChecksum checksum(algo, size);
+            for (uint32_t from = 0; from < size;) {
+                auto n = min<uint32_t>(size - from, 4096);
+                PayloadGen::Fill(seed, from, n, block);
+                checksum.Update(block, n);
+                from += n;
+            }
+            cached.value = checksum.Value();
+        });
+        return cached.value;
+    }
+
+    // The Common::Crc32c of the ints [from, from + count).
+    uint32_t Crc32c(uint32_t from, uint32_t count) const
+    {
+        if (!values.empty()) {
+            return Common::Crc32c(values.data() + from,
+                                  count * sizeof(uint32_t));
+        }
+
+        uint32_t block[4096];
+        auto crc = 0xffffffffu;
+        for (auto to = from + count; from < to;) {
+            auto n = min<uint32_t>(to - from, 4096);
+            PayloadGen::Fill(seed, from, n, block);
+            crc = Common::Crc32cUpdate(crc, block, n * sizeof(uint32_t));
+            from += n;
+        }
+        return ~crc;
+    }
+
+  private:
+    uint64_t seed;
+    uint32_t size;
+    vector<uint32_t> values;
+
+    struct CachedChecksum
+    {
+        once_flag once;
+        uint32_t value;
+    };
+    mutable CachedChecksum checksums[2]; // by ChecksumAlgo
+};
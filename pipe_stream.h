@@ -0,0 +1,152 @@
+#pragma once
+
+// One end of an in memory connection, for running both ends of the protocol
+// in one process without the kernel, as AblyBench does.
+// Each direction is a bounded ring of bytes. Sends block while it is full,
+// and receives while it is empty, as they would on a socket. Closing either
+// end closes both directions. Receives then drain what was already sent, and
+// after that throw socket_close_exception, as would a closed socket.
+class PipeStream : public INetStream
+{
+  public:
+    static constexpr size_t g_default_capacity = 1 << 18;
+
+    // Two connected ends.
+    static pair<unique_ptr<PipeStream>, unique_ptr<PipeStream>>
+    MakePair(size_t capacity = g_default_capacity)
+    {
+        auto link = make_shared<Link>(capacity);
+        return { unique_ptr<PipeStream>(
+                   new PipeStream(link, link->b_to_a, link->a_to_b)),
+                 unique_ptr<PipeStream>(
+                   new PipeStream(link, link->a_to_b, link->b_to_a)) };
+    }
+
+    ~PipeStream() { Close(); }
+
+    virtual void SendN(size_t n, const void* data) override
+    {
+        auto src = static_cast<const char*>(data);
+        while (n) {
+            unique_lock<mutex> wait_lock(out.lock);
+            out.changed.wait(wait_lock, [&] {
+                return out.closed || out.size < out.ring.size();
+            });
+            if (out.closed) {
+                throw socket_close_exception();
+            }
+            auto copied = out.Write(src, n);
+            src += copied;
+            n -= copied;
+            out.changed.notify_all();
+        }
+    }
+
+    virtual void RecvN(size_t n, void* dst) override
+    {
+        auto to = static_cast<char*>(dst);
+        while (n) {
+            auto got = RecvSome(n, to);
+            to += got;
+            n -= got;
+        }
+    }
+
+    virtual size_t RecvSome(size_t max, void* dst) override
+    {
+        unique_lock<mutex> wait_lock(in.lock);
+        in.changed.wait(wait_lock, [&] { return in.closed || in.size; });
+        if (!in.size) {
+            throw socket_close_exception();
+        }
+        auto got = in.Read(static_cast<char*>(dst), max);
+        in.changed.notify_all();
+        return got;
+    }
+
+    virtual int WaitForDataToRecv(chrono::seconds timeout) override
+    {
+        unique_lock<mutex> wait_lock(in.lock);
+        return in.changed.wait_for(wait_lock, timeout,
+                                   [&] { return in.closed || in.size; })
+                 ? 1
+                 : 0;
+    }
+
+    virtual void Close() override
+    {
+        for (auto channel : { &in, &out }) {
+            lock_guard<mutex> scope_guard(channel->lock);
+            channel->closed = true;
+            channel->changed.notify_all();
+        }
+    }
+
+  private:
+    // One direction.
+    struct Channel
+    {
+        mutex lock;
+        condition_variable changed;
+        vector<char> ring;
+        size_t head; // where the next read starts
+        size_t size;
+        bool closed;
+
+        Channel(size_t capacity)
+          : ring(max<size_t>(1, capacity))
+          , head{ 0 }
+          , size{ 0 }
+          , closed{ false }
+        {}
+
+        // With lock held. Both copy as much as they can, in at most two
+        // pieces, as the ring wraps.
+        size_t Write(const char* src, size_t n)
+        {
+            n = min(n, ring.size() - size);
+            for (size_t done = 0; done < n;) {
+                auto at    = (head + size) % ring.size();
+                auto piece = min(n - done, ring.size() - at);
+                memcpy(ring.data() + at, src + done, piece);
+                size += piece;
+                done += piece;
+            }
+            return n;
+        }
+
+        size_t Read(char* dst, size_t n)
+        {
+            n = min(n, size);
+            for (size_t done = 0; done < n;) {
+                auto piece = min(n - done, ring.size() - head);
+                memcpy(dst + done, ring.data() + head, piece);
+                head = (head + piece) % ring.size();
+                size -= piece;
+                done += piece;
+            }
+            return n;
+        }
+    };
+
+    struct Link
+    {
+        Channel a_to_b;
+        Channel b_to_a;
+
+        Link(size_t capacity)
+          : a_to_b(capacity)
+          , b_to_a(capacity)
+        {}
+    };
+
+    PipeStream(shared_ptr<Link> link, Channel& in, Channel& out)
+      : link{ move(link) }
+      , in{ in }
+      , out{ out }
+    {}
+
+    shared_ptr<Link> link;
+    Channel& in;
+    Channel& out;
+};
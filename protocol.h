@@ -0,0 +1,272 @@
+#pragma once
+
+namespace Protocal {
+struct LoginRequest
+{
+    char uuid[40];
+    uint32_t N;
+
+    // non 0 for restart
+    uint32_t packets_seen;
+};
+
+struct LoginConfirmed
+{
+    // non 0 for restart
+    uint32_t sending_from;
+
+    // same a N in LoginRequest
+    uint32_t sending_total;
+};
+
+struct DataPacket
+{
+    uint32_t payload;
+};
+
+struct DataComplete
+{
+    uint32_t checksum;
+};
+
+// Optional extensions.
+// A client that wants any of these sends a Hello just before its
+// LoginRequest. A Hello starts with a zero byte followed by "ABL", which no
+// LoginRequest can (an empty uuid is all zeros), so a login from an old client
+// is still read as is.
+// The server replies with a Hello of its own, holding the features it agreed
+// to, just before the LoginConfirmed.
+enum Features : uint32_t
+{
+    // DataBatch frames instead of one DataPacket per int.
+    Feature_DataBatch = 1 << 0,
+
+    // DataComplete holds the checksum named in Hello::checksum, rather than
+    // Common::ComputeChecksum.
+    Feature_Checksum = 1 << 1,
+
+    // A ChunkChecksum after every Hello::chunk_size ints, and the client may
+    // ask for only part of the payload with Hello::fetch_to.
+    Feature_ChunkCheck = 1 << 2,
+
+    // The connection carries many sessions, see MuxFrame. Only asked for
+    // when opening a connection for it, never with a real login.
+    Feature_Mux = 1 << 3,
+
+    // The client fetches only [Hello::range_from, Hello::fetch_to) on this
+    // connection, with other connections fetching the rest of the payload at
+    // the same time. The server keeps each range's progress on its own, so
+    // packets_seen is where the client has got to within the range.
+    Feature_Range = 1 << 4,
+
+    // The server issues the session a token in its reply Hello, which the
+    // client hands back in its Hello on each reconnect. With it a server
+    // picks the session back up where the client got to, even once it has
+    // forgotten it, or if it never knew it, rather than starting it over.
+    Feature_ResumeToken = 1 << 5,
+
+    // The client sends an Ack each time the ints it has kept cross a multiple
+    // of Hello::ack_every, so the server can tell when it has stopped
+    // reading, rather than sending until the socket fails.
+    Feature_Ack = 1 << 6,
+};
+
+const char g_hello_magic[4] = { '\0', 'A', 'B', 'L' };
+
+// Hello's are never bigger than this, anything claiming to be is garbage.
+const uint32_t g_hello_max_size = 256;
+
+struct Hello
+{
+    char magic[4];
+
+    // sizeof(Hello) as the sender knew it.
+    // New fields only ever get appended, so each end reads the fields it
+    // knows of, and skips any it does not.
+    uint32_t size;
+    uint32_t features;
+
+    // Most payload ints the client will take in one DataBatch.
+    uint32_t batch_max;
+
+    // A Common::ChecksumAlgo. The one the client would like, and in the reply
+    // the one the server will use.
+    uint32_t checksum;
+
+    // Ints per ChunkChecksum.
+    uint32_t chunk_size;
+
+    // Not 0 to have the server stop before this int, rather than at the end
+    // of the payload. With packets_seen this re-fetches a range that failed
+    // its ChunkChecksum, or with Feature_Range ends the range. The reply
+    // holds where the server will stop.
+    uint32_t fetch_to;
+
+    // With Feature_Range, where the range starts. The reply holds the same.
+    uint32_t range_from;
+
+    // With Feature_ResumeToken, the token from the last reply, all 0 on the
+    // first login. The reply holds the session's token, which is opaque to
+    // the client.
+    uint32_t resume_token[4];
+
+    // With Feature_Ack, ints between Acks. The reply holds the same.
+    uint32_t ack_every;
+};
+
+// Sent in place of DataPackets when Feature_DataBatch is agreed.
+// Followed by count payload ints.
+struct DataBatch
+{
+    uint32_t count;
+};
+
+// Sent with Feature_ChunkCheck, straight after the last int of each chunk.
+// Chunks are the ints [k * chunk_size, (k + 1) * chunk_size), the last one
+// ending with the payload.
+struct ChunkChecksum
+{
+    // Common::Crc32c of the chunks ints, whatever checksum was agreed for
+    // the DataComplete.
+    uint32_t checksum;
+};
+
+// Sent by the client with Feature_Ack, the only thing it sends once logged in.
+struct Ack
+{
+    // Where the client has got to, counted as LoginRequest::packets_seen is.
+    uint32_t packets_seen;
+};
+
+// With Feature_Mux one connection carries any number of sessions, each on a
+// stream of its own.
+// The client opens such a connection with a Hello asking for Feature_Mux and
+// an empty LoginRequest (no uuid, and an N of 0), and waits for the reply. A
+// server that agrees sends a Hello holding Feature_Mux and an empty
+// LoginConfirmed, and from then on everything, both ways, is a MuxFrame
+// followed by size bytes of its stream.
+// Each stream carries exactly what a connection of its own would, a Hello
+// and LoginRequest one way, and the reply, ints and DataComplete the other.
+// The client numbers streams from 1 up, in the order it opens them, and a
+// stream opens with its first frame. Streams are sent on independently, so
+// those first frames may arrive out of order, but never more than
+// g_mux_skip_max ids ahead of the last stream opened.
+// Each end sends a frame with a size of 0 when it is done with a stream, as
+// closing a connection would, and the stream is gone once both have.
+struct MuxFrame
+{
+    uint32_t stream;
+    uint32_t size;
+};
+
+// Frames are never bigger than this, anything claiming to be is garbage.
+const uint32_t g_mux_frame_max = 1 << 16;
+const uint32_t g_mux_skip_max  = 1 << 10;
+
+template<typename T>
+void AppendTo(vector<char>& out, const T& t)
+{
+    auto c = reinterpret_cast<const char*>(&t);
+    out.insert(end(out), c, c + sizeof(T));
+}
+
+Hello MakeHello(uint32_t features)
+{
+    Hello h{};
+    copy(begin(g_hello_magic), end(g_hello_magic), h.magic);
+    h.size     = sizeof(Hello);
+    h.features = features;
+    return h;
+}
+
+// The size on the wire of the Hello whose first g_hello_header_size bytes
+// are header. Throws if they are not a Hello's.
+const size_t g_hello_header_size = 8;
+uint32_t HelloSize(const char* header)
+{
+    if (!equal(begin(g_hello_magic), end(g_hello_magic), header)) {
+        throw runtime_error("Expected a Hello");
+    }
+    uint32_t size;
+    memcpy(&size, header + 4, sizeof(size));
+    if (size < g_hello_header_size || size > g_hello_max_size) {
+        throw runtime_error("Bad Hello size");
+    }
+    return size;
+}
+
+// A Hello from all HelloSize of its bytes. Anything from a newer version
+// that this one doesn't know is dropped.
+Hello DecodeHello(const char* data)
+{
+    Hello h{};
+    memcpy(&h, data, min<size_t>(HelloSize(data), sizeof(Hello)));
+    h.size = sizeof(Hello);
+    return h;
+}
+
+// Reads a Hello whose magic is already known to be on the wire.
+Hello RecvHello(TSerialToStream& conn)
+{
+    char data[g_hello_max_size];
+    conn.stream.RecvN(g_hello_header_size, data);
+    auto size = HelloSize(data);
+    conn.stream.RecvN(size - g_hello_header_size, data + g_hello_header_size);
+    return DecodeHello(data);
+}
+
+// If a login opens a connection for multiplexing, rather than a session.
+bool IsMuxOpener(bool has_hello, const Hello& hello, const LoginRequest& login)
+{
+    return has_hello && (hello.features & Feature_Mux) && !login.uuid[0]
+           && !login.N;
+}
+
+// The largest a login (a Hello and a LoginRequest) can be on the wire.
+const size_t g_login_max_size = g_hello_max_size + sizeof(LoginRequest);
+
+// How many more bytes of a login to read, given the first 'have' bytes.
+// 0 once the whole login is held, at which point DecodeLogin can be used.
+// Throws on a Hello that is not valid.
+size_t LoginBytesNeeded(const char* data, size_t have)
+{
+    auto need = [have](size_t total) { return have < total ? total - have : 0; };
+
+    if (have < sizeof(g_hello_magic)) {
+        return need(sizeof(g_hello_magic));
+    }
+    if (!equal(begin(g_hello_magic), end(g_hello_magic), data)) {
+        return need(sizeof(LoginRequest));
+    }
+    if (have < 8) {
+        return need(8);
+    }
+
+    uint32_t size;
+    memcpy(&size, data + 4, sizeof(size));
+    if (size < 8 || size > g_hello_max_size) {
+        throw runtime_error("Bad Hello size");
+    }
+    return need(size + sizeof(LoginRequest));
+}
+
+// Splits a complete login in to its parts.
+// Returns false if it had no Hello, which is an old client.
+bool DecodeLogin(const char* data, Hello& hello, LoginRequest& login)
+{
+    hello = {};
+    if (!equal(begin(g_hello_magic), end(g_hello_magic), data)) {
+        memcpy(&login, data, sizeof(login));
+        return false;
+    }
+
+    uint32_t size;
+    memcpy(&size, data + 4, sizeof(size));
+    memcpy(&hello, data, min<size_t>(size, sizeof(Hello)));
+    hello.size = sizeof(Hello);
+    memcpy(&login, data + size, sizeof(login));
+    return true;
+}
+
+int g_port_number;
+}; // namespace Protocal
@@ -0,0 +1,750 @@
+#pragma once
+
+#ifdef __linux__
+namespace Server {
+// Event driven server core.
+// A Reactor owns any number of sessions on a single thread. Each session is a
+// non-blocking state machine walking the same steps as
+// LocalClientState::ProcessTransmission, with a TimerWheel standing in for the
+// per thread sleep between data packets.
+// Sessions send through the Link, the socket, they arrived on. A link carries
+// one session, or once the client opens it for multiplexing, a session per
+// stream, framed as Protocal::MuxFrame's.
+class Reactor
+{
+    using Clock = TimerWheel<uint64_t>::Clock;
+
+  public:
+    // With a core, the loop only runs on that core.
+    Reactor(ISharedState* shared, int core = -1)
+      : shared{ shared }
+      , core{ core }
+      , epoll_handle{ epoll_create1(EPOLL_CLOEXEC) }
+      , wake_handle{ eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) }
+      , wheel{ 1ms, 1024 }
+      , next_id{ 1 }
+      , running{ true }
+    {
+        if (epoll_handle < 0 || wake_handle < 0) {
+            throw std::runtime_error("Could not create epoll reactor");
+        }
+
+        // id 0 is reserved for the wake up event.
+        epoll_event ev{};
+        ev.events   = EPOLLIN;
+        ev.data.u64 = 0;
+        epoll_ctl(epoll_handle, EPOLL_CTL_ADD, wake_handle, &ev);
+
+        loop = thread(&Reactor::Run, this);
+    }
+
+    ~Reactor()
+    {
+        running = false;
+        Wake();
+        loop.join();
+
+        for (auto& i : links) {
+            closesocket(i.second->handle);
+        }
+        close(wake_handle);
+        close(epoll_handle);
+    }
+
+    // Hand a freshly accepted connection over to this reactor, along with
+    // any of its login already read.
+    // Safe to call from any thread.
+    void Adopt(TCPStream stream, vector<char> login = {})
+    {
+        SetNonBlocking(stream.Handle());
+        {
+            lock_guard<mutex> scope_guard(lock);
+            adopted.push_back({ stream.Handle(), move(login) });
+        }
+        Wake();
+    }
+
+    // From now on each login, other than on a multiplexed link, is handed to
+    // the one of owners picked by its uuid's hash, this one included. So
+    // every resume of a session is served on the same reactor, and with a
+    // LocalSharedState with a multiple of owners.size() shards, the shards
+    // each reactor touches are its own. Must be called before any Adopt.
+    void Route(vector<Reactor*> reactors) { owners = move(reactors); }
+
+  private:
+    enum class Step
+    {
+        Login,
+        Stream,
+        Closing, // close once everything queued has been sent.
+    };
+
+    struct Link
+    {
+        uint64_t id;
+        SOCKET handle;
+        bool mux;
+
+        // The one session, without mux.
+        uint64_t session;
+
+        // With mux, sessions by stream, the streams opened, and frames read
+        // but not yet handled.
+        unordered_map<uint32_t, uint64_t> streams;
+        MuxStreamIds opened;
+        vector<char> in;
+
+        vector<char> out;
+        size_t out_sent;
+        bool want_write;
+    };
+
+    struct Session
+    {
+        uint64_t id;
+        Link* link;
+        uint32_t stream; // 0 without mux
+        Step step;
+        Clock::time_point logged_in;
+
+        char login_buffer[Protocal::g_login_max_size];
+        size_t login_read;
+        Protocal::LoginRequest login;
+
+        SessionStart start;
+        uint32_t next_packet;
+        Pacer pacer;
+        optional<AckTracker> acks;
+
+        // Encoded, and not yet handed to the link.
+        vector<char> out;
+    };
+
+    void Wake()
+    {
+        uint64_t one = 1;
+        auto r       = write(wake_handle, &one, sizeof(one));
+        (void)r;
+    }
+
+    void Run()
+    {
+        if (core >= 0 && !Common::PinToCore(core)) {
+            LogError("Could not pin reactor to core", core);
+        }
+        epoll_event events[64];
+
+        while (running) {
+            auto timeout = wheel.TimeToNext(Clock::now(), 1s);
+            auto n       = epoll_wait(epoll_handle, events, size(events),
+                                (int)timeout.count());
+
+            for (int i = 0; i < n; ++i) {
+                auto id = events[i].data.u64;
+                if (id == 0) {
+                    AdoptPending();
+                    continue;
+                }
+
+                auto found = links.find(id);
+                if (found == end(links)) {
+                    continue;
+                }
+                auto& link = *found->second;
+
+                if (events[i].events & EPOLLERR) {
+                    DropLink(link);
+                    continue;
+                }
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+                    if (!OnReadable(link)) {
+                        continue;
+                    }
+                }
+                if (events[i].events & EPOLLOUT) {
+                    Flush(link);
+                }
+            }
+
+            wheel.Advance(Clock::now(), [this](uint64_t id) {
+                auto found = sessions.find(id);
+                if (found != end(sessions)) {
+                    OnTimer(*found->second);
+                }
+            });
+        }
+    }
+
+    void AdoptPending()
+    {
+        uint64_t count;
+        auto r = read(wake_handle, &count, sizeof(count));
+        (void)r;
+
+        vector<pair<SOCKET, vector<char>>> to_add;
+        {
+            lock_guard<mutex> scope_guard(lock);
+            swap(to_add, adopted);
+        }
+
+        for (auto& [handle, login] : to_add) {
+            auto link         = make_unique<Link>();
+            link->id          = next_id++;
+            link->handle      = handle;
+            link->mux        = false;
+            link->out_sent   = 0;
+            link->want_write = false;
+
+            epoll_event ev{};
+            ev.events   = EPOLLIN | EPOLLRDHUP;
+            ev.data.u64 = link->id;
+            if (epoll_ctl(epoll_handle, EPOLL_CTL_ADD, handle, &ev) != 0) {
+                LogError("Could not add connection to reactor");
+                closesocket(handle);
+                continue;
+            }
+
+            auto& s       = NewSession(*link, 0);
+            link->session = s.id;
+            links.emplace(link->id, move(link));
+
+            if (!login.empty()) {
+                memcpy(s.login_buffer, login.data(), login.size());
+                s.login_read = login.size();
+                OnLogin(s);
+            }
+        }
+    }
+
+    Session& NewSession(Link& link, uint32_t stream)
+    {
+        auto s = make_unique<Session>(Session{
+          next_id++, &link, stream, Step::Login, {}, {}, 0, {}, {}, 0,
+          Pacer(g_rate, g_burst, Clock::now()), {}, {} });
+        s->start.uuid = "unkown";
+
+        auto& added = *s;
+        sessions.emplace(s->id, move(s));
+        Metrics::Add(Metrics::SessionsStarted);
+        return added;
+    }
+
+    // All these return false if what they were given was closed, and so
+    // must no longer be touched.
+    bool OnReadable(Link& link)
+    {
+        if (link.mux) {
+            return ReadFrames(link);
+        }
+
+        auto& s = *sessions.at(link.session);
+        if (s.step == Step::Login) {
+            size_t need;
+            try {
+                need = Protocal::LoginBytesNeeded(s.login_buffer, s.login_read);
+            } catch (runtime_error& e) {
+                LogError("Bad login", e.what());
+                return Close(s);
+            }
+
+            auto r = recv(link.handle, s.login_buffer + s.login_read, need, 0);
+            if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                return DropLink(link);
+            }
+            if (r > 0) {
+                s.login_read += r;
+                if (r == (ssize_t)need
+                    && !Protocal::LoginBytesNeeded(s.login_buffer,
+                                                   s.login_read)) {
+                    return OnLogin(s);
+                }
+            }
+            return true;
+        }
+
+        // Only Acks are expected from the client once streaming, if that,
+        // so otherwise this is only here to notice it going away.
+        char bytes[256];
+        auto r = recv(link.handle, bytes, sizeof(bytes), 0);
+        if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return DropLink(link);
+        }
+        if (r > 0 && s.step == Step::Stream) {
+            return OnAcks(s, bytes, r);
+        }
+        return true;
+    }
+
+    bool OnAcks(Session& s, const char* data, size_t size)
+    {
+        try {
+            s.acks->Read(data, size, Clock::now());
+        } catch (runtime_error& e) {
+            LogError("(" + s.start.uuid + ")", e.what());
+            return Close(s);
+        }
+        return true;
+    }
+
+    // Clients only send logins, Acks and closes on a multiplexed link, so
+    // frames are never bigger than a login.
+    bool ReadFrames(Link& link)
+    {
+        char buffer[4096];
+        auto r = recv(link.handle, buffer, sizeof(buffer), 0);
+        if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return DropLink(link);
+        }
+        if (r < 0) {
+            return true;
+        }
+        link.in.insert(end(link.in), buffer, buffer + r);
+
+        auto id     = link.id;
+        size_t used = 0;
+        while (link.in.size() - used >= sizeof(Protocal::MuxFrame)) {
+            Protocal::MuxFrame frame;
+            memcpy(&frame, link.in.data() + used, sizeof(frame));
+            if (frame.size > Protocal::g_login_max_size) {
+                LogError("Bad MuxFrame of", frame.size);
+                return DropLink(link);
+            }
+            if (link.in.size() - used < sizeof(frame) + frame.size) {
+                break;
+            }
+
+            auto data = link.in.data() + used + sizeof(frame);
+            used += sizeof(frame) + frame.size;
+            try {
+                OnStreamData(link, frame.stream, data, frame.size);
+            } catch (runtime_error& e) {
+                LogError(e.what());
+                return DropLink(link);
+            }
+            if (!links.count(id)) {
+                return false;
+            }
+        }
+        link.in.erase(begin(link.in), begin(link.in) + used);
+        return true;
+    }
+
+    void OnStreamData(Link& link, uint32_t stream, const char* data,
+                      uint32_t size)
+    {
+        auto found = link.streams.find(stream);
+        if (found == end(link.streams)) {
+            // anything else is for a stream already gone.
+            if (!link.opened.Opens(stream, size != 0)) {
+                return;
+            }
+            found = link.streams.emplace(stream, NewSession(link, stream).id)
+                      .first;
+        }
+
+        auto& s = *sessions.at(found->second);
+        if (!size) {
+            if (s.step != Step::Closing) {
+                LogError("(" + s.start.uuid + ")", "Stream closed early");
+            }
+            Close(s);
+            return;
+        }
+        if (s.step == Step::Stream) {
+            OnAcks(s, data, size);
+            return;
+        }
+        if (s.step != Step::Login) {
+            return;
+        }
+
+        try {
+            for (uint32_t at = 0; at < size;) {
+                auto need =
+                  Protocal::LoginBytesNeeded(s.login_buffer, s.login_read);
+                if (!need) {
+                    throw runtime_error("More than a login");
+                }
+                auto take = min<size_t>(need, size - at);
+                memcpy(s.login_buffer + s.login_read, data + at, take);
+                s.login_read += take;
+                at += take;
+            }
+            if (Protocal::LoginBytesNeeded(s.login_buffer, s.login_read)) {
+                return;
+            }
+        } catch (runtime_error& e) {
+            LogError("Bad login", e.what());
+            Close(s);
+            return;
+        }
+        OnLogin(s);
+    }
+
+    bool OnLogin(Session& s)
+    {
+        // Step 1 to 3, shared with the threaded server.
+        Protocal::Hello hello;
+        auto has_hello = Protocal::DecodeLogin(s.login_buffer, hello, s.login);
+        s.logged_in    = Clock::now();
+
+        if (!s.stream && Protocal::IsMuxOpener(has_hello, hello, s.login)) {
+            return OpenMux(s);
+        }
+        if (!s.stream && owners.size() > 1) {
+            auto uuid  = UUIDFromLogin(s.login);
+            auto owner = owners[LocalSharedState::Hash(uuid) % owners.size()];
+            if (owner != this) {
+                return HandOver(s, *owner);
+            }
+        }
+
+        try {
+            s.start =
+              ResolveLogin(shared, s.login, has_hello ? &hello : nullptr);
+        } catch (runtime_error& e) {
+            LogError("(" + s.start.uuid + ")", "Login failed", e.what());
+            return Close(s);
+        }
+
+        EncodeConfirmation(s.start, s.out);
+
+        if (s.start.NMissmatch(s.login)) {
+            LogError("Request N Packet missmatch. server:",
+                     s.start.to_transmit.Size(),
+                     "client:", s.login.N);
+            Metrics::Add(Metrics::NMismatches);
+            return Finish(s);
+        }
+
+        LogInfo("(" + s.start.uuid + ")", "will send", s.start.sending_from,
+                "to", s.start.sending_to);
+
+        // Step 4. the first packets go out straight away, the rest on the
+        // wheel as the pacer allows.
+        s.step        = Step::Stream;
+        s.next_packet = s.start.sending_from;
+        s.pacer       = Pacer(g_rate, g_burst, Clock::now());
+        s.acks.emplace(s.start);
+        return OnTimer(s);
+    }
+
+    // The link's first session turns out to be the client opening it for
+    // multiplexing. From now on it only carries frames.
+    bool OpenMux(Session& s)
+    {
+        auto& link = *s.link;
+        LogInfo("Multiplexed connection");
+        Erase(s);
+        link.mux     = true;
+        link.session = 0;
+        EncodeMuxAccept(link.out);
+        Flush(link);
+        return false;
+    }
+
+    // Moves the session's link, and the login read from it, to owner, as if
+    // it had been accepted there.
+    bool HandOver(Session& s, Reactor& owner)
+    {
+        auto& link = *s.link;
+        epoll_ctl(epoll_handle, EPOLL_CTL_DEL, link.handle, nullptr);
+        auto stream = TCPStream::FromHandle(link.handle);
+        vector<char> login(s.login_buffer, s.login_buffer + s.login_read);
+        Erase(s);
+        links.erase(link.id);
+        Metrics::Add(Metrics::Handovers);
+        owner.Adopt(stream, move(login));
+        return false;
+    }
+
+    bool OnTimer(Session& s)
+    {
+        if (s.step != Step::Stream) {
+            return true;
+        }
+
+        auto& uuid    = s.start.uuid;
+        auto& payload = *s.start.to_transmit.payload;
+
+        if (s.next_packet >= s.start.sending_to) {
+            // Step 5. Send the checksum and close everthing down.
+            auto checksum = payload.Checksum(s.start.Checksum());
+            LogInfo("(" + uuid + ")", "Payload sent, sending check sum",
+                    checksum);
+
+            Protocal::AppendTo(s.out, Protocal::DataComplete{ checksum });
+            return Finish(s);
+        }
+
+        if (s.acks->Overdue(Clock::now())) {
+            // checked even with the socket full, which is how a client that
+            // has stopped reading usually looks.
+            LogError("(" + uuid + ")", "No Ack after", s.acks->Acked(),
+                     "closing");
+            Metrics::Add(Metrics::AckTimeouts);
+            return Close(s);
+        }
+
+        if (s.link->want_write) {
+            // the client is not keeping up, so don't queue more until the
+            // socket drains.
+            wheel.Schedule(Clock::now() + 10ms, s.id);
+            return true;
+        }
+
+        auto total = s.start.sending_to;
+        auto now   = Clock::now();
+        auto n     = s.pacer.Take(now, total - s.next_packet);
+        if (n) {
+            auto queued = s.out.size();
+            EncodePackets(s.start, s.next_packet, n, s.out);
+            Metrics::Add(Metrics::BytesSent, s.out.size() - queued);
+            Metrics::Add(Metrics::PacketsSent, n);
+            auto first = s.next_packet == s.start.sending_from;
+            s.next_packet += n;
+
+            RecordProgress(s.start, s.next_packet);
+            s.acks->Sent(s.next_packet, now);
+            auto send_start = Clock::now();
+            if (!Send(s)) {
+                return false;
+            }
+            auto sent = Clock::now();
+            Metrics::Record(Metrics::SendCall, sent - send_start);
+            if (first) {
+                Metrics::Record(Metrics::LoginToFirstPacket, sent - s.logged_in);
+            }
+
+            if (FaultInjection::FlakyConnection()) {
+                LogError("(" + uuid + ")", "Fault injecting connection fail");
+                return Close(s);
+            }
+        }
+
+        wheel.Schedule(s.next_packet < total
+                         ? s.pacer.Next(total - s.next_packet)
+                         : now,
+                       s.id);
+        return true;
+    }
+
+    // Hands what the session has encoded to its link, framed as its
+    // stream's with mux, and sends as much as the socket takes.
+    bool Send(Session& s)
+    {
+        auto& link = *s.link;
+        if (!link.mux && link.out.empty()) {
+            // the usual case, nothing to copy.
+            swap(link.out, s.out);
+        } else if (!link.mux) {
+            link.out.insert(end(link.out), begin(s.out), end(s.out));
+        } else {
+            for (size_t at = 0; at < s.out.size();) {
+                auto n = static_cast<uint32_t>(
+                  min<size_t>(s.out.size() - at, Protocal::g_mux_frame_max));
+                Protocal::AppendTo(link.out,
+                                   Protocal::MuxFrame{ s.stream, n });
+                link.out.insert(end(link.out), begin(s.out) + at,
+                                begin(s.out) + at + n);
+                at += n;
+            }
+        }
+        s.out.clear();
+
+        auto id = s.id;
+        Flush(link);
+        return sessions.count(id) != 0;
+    }
+
+    // The session has nothing more to send. Alone on its link, the link is
+    // closed once that has all gone. With mux the stream is closed after it.
+    bool Finish(Session& s)
+    {
+        s.step = Step::Closing;
+        if (!Send(s)) {
+            return false;
+        }
+        if (!s.link->mux) {
+            return true;
+        }
+        Completed(s);
+        return Close(s);
+    }
+
+    void Completed(Session& s)
+    {
+        if (s.start.to_transmit.Size() == s.login.N) {
+            LogInfo("(" + s.start.uuid + ")",
+                    "Complete transmission, closed connection.");
+        }
+    }
+
+    bool Flush(Link& link)
+    {
+        while (link.out_sent < link.out.size()) {
+            auto r = send(link.handle, link.out.data() + link.out_sent,
+                          link.out.size() - link.out_sent, MSG_NOSIGNAL);
+            if (r > 0) {
+                link.out_sent += r;
+                continue;
+            }
+            if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                // the socket buffer is full, carry on once it drains.
+                return Watch(link, true);
+            }
+            LogError("Send result", r);
+            return DropLink(link);
+        }
+
+        link.out.clear();
+        link.out_sent = 0;
+
+        if (!link.mux && sessions.at(link.session)->step == Step::Closing) {
+            auto& s = *sessions.at(link.session);
+            Completed(s);
+            return Close(s);
+        }
+        return Watch(link, false);
+    }
+
+    bool Watch(Link& link, bool want_write)
+    {
+        if (link.want_write != want_write) {
+            epoll_event ev{};
+            ev.events   = EPOLLIN | EPOLLRDHUP
+                        | (want_write ? uint32_t(EPOLLOUT) : 0);
+            ev.data.u64 = link.id;
+            epoll_ctl(epoll_handle, EPOLL_CTL_MOD, link.handle, &ev);
+            link.want_write = want_write;
+        }
+        return true;
+    }
+
+    // The socket has gone, and every session on it.
+    bool DropLink(Link& link)
+    {
+        vector<uint64_t> ids;
+        if (link.mux) {
+            for (auto& i : link.streams) {
+                ids.push_back(i.second);
+            }
+        } else {
+            ids.push_back(link.session);
+        }
+        for (auto id : ids) {
+            auto& s = *sessions.at(id);
+            LogError("(" + s.start.uuid + ")", "Socket closed early");
+            Erase(s);
+        }
+        CloseLink(link);
+        return false;
+    }
+
+    // Alone on its link, the link goes too. With mux the client is told the
+    // stream is closed.
+    bool Close(Session& s)
+    {
+        auto& link  = *s.link;
+        auto stream = s.stream;
+        Erase(s);
+        if (!link.mux) {
+            CloseLink(link);
+            return false;
+        }
+        Protocal::AppendTo(link.out, Protocal::MuxFrame{ stream, 0 });
+        Flush(link);
+        return false;
+    }
+
+    void Erase(Session& s)
+    {
+        LogTrace("removing client ", s.start.uuid);
+        if (s.link->mux) {
+            s.link->streams.erase(s.stream);
+        }
+        sessions.erase(s.id);
+        Metrics::Add(Metrics::SessionsEnded);
+    }
+
+    void CloseLink(Link& link)
+    {
+        closesocket(link.handle);
+        links.erase(link.id);
+    }
+
+    ISharedState* shared;
+    int core;
+    vector<Reactor*> owners;
+    int epoll_handle;
+    int wake_handle;
+
+    TimerWheel<uint64_t> wheel;
+    unordered_map<uint64_t, unique_ptr<Link>> links;
+    unordered_map<uint64_t, unique_ptr<Session>> sessions;
+    uint64_t next_id;
+
+    mutex lock;
+    vector<pair<SOCKET, vector<char>>> adopted;
+
+    atomic<bool> running;
+    thread loop;
+};
+
+// With -listeners, one of several threads accepting on the same port, each on
+// a socket of its own with SO_REUSEPORT, so the kernel spreads new
+// connections over them rather than one thread accepting them all. What it
+// accepts goes to its own reactor, on the same core.
+class AcceptThread
+{
+  public:
+    AcceptThread(int port, Reactor& reactor, int core)
+      : socket{ port, true }
+      , reactor{ reactor }
+      , running{ true }
+    {
+        loop = thread(&AcceptThread::Run, this, core);
+    }
+
+    ~AcceptThread()
+    {
+        running = false;
+        loop.join();
+        socket.Close();
+    }
+
+  private:
+    void Run(int core)
+    {
+        if (!Common::PinToCore(core)) {
+            LogError("Could not pin listener to core", core);
+        }
+        vector<TCPStream*> sockets{ &socket };
+        while (running) {
+            if (WaitForAccept(sockets, 1s) < 0) {
+                continue;
+            }
+            try {
+                reactor.Adopt(socket.Accept());
+            } catch (runtime_error& e) {
+                LogError(e.what());
+            }
+        }
+    }
+
+    TCPStream socket;
+    Reactor& reactor;
+    atomic<bool> running;
+    thread loop;
+};
+} // namespace Server
+#else
+namespace Server {
+// epoll is linux only, elsewhere the server always uses the blocking core.
+class Reactor
+{
+  public:
+    void Adopt(TCPStream) {}
+};
+} // namespace Server
+#endif // __linux__
@@ -0,0 +1,491 @@
+#pragma once
+
+// The protocol between a server using RemoteSharedState and a state_server.
+// Fixed size records, type-punned like the client protocol. Requests carry an
+// id that the reply echoes, so any number can be in flight on one connection.
+namespace StateProtocol {
+enum class Op : uint32_t
+{
+    Get      = 1, // replied to
+    Register = 2, // replied to, with whichever payload won
+    LastSent = 3,
+    Erase    = 4,
+    Size     = 5, // replied to, with the count in size
+};
+
+struct Request
+{
+    uint32_t op;
+    uint32_t id;
+    char uuid[40];
+    uint64_t seed;
+    uint32_t size;
+    uint32_t last_sent;
+};
+
+struct Reply
+{
+    uint32_t id;
+    uint32_t found;
+    uint64_t seed;
+    uint32_t size;
+    uint32_t last_sent;
+};
+
+Request MakeRequest(Op op, const string& uuid)
+{
+    Request r{};
+    r.op = static_cast<uint32_t>(op);
+    copy_n(uuid.data(), min(uuid.size(), sizeof(r.uuid)), r.uuid);
+    return r;
+}
+
+string UUIDOf(const Request& r)
+{
+    return string(begin(r.uuid), find(begin(r.uuid), end(r.uuid), '\0'));
+}
+} // namespace StateProtocol
+
+namespace Server {
+// Sessions kept by a state_server, so several servers can resume each others
+// sessions.
+// Get and Register wait on a reply, but many can be in flight at once, from
+// any number of threads, over the one connection. Everything else is sent
+// without waiting.
+// Sessions in use here are tracked, and progress is recorded through their
+// handles as usual. A background thread sends the last_sent of any that
+// moved every flush_interval, or sooner along with any request, so a session
+// costs one update an interval rather than a round trip a packet. A resume
+// that sees a slightly old last_sent only resends a little.
+// If the connection drops, the requests in flight fail, as does any asked
+// for before the reader thread reconnects, backing off between tries. Once
+// back, the last_sent of every tracked session is sent again.
+class RemoteSharedState : public ISharedState
+{
+  public:
+    RemoteSharedState(const char* host, int port, bool lazy_payloads,
+                      chrono::milliseconds flush_interval)
+      : host{ host }
+      , port{ port }
+      , conn(host, port)
+      , lazy_payloads{ lazy_payloads }
+      , flush_interval{ flush_interval }
+      , next_id{ 1 }
+      , running{ true }
+      , connected{ true }
+      , sending{ false }
+      , resend_all{ false }
+      , last_sent_updates{ 0 }
+    {
+        reader = thread(&RemoteSharedState::ReadReplies, this);
+        writer = thread(&RemoteSharedState::WriteRequests, this);
+    }
+
+    ~RemoteSharedState()
+    {
+        {
+            lock_guard<mutex> scope_guard(lock);
+            running = false;
+        }
+        wake.notify_all();
+        writer.join();
+
+        {
+            lock_guard<mutex> scope_guard(lock);
+            if (connected) {
+                shutdown(conn.Handle(), 2); // wakes the reader
+            }
+        }
+        reader.join();
+
+        LogInfo("Sent the state server", last_sent_updates.load(),
+                "last sent updates");
+    }
+
+    virtual ConnectionState RegisterNewTransmission(const string& id,
+                                                    PayloadPtr payload) override
+    {
+        auto r = StateProtocol::MakeRequest(StateProtocol::Op::Register, id);
+        r.seed = payload->Seed();
+        r.size = payload->Size();
+
+        return Track(id, Call(r), move(payload));
+    }
+
+    virtual ConnectionState GetTransmission(const string& id) override
+    {
+        auto reply = Call(StateProtocol::MakeRequest(StateProtocol::Op::Get, id));
+        if (!reply.found) {
+            return {};
+        }
+        return Track(id, reply, nullptr);
+    }
+
+    virtual void SetTransmissionLastSent(const string& id,
+                                         uint32_t last_sent) override
+    {
+        {
+            lock_guard<mutex> scope_guard(tracked_lock);
+            auto i = tracked.find(id);
+            if (i != end(tracked)) {
+                i->second.progress->Set(last_sent);
+                return;
+            }
+        }
+
+        auto r = StateProtocol::MakeRequest(StateProtocol::Op::LastSent, id);
+        r.last_sent = last_sent;
+        Send(r);
+    }
+
+    virtual void EraseTransmission(const string& id) override
+    {
+        {
+            lock_guard<mutex> scope_guard(tracked_lock);
+            tracked.erase(id);
+        }
+        Send(StateProtocol::MakeRequest(StateProtocol::Op::Erase, id));
+    }
+
+    // The state_server expires sessions. Here only sessions no connection is
+    // using, and whose progress has been sent, are let go.
+    virtual void RemoveExpiredSessions() override
+    {
+        lock_guard<mutex> scope_guard(tracked_lock);
+        for (auto i = begin(tracked); i != end(tracked);) {
+            auto& t = i->second;
+            if (t.payload.use_count() == 1 && t.progress.use_count() == 1
+                && t.progress->last_sent == t.sent) {
+                i = tracked.erase(i);
+            } else {
+                ++i;
+            }
+        }
+    }
+
+    virtual size_t Size() override
+    {
+        return Call(StateProtocol::MakeRequest(StateProtocol::Op::Size, ""))
+          .size;
+    }
+
+  private:
+    static constexpr chrono::milliseconds g_first_retry = 100ms;
+    static constexpr chrono::milliseconds g_max_retry   = 5s;
+
+    // A session with connections here.
+    struct Tracked
+    {
+        PayloadPtr payload;
+        ProgressPtr progress;
+
+        // The last_sent the state server last had from us.
+        uint32_t sent;
+    };
+
+    StateProtocol::Reply Call(StateProtocol::Request r)
+    {
+        future<StateProtocol::Reply> reply;
+        {
+            lock_guard<mutex> scope_guard(lock);
+            if (!connected) {
+                throw runtime_error("Lost the state server");
+            }
+            r.id  = next_id++;
+            reply = waiting[r.id].get_future();
+            requests.push_back(r);
+        }
+        wake.notify_all();
+        return reply.get();
+    }
+
+    // Without waiting for a reply, there being none. Dropped while the
+    // connection is down, the state server expires what it misses.
+    void Send(const StateProtocol::Request& r)
+    {
+        {
+            lock_guard<mutex> scope_guard(lock);
+            if (!connected) {
+                return;
+            }
+            requests.push_back(r);
+        }
+        wake.notify_all();
+    }
+
+    // The session for id, as the state server has it. The payload is made
+    // from its seed here, unless this process already has it, or made it
+    // (mine). Connections in this process to the same session share its
+    // progress.
+    ConnectionState Track(const string& id, const StateProtocol::Reply& reply,
+                          PayloadPtr mine)
+    {
+        auto same = [&](const PayloadPtr& p) {
+            return p && p->Seed() == reply.seed && p->Size() == reply.size;
+        };
+
+        {
+            lock_guard<mutex> scope_guard(tracked_lock);
+            auto i = tracked.find(id);
+            if (i != end(tracked) && same(i->second.payload)) {
+                return Catchup(i->second, reply.last_sent);
+            }
+        }
+
+        if (!same(mine)) {
+            mine = lazy_payloads ? Payload::Lazy(reply.seed, reply.size)
+                                 : Payload::Stored(reply.seed, reply.size);
+        }
+
+        lock_guard<mutex> scope_guard(tracked_lock);
+        auto& t = tracked[id];
+        if (!same(t.payload)) {
+            t.payload  = move(mine);
+            t.progress = make_shared<SessionProgress>(
+              reply.last_sent, chrono::system_clock::now());
+            t.sent = reply.last_sent;
+        }
+        return Catchup(t, reply.last_sent);
+    }
+
+    // Another server may have got the session further than this one knows.
+    ConnectionState Catchup(Tracked& t, uint32_t remote_last_sent)
+    {
+        if (remote_last_sent > t.progress->last_sent) {
+            t.progress->Set(remote_last_sent);
+            t.sent = remote_last_sent;
+        }
+        return { t.payload, t.progress };
+    }
+
+    void WriteRequests()
+    {
+        vector<StateProtocol::Request> batch;
+        vector<StateProtocol::Request> queued;
+
+        unique_lock<mutex> wait_lock(lock);
+        while (running) {
+            wake.wait_for(wait_lock, flush_interval, [this] {
+                return !running
+                       || (connected && (!requests.empty() || resend_all));
+            });
+            if (!connected) {
+                continue;
+            }
+            swap(queued, requests);
+            auto all = exchange(resend_all, false);
+            sending  = true;
+            wait_lock.unlock();
+
+            // progress first, and read after taking the requests, so a Get
+            // queued after recording progress sees it.
+            batch.clear();
+            {
+                lock_guard<mutex> scope_guard(tracked_lock);
+                for (auto& i : tracked) {
+                    auto last_sent = i.second.progress->last_sent.load();
+                    if (all || last_sent != i.second.sent) {
+                        auto r = StateProtocol::MakeRequest(
+                          StateProtocol::Op::LastSent, i.first);
+                        r.last_sent = last_sent;
+                        batch.push_back(r);
+                        i.second.sent = last_sent;
+                    }
+                }
+            }
+            last_sent_updates += batch.size();
+            batch.insert(end(batch), begin(queued), end(queued));
+            queued.clear();
+
+            auto sent = true;
+            if (!batch.empty()) {
+                try {
+                    conn.SendN(batch.size() * sizeof(batch[0]), batch.data());
+                } catch (socket_close_exception&) {
+                    sent = false;
+                }
+            }
+
+            wait_lock.lock();
+            sending = false;
+            if (!sent && connected) {
+                Fail();
+                shutdown(conn.Handle(), 2); // the reader reconnects
+            }
+            wake.notify_all();
+        }
+    }
+
+    // Reads replies until the connection drops, and then reconnects, until
+    // stopped.
+    void ReadReplies()
+    {
+        do {
+            ReadUntilClosed();
+
+            unique_lock<mutex> wait_lock(lock);
+            Fail();
+            // the writer may still be using the handle.
+            wake.wait(wait_lock, [this] { return !sending; });
+            conn.Close();
+        } while (Reconnect());
+    }
+
+    void ReadUntilClosed()
+    {
+        BufferedStream buffered(conn);
+        auto in = TSerialToStream{ buffered };
+        try {
+            for (;;) {
+                auto reply = in.RecvN<StateProtocol::Reply>();
+
+                lock_guard<mutex> scope_guard(lock);
+                auto i = waiting.find(reply.id);
+                if (i != end(waiting)) {
+                    i->second.set_value(reply);
+                    waiting.erase(i);
+                }
+            }
+        } catch (socket_close_exception&) {
+        }
+    }
+
+    // Tries to connect again, each try waiting twice as long as the last, up
+    // to g_max_retry. False if stopped first.
+    bool Reconnect()
+    {
+        auto delay = g_first_retry;
+        unique_lock<mutex> wait_lock(lock);
+        for (;;) {
+            if (wake.wait_for(wait_lock, delay, [this] { return !running; })) {
+                return false;
+            }
+            wait_lock.unlock();
+            try {
+                TCPStream fresh(host.c_str(), port);
+                wait_lock.lock();
+                if (!running) {
+                    fresh.Close();
+                    return false;
+                }
+                conn       = fresh;
+                connected  = true;
+                resend_all = true;
+                LogInfo("Reconnected to the state server");
+                wake.notify_all();
+                return true;
+            } catch (runtime_error&) {
+                wait_lock.lock();
+            }
+            delay = min(delay * 2, g_max_retry);
+        }
+    }
+
+    // With lock held. Everything waiting, or asked for until the connection
+    // is back, gets an error.
+    void Fail()
+    {
+        if (running && connected) {
+            LogError("Lost the state server, reconnecting");
+        }
+        connected = false;
+        for (auto& i : waiting) {
+            i.second.set_exception(
+              make_exception_ptr(runtime_error("Lost the state server")));
+        }
+        waiting.clear();
+        // nothing would wait on the replies to these.
+        requests.erase(remove_if(begin(requests), end(requests),
+                                 [](auto& r) { return r.id != 0; }),
+                       end(requests));
+        wake.notify_all();
+    }
+
+    string host;
+    int port;
+    TCPStream conn;
+    bool lazy_payloads;
+    chrono::milliseconds flush_interval;
+
+    mutex lock;
+    condition_variable wake;
+    uint32_t next_id;
+    bool running;
+    bool connected;
+    bool sending;    // the writer is using conn, without the lock.
+    bool resend_all; // the connection is new, so send every last_sent.
+    vector<StateProtocol::Request> requests;
+    unordered_map<uint32_t, promise<StateProtocol::Reply>> waiting;
+
+    mutex tracked_lock;
+    unordered_map<string, Tracked> tracked;
+
+    atomic<uint64_t> last_sent_updates;
+
+    thread reader;
+    thread writer;
+};
+
+// One connection to the state_server, from a server using
+// RemoteSharedState. Requests are answered in order against the local state.
+// Replies gather until there are no more requests waiting to be read, and then
+// go out together.
+void ServeStateConnection(LocalSharedState* shared, INetStream& stream)
+{
+    BufferedStream buffered(stream);
+    auto conn = TSerialToStream{ buffered };
+    try {
+        for (;;) {
+            auto r  = conn.RecvN<StateProtocol::Request>();
+            auto id = StateProtocol::UUIDOf(r);
+
+            StateProtocol::Reply reply{};
+            reply.id = r.id;
+            switch (static_cast<StateProtocol::Op>(r.op)) {
+                case StateProtocol::Op::Get: {
+                    auto s = shared->GetTransmission(id);
+                    if (s.payload) {
+                        reply.found     = 1;
+                        reply.seed      = s.payload->Seed();
+                        reply.size      = s.Size();
+                        reply.last_sent = s.last_sent;
+                    }
+                    conn.SendN(reply);
+                    break;
+                }
+                case StateProtocol::Op::Register: {
+                    // only the seed is needed here, the servers make the ints.
+                    auto s = shared->RegisterNewTransmission(
+                      id, Payload::Lazy(r.seed, r.size));
+                    reply.found     = 1;
+                    reply.seed      = s.payload->Seed();
+                    reply.size      = s.Size();
+                    reply.last_sent = s.last_sent;
+                    conn.SendN(reply);
+                    break;
+                }
+                case StateProtocol::Op::LastSent:
+                    shared->SetTransmissionLastSent(id, r.last_sent);
+                    break;
+                case StateProtocol::Op::Erase:
+                    shared->EraseTransmission(id);
+                    break;
+                case StateProtocol::Op::Size:
+                    reply.size = static_cast<uint32_t>(shared->Size());
+                    conn.SendN(reply);
+                    break;
+                default:
+                    LogError("Unknown state request", r.op);
+                    stream.Close();
+                    return;
+            }
+
+            if (!buffered.WaitForDataToRecv(chrono::seconds(0))) {
+                conn.Flush();
+            }
+        }
+    } catch (socket_close_exception&) {
+    }
+    stream.Close();
+}
+} // namespace Server
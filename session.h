@@ -0,0 +1,514 @@
+#pragma once
+
+namespace Server {
+// Data packets sent per second per session, and how many may go at once after
+// falling behind.
+uint32_t g_rate  = 1;
+uint32_t g_burst = 1;
+
+// Lazy payloads are made from their seed as they are sent, rather than held.
+bool g_lazy_payloads = false;
+
+// Features this server will agree to in a Hello.
+const uint32_t g_supported_features = Protocal::Feature_DataBatch
+                                      | Protocal::Feature_Checksum
+                                      | Protocal::Feature_ChunkCheck
+                                      | Protocal::Feature_Range
+                                      | Protocal::Feature_ResumeToken
+                                      | Protocal::Feature_Ack;
+
+// Resume tokens, see Protocal::Feature_ResumeToken, are only taken from a
+// server with the same key.
+string g_resume_key;
+
+// How long a client that owes an Ack has to send it before its connection is
+// given up on, see AckTracker. 0 for never.
+chrono::milliseconds g_ack_timeout = 10s;
+
+// The server never puts more than this many ints in one DataBatch.
+const uint32_t g_batch_limit = 1 << 16;
+
+// The result of steps 1 to 3 of a transmission. Both the threaded and the
+// epoll server cores go through here, so a login resolves the same way no
+// matter which one accepted the socket.
+struct SessionStart
+{
+    string uuid;
+    ISharedState::ConnectionState to_transmit;
+    uint32_t sending_from;
+
+    // Where sending stops. The end of the payload, unless the client asked
+    // for a range.
+    uint32_t sending_to;
+
+    // Only old clients log in without a Hello, and so get no reply Hello.
+    bool has_hello;
+    Protocal::Hello hello;
+
+    // With Feature_Range, to_transmit is the range's own, so its progress is
+    // recorded as a whole transmission's is.
+    bool range;
+
+    bool Batched() const
+    {
+        return has_hello && (hello.features & Protocal::Feature_DataBatch);
+    }
+
+    // Most payload ints in one frame. Without batching each is its own
+    // DataPacket.
+    uint32_t FrameMax() const { return Batched() ? hello.batch_max : 1; }
+
+    // Ints per ChunkChecksum, 0 for none.
+    uint32_t ChunkSize() const
+    {
+        return has_hello && (hello.features & Protocal::Feature_ChunkCheck)
+                 ? hello.chunk_size
+                 : 0;
+    }
+
+    // Where a frame starting at 'from' ends, given the frame size, and that
+    // a frame never spans the end of a chunk.
+    uint32_t FrameEnd(uint32_t from, uint32_t to) const
+    {
+        auto end = from + min(FrameMax(), to - from);
+        if (auto chunk = ChunkSize()) {
+            end = min(end, (from / chunk + 1) * chunk);
+        }
+        return end;
+    }
+
+    // If a ChunkChecksum is due after the int before 'at'.
+    bool EndsChunk(uint32_t at) const
+    {
+        auto chunk = ChunkSize();
+        return chunk && (at % chunk == 0 || at == to_transmit.Size());
+    }
+
+    // The ChunkChecksum for the chunk ending at 'at'.
+    Protocal::ChunkChecksum ChunkCheck(uint32_t at) const
+    {
+        auto from = (at - 1) / ChunkSize() * ChunkSize();
+        return { to_transmit.payload->Crc32c(from, at - from) };
+    }
+
+    // Ints between the client's Acks, 0 for none.
+    uint32_t AckEvery() const
+    {
+        return has_hello && (hello.features & Protocal::Feature_Ack)
+                 ? hello.ack_every
+                 : 0;
+    }
+
+    // A re-fetch of part of the payload, rather than the rest of it.
+    bool Ranged() const { return !range && sending_to < to_transmit.Size(); }
+
+    // The checksum the DataComplete holds.
+    Common::ChecksumAlgo Checksum() const
+    {
+        return has_hello && (hello.features & Protocal::Feature_Checksum)
+                 ? static_cast<Common::ChecksumAlgo>(hello.checksum)
+                 : Common::ChecksumAlgo::Legacy;
+    }
+
+    Protocal::LoginConfirmed Confirmation() const
+    {
+        return { sending_from, to_transmit.Size() };
+    }
+
+    // The client and server disagree on N. The client is still sent the
+    // LoginConfirmed, so both ends see the missmatch and give up.
+    bool NMissmatch(const Protocal::LoginRequest& login) const
+    {
+        return to_transmit.Size() != login.N;
+    }
+};
+
+string UUIDFromLogin(const Protocal::LoginRequest& login)
+{
+    return string(begin(login.uuid),
+                  find(begin(login.uuid), end(login.uuid), '\0'));
+}
+
+// The id a range's progress is kept under, in the same ISharedState as its
+// uuid. Ids are stored as at most 40 chars, so the uuid goes in as a hash.
+string RangeKey(const string& uuid, uint32_t range_from)
+{
+    char key[40];
+    snprintf(key, sizeof(key), "range-%016llx-%u",
+             (unsigned long long)Common::Fnv1a(uuid), range_from);
+    return key;
+}
+
+// A resume token is the session's payload seed, and a keyed hash of it with
+// the uuid and N, so a server can make the same payload again from it without
+// looking the session up. The hash stops a token being taken for another
+// session, or from a server with another key. It is not a MAC, but a made up
+// token only gets the ints of a seed of the client's choosing.
+const uint32_t g_resume_token_version = 1;
+
+uint32_t ResumeTokenCheck(const string& uuid, uint32_t N, uint64_t seed)
+{
+    return static_cast<uint32_t>(Common::Fnv1a(
+      g_resume_key + '\0' + uuid + '\0' + to_string(N) + ':'
+      + to_string(seed)));
+}
+
+void IssueResumeToken(const string& uuid, uint32_t N, uint64_t seed,
+                      uint32_t (&token)[4])
+{
+    token[0] = g_resume_token_version;
+    token[1] = static_cast<uint32_t>(seed);
+    token[2] = static_cast<uint32_t>(seed >> 32);
+    token[3] = ResumeTokenCheck(uuid, N, seed);
+}
+
+// False for a token that isn't this session's.
+bool ReadResumeToken(const uint32_t (&token)[4], const string& uuid,
+                     uint32_t N, uint64_t& seed)
+{
+    seed = token[1] | uint64_t(token[2]) << 32;
+    return token[0] == g_resume_token_version
+           && token[3] == ResumeTokenCheck(uuid, N, seed);
+}
+
+// Reads a login from a blocking stream, with its Hello if it has one.
+// Returns false for a login without a Hello.
+bool RecvLogin(TSerialToStream& conn, Protocal::Hello& hello,
+               Protocal::LoginRequest& login)
+{
+    char buffer[Protocal::g_login_max_size];
+    size_t have = 0;
+    while (auto need = Protocal::LoginBytesNeeded(buffer, have)) {
+        conn.stream.RecvN(need, buffer + have);
+        have += need;
+    }
+    return Protocal::DecodeLogin(buffer, hello, login);
+}
+
+// client_hello is null for an old client.
+SessionStart ResolveLogin(ISharedState* server_shared,
+                          const Protocal::LoginRequest& login,
+                          const Protocal::Hello* client_hello)
+{
+    SessionStart s;
+    s.uuid = UUIDFromLogin(login);
+
+    s.has_hello = client_hello != nullptr;
+    s.hello     = {};
+    if (client_hello) {
+        auto features = client_hello->features & g_supported_features;
+        if (!client_hello->batch_max) {
+            features &= ~Protocal::Feature_DataBatch;
+        }
+        if (client_hello->checksum
+            > static_cast<uint32_t>(Common::ChecksumAlgo::Crc32c)) {
+            features &= ~Protocal::Feature_Checksum;
+        }
+        if (!client_hello->chunk_size) {
+            features &= ~Protocal::Feature_ChunkCheck;
+        }
+        if (client_hello->fetch_to <= client_hello->range_from) {
+            features &= ~Protocal::Feature_Range;
+        }
+        if (!client_hello->ack_every) {
+            features &= ~Protocal::Feature_Ack;
+        }
+        s.hello           = Protocal::MakeHello(features);
+        s.hello.batch_max = min(client_hello->batch_max, g_batch_limit);
+        if (features & Protocal::Feature_Checksum) {
+            s.hello.checksum = client_hello->checksum;
+        }
+        if (features & Protocal::Feature_ChunkCheck) {
+            s.hello.chunk_size = client_hello->chunk_size;
+        }
+        if (features & Protocal::Feature_Range) {
+            s.hello.range_from = client_hello->range_from;
+        }
+        if (features & Protocal::Feature_Ack) {
+            s.hello.ack_every = client_hello->ack_every;
+        }
+        LogTrace("(" + s.uuid + ")", "agreed features", features,
+                 "batch max", s.hello.batch_max, "checksum",
+                 Common::ToString(s.Checksum()));
+    }
+    s.range = s.has_hello && (s.hello.features & Protocal::Feature_Range);
+
+    uint64_t token_seed = 0;
+    auto token = s.has_hello
+                 && (s.hello.features & Protocal::Feature_ResumeToken)
+                 && ReadResumeToken(client_hello->resume_token, s.uuid,
+                                    login.N, token_seed);
+
+    LogInfo("login for", s.uuid);
+    Metrics::Add(Metrics::Logins);
+    LogInfo("(" + s.uuid + ")", "requested", login.packets_seen, "to",
+            login.N);
+
+    // Step 2. Get the previous state, if any. A range has its own, kept
+    // alongside its uuid's.
+    auto id = s.range ? RangeKey(s.uuid, s.hello.range_from) : s.uuid;
+    s.to_transmit = server_shared->GetTransmission(id);
+    auto remade   = false;
+    if (!s.to_transmit.payload) {
+        // new transmission, or one that had time out and we've
+        // forgotten. A new range shares its uuid's payload with the other
+        // ranges, making it if it is the first.
+        ISharedState::PayloadPtr payload;
+        if (s.range) {
+            payload = server_shared->GetTransmission(s.uuid).payload;
+        }
+        if (!payload) {
+            // a token's session is made again as it was.
+            auto seed = token ? token_seed : PayloadGen::RandomSeed();
+            payload   = g_lazy_payloads ? Payload::Lazy(seed, login.N)
+                                        : Payload::Stored(seed, login.N);
+        }
+        remade = token && payload->Seed() == token_seed;
+        if (s.range) {
+            payload =
+              server_shared->RegisterNewTransmission(s.uuid, move(payload))
+                .payload;
+        }
+        // if another login for this uuid raced us here, theirs is used.
+        s.to_transmit =
+          server_shared->RegisterNewTransmission(id, move(payload));
+    } else {
+        LogInfo("(" + s.uuid + ")", "resumed. Last sent ",
+                s.to_transmit.last_sent);
+        Metrics::Add(Metrics::Resumes);
+    }
+
+    if (remade && s.to_transmit.payload->Seed() == token_seed) {
+        LogInfo("(" + s.uuid + ")", "made again from its resume token");
+        Metrics::Add(Metrics::TokenResumes);
+    } else {
+        remade = false;
+    }
+
+    // Step 3. Calc where to start.
+    // This is the min of were both ends thought they had gotten to. Only
+    // the client knows how far a session made again has got.
+    s.sending_from = remade ? min(login.packets_seen, s.to_transmit.Size())
+                            : min(s.to_transmit.last_sent, login.packets_seen);
+
+    // and where to stop.
+    s.sending_to = s.to_transmit.Size();
+    if (s.range) {
+        // never outside the range. A new one has sent nothing, so starts
+        // at its beginning.
+        s.sending_to   = min(s.sending_to, client_hello->fetch_to);
+        s.sending_from = clamp(s.sending_from,
+                               min(s.hello.range_from, s.sending_to),
+                               s.sending_to);
+        LogInfo("(" + s.uuid + ")", "range", s.hello.range_from, "sending",
+                s.sending_from, "to", s.sending_to);
+    } else if (s.ChunkSize() && client_hello->fetch_to) {
+        s.sending_to   = min(s.sending_to, client_hello->fetch_to);
+        s.sending_from = min(s.sending_from, s.sending_to);
+        LogInfo("(" + s.uuid + ")", "re-fetching", s.sending_from, "to",
+                s.sending_to);
+    }
+    if (s.ChunkSize() || s.range) {
+        s.hello.fetch_to = s.sending_to;
+    }
+    if (s.has_hello && (s.hello.features & Protocal::Feature_ResumeToken)) {
+        IssueResumeToken(s.uuid, s.to_transmit.Size(),
+                         s.to_transmit.payload->Seed(), s.hello.resume_token);
+    }
+    return s;
+}
+
+// The reply to a login. The Hello goes first, if the client sent one.
+void EncodeConfirmation(const SessionStart& s, vector<char>& out)
+{
+    if (s.has_hello) {
+        Protocal::AppendTo(out, s.hello);
+    }
+    Protocal::AppendTo(out, s.Confirmation());
+}
+
+// The reply to a Protocal::IsMuxOpener login, agreeing to multiplex.
+void EncodeMuxAccept(vector<char>& out)
+{
+    Protocal::AppendTo(out, Protocal::MakeHello(Protocal::Feature_Mux));
+    Protocal::AppendTo(out, Protocal::LoginConfirmed{});
+}
+
+// Step 4. Encodes 'count' payload ints, starting at 'from', in the frames the
+// client agreed to.
+void EncodePackets(const SessionStart& s, uint32_t from, uint32_t count,
+                   vector<char>& out)
+{
+    auto& payload = *s.to_transmit.payload;
+    auto to       = from + count;
+
+    for (auto pi = from; pi < to;) {
+        auto n = s.FrameEnd(pi, to) - pi;
+        if (s.Batched()) {
+            Protocal::AppendTo(out, Protocal::DataBatch{ n });
+        }
+
+        // the ints are read, or made, straight in to out. A DataPacket is
+        // only an int, so a run of them is laid out the same.
+        auto at = out.size();
+        out.resize(at + n * sizeof(uint32_t));
+        auto data = reinterpret_cast<uint32_t*>(out.data() + at);
+        payload.Read(pi, n, data);
+
+        for (uint32_t i = 0; i < n; ++i) {
+            LogTrace("(" + s.uuid + ")", "sent packet", pi + i, "value",
+                     data[i]);
+            data[i] += FaultInjection::FlakyData();
+        }
+        pi += n;
+
+        if (s.EndsChunk(pi)) {
+            Protocal::AppendTo(out, s.ChunkCheck(pi));
+        }
+    }
+}
+
+// Step 4, without copying.
+// When nothing needs altering on the way out, a batched run of ints is sent
+// straight from the payload. Streams like UringStream can then hand it to the
+// kernel zero copy.
+bool CanSendInPlace(const SessionStart& s)
+{
+    return s.Batched() && s.to_transmit.payload->Data()
+           && !FaultInjection::g_flaky_data && g_log_level < LogLevel::Trace;
+}
+
+// headers and checks are only filled here so the slices have somewhere to
+// point.
+void SlicePackets(const SessionStart& s, uint32_t from, uint32_t count,
+                  vector<Protocal::DataBatch>& headers,
+                  vector<Protocal::ChunkChecksum>& checks,
+                  vector<IoSlice>& slices)
+{
+    auto& payload = *s.to_transmit.payload;
+    auto to       = from + count;
+
+    // reserved up front, so nothing moves once pointed to.
+    auto frames = (count + s.FrameMax() - 1) / s.FrameMax();
+    if (auto chunk = s.ChunkSize()) {
+        frames += count / chunk + 2;
+    }
+    headers.clear();
+    checks.clear();
+    slices.clear();
+    headers.reserve(frames);
+    checks.reserve(frames);
+    for (auto pi = from; pi < to;) {
+        auto n = s.FrameEnd(pi, to) - pi;
+        headers.push_back({ n });
+        slices.push_back({ &headers.back(), sizeof(Protocal::DataBatch) });
+        slices.push_back({ payload.Data() + pi, n * sizeof(uint32_t) });
+        pi += n;
+
+        if (s.EndsChunk(pi)) {
+            checks.push_back(s.ChunkCheck(pi));
+            slices.push_back(
+              { &checks.back(), sizeof(Protocal::ChunkChecksum) });
+        }
+    }
+}
+
+// Records that the ints before 'sent_to' have gone out, through the
+// sessions progress handle, so without a lock or a lookup.
+// A re-fetch is behind where the session had got to, so does not move it
+// back. A range moves its own.
+void RecordProgress(const SessionStart& s, uint32_t sent_to)
+{
+    if (!s.Ranged()) {
+        s.to_transmit.progress->Set(sent_to - 1);
+    }
+}
+
+// With Feature_Ack, a connection's view of its client's Acks. An Ack is owed
+// once the ints sent cross a multiple of ack_every past the last one. A client
+// that owes one for g_ack_timeout has stopped reading, or gone, and is given
+// up on rather than sent to until the socket fails. Acks are not progress,
+// the client's packets_seen already makes a resume exact.
+class AckTracker
+{
+  public:
+    using Clock = chrono::steady_clock;
+
+    explicit AckTracker(const SessionStart& s)
+      : every{ s.AckEvery() }
+      , acked{ s.sending_from }
+      , sent{ s.sending_from }
+      , read{ 0 }
+      , owed{ false }
+    {}
+
+    bool On() const { return every != 0; }
+    uint32_t Acked() const { return acked; }
+
+    // The ints before sent_to have gone out.
+    void Sent(uint32_t sent_to, Clock::time_point now)
+    {
+        sent = sent_to;
+        if (!owed && Owes()) {
+            owed       = true;
+            owed_since = now;
+        }
+    }
+
+    // Bytes from the client, in pieces of any size. Throws on anything but
+    // an Ack for ints it was sent.
+    void Read(const char* data, size_t n, Clock::time_point now)
+    {
+        while (n) {
+            auto take = min(n, sizeof(partial) - read);
+            memcpy(partial + read, data, take);
+            read += take;
+            data += take;
+            n -= take;
+            if (read < sizeof(partial)) {
+                return;
+            }
+            read = 0;
+
+            Protocal::Ack ack;
+            memcpy(&ack, partial, sizeof(ack));
+            if (!On() || ack.packets_seen < acked || ack.packets_seen > sent) {
+                throw runtime_error("Bad Ack of "
+                                    + to_string(ack.packets_seen));
+            }
+            acked      = ack.packets_seen;
+            owed       = Owes();
+            owed_since = now;
+        }
+    }
+
+    // Reads whatever the client has sent, without waiting.
+    void ReadFrom(INetStream& stream)
+    {
+        char bytes[64];
+        while (stream.WaitForDataToRecv(0s) > 0) {
+            auto got = stream.RecvSome(sizeof(bytes), bytes);
+            Read(bytes, got, Clock::now());
+        }
+    }
+
+    bool Overdue(Clock::time_point now) const
+    {
+        return owed && g_ack_timeout.count()
+               && now - owed_since >= g_ack_timeout;
+    }
+
+  private:
+    bool Owes() const { return every && sent / every > acked / every; }
+
+    uint32_t every;
+    uint32_t acked;
+    uint32_t sent;
+
+    char partial[sizeof(Protocal::Ack)];
+    size_t read;
+
+    bool owed;
+    Clock::time_point owed_since;
+};
+} // namespace Server
@@ -0,0 +1,375 @@
+#pragma once
+
+namespace Server {
+// What a SessionStore keeps of one session. A payload is made from its seed,
+// so this is all it takes to resume one, whatever N is.
+struct SessionRecord
+{
+    enum State : uint32_t
+    {
+        Empty  = 0,
+        Used   = 1,
+        Erased = 2, // a tombstone, so probing carries on past it.
+    };
+
+    enum Flags : uint32_t
+    {
+        Flag_Lazy = 1 << 0,
+    };
+
+    char uuid[40];   // as in the LoginRequest, zero padded.
+    uint32_t state;  // State
+    uint32_t flags;  // Flags
+    uint64_t seed;
+    uint32_t size;   // N
+    uint32_t check;  // Crc32c of everything above, bar state, written last.
+    int64_t last_seen; // system_clock ticks
+    uint32_t last_sent;
+    uint32_t reserved;
+
+    uint32_t Check() const
+    {
+        auto crc = Common::Crc32cUpdate(0xffffffff, uuid, sizeof(uuid));
+        crc      = Common::Crc32cUpdate(crc, &flags, sizeof(flags));
+        crc      = Common::Crc32cUpdate(crc, &seed, sizeof(seed));
+        crc      = Common::Crc32cUpdate(crc, &size, sizeof(size));
+        return ~crc;
+    }
+};
+
+// A session as SessionStore::Sweep finds it.
+struct StoredSession
+{
+    int64_t slot;
+    string uuid;
+    int64_t last_seen; // system_clock ticks
+};
+
+#ifndef _WIN32
+// A file backed, memory mapped table of SessionRecords, so sessions outlive
+// the server.
+// The file is a header and a fixed number of slots, open addressed by a hash
+// of the uuid with linear probing. Opening maps it and checks the header,
+// nothing is read up front, so a restarted server serves resumes straight
+// away, each lookup probing the mapped slots. Sessions no one comes back
+// for are found by Sweep, a few slots at a time, as expiry goes along.
+// last_sent and last_seen are written straight in to the mapping, and a
+// background thread msyncs it every sync_interval, so a crash of the server
+// loses nothing, and a crash of the machine at most that interval.
+class SessionStore
+{
+  public:
+    static constexpr size_t g_default_slot_count = 1 << 16;
+
+    // Opens path, or makes it with slot_count slots. An existing file keeps
+    // its own slot count.
+    SessionStore(const string& path, size_t slot_count,
+                 chrono::milliseconds sync_interval)
+      : file_handle{ open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644) }
+      , sweep_at{ 0 }
+      , running{ true }
+    {
+        if (file_handle < 0) {
+            throw runtime_error("Could not open session store " + path);
+        }
+
+        auto existing = lseek(file_handle, 0, SEEK_END);
+        if (existing == 0) {
+            map_size = sizeof(Header) + slot_count * sizeof(SessionRecord);
+            if (ftruncate(file_handle, map_size) != 0) {
+                throw runtime_error("Could not size session store " + path);
+            }
+        } else {
+            map_size = static_cast<size_t>(existing);
+        }
+
+        map = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   file_handle, 0);
+        if (map == MAP_FAILED) {
+            throw runtime_error("Could not map session store " + path);
+        }
+        header = reinterpret_cast<Header*>(map);
+        slots  = reinterpret_cast<SessionRecord*>(header + 1);
+
+        if (existing == 0) {
+            copy(begin(g_magic), end(g_magic), header->magic);
+            header->version     = g_version;
+            header->record_size = sizeof(SessionRecord);
+            header->slot_count  = slot_count;
+            header->used        = 0;
+        } else if (!equal(begin(g_magic), end(g_magic), header->magic)
+                   || header->version != g_version
+                   || header->record_size != sizeof(SessionRecord)
+                   || map_size < sizeof(Header)
+                                   + header->slot_count
+                                       * sizeof(SessionRecord)) {
+            munmap(map, map_size);
+            throw runtime_error("Not a session store, or the wrong version "
+                                + path);
+        }
+
+        LogInfo("Session store", path, "holds", header->used, "of",
+                header->slot_count, "sessions");
+
+        sync = thread([this, sync_interval] {
+            unique_lock<mutex> wait_lock(sync_lock);
+            while (running) {
+                sync_wake.wait_for(wait_lock, sync_interval);
+                Sync();
+            }
+        });
+    }
+
+    ~SessionStore()
+    {
+        {
+            lock_guard<mutex> scope_guard(sync_lock);
+            running = false;
+        }
+        sync_wake.notify_one();
+        sync.join();
+
+        Sync();
+        munmap(map, map_size);
+        close(file_handle);
+    }
+
+    SessionStore(const SessionStore&) = delete;
+    SessionStore& operator=(const SessionStore&) = delete;
+
+    static constexpr int64_t g_no_slot = -1;
+
+    // The slot holding id, or g_no_slot.
+    int64_t Find(const string& id)
+    {
+        lock_guard<mutex> scope_guard(lock);
+        return Probe(id, nullptr);
+    }
+
+    // A copy of what is in a slot from Find.
+    SessionRecord Read(int64_t slot)
+    {
+        lock_guard<mutex> scope_guard(lock);
+        return slots[slot];
+    }
+
+    // Adds a session, and returns its slot. If id is already in the store,
+    // that is replaced. g_no_slot if the store is full, the session then only
+    // lives in memory.
+    int64_t Insert(const string& id, uint64_t seed, uint32_t size,
+                   uint32_t flags)
+    {
+        lock_guard<mutex> scope_guard(lock);
+
+        int64_t free_slot = g_no_slot;
+        auto slot         = Probe(id, &free_slot);
+        if (slot == g_no_slot) {
+            slot = free_slot;
+            if (slot == g_no_slot) {
+                LogError("Session store is full, (" + id + ")",
+                         "will not survive a restart");
+                return g_no_slot;
+            }
+            ++header->used;
+        }
+
+        // The state is left as it is until the record is whole, so a crash
+        // part way through never leaves an Empty in a probe chain.
+        auto& r = slots[slot];
+        memset(r.uuid, 0, sizeof(r.uuid));
+        copy_n(id.data(), min(id.size(), sizeof(r.uuid)), r.uuid);
+        r.flags     = flags;
+        r.seed      = seed;
+        r.size      = size;
+        r.last_sent = 0;
+        r.last_seen = chrono::system_clock::now().time_since_epoch().count();
+        r.check     = r.Check();
+        r.state     = SessionRecord::Used;
+        return slot;
+    }
+
+    // Only called for slots held by the caller, so without the lock.
+    void SetLastSent(int64_t slot, uint32_t last_sent,
+                     chrono::system_clock::time_point last_seen)
+    {
+        auto& r     = slots[slot];
+        r.last_sent = last_sent;
+        r.last_seen = last_seen.time_since_epoch().count();
+    }
+
+    void Erase(int64_t slot)
+    {
+        lock_guard<mutex> scope_guard(lock);
+        EraseLocked(slot);
+    }
+
+    // The sessions last seen before expired, in the next count slots on
+    // from where the last Sweep stopped, wrapping round. So the whole store
+    // is gone over a bounded number of slots at a time, never all at once.
+    vector<StoredSession> Sweep(size_t count,
+                                chrono::system_clock::time_point expired)
+    {
+        lock_guard<mutex> scope_guard(lock);
+
+        vector<StoredSession> stale;
+        auto slot_count = static_cast<int64_t>(header->slot_count);
+        auto before     = expired.time_since_epoch().count();
+        for (size_t n = 0; n < count && n < header->slot_count; ++n) {
+            auto i   = sweep_at;
+            sweep_at = (sweep_at + 1) % slot_count;
+
+            auto& r = slots[i];
+            if (r.state == SessionRecord::Used && r.last_seen < before) {
+                stale.push_back({ i, UUIDOf(r), r.last_seen });
+            }
+        }
+        return stale;
+    }
+
+    // Erases slot, if it still holds the same session, last seen before
+    // expired. True if it did.
+    bool EraseIfExpired(int64_t slot, const string& id,
+                        chrono::system_clock::time_point expired)
+    {
+        lock_guard<mutex> scope_guard(lock);
+
+        auto& r = slots[slot];
+        if (r.state == SessionRecord::Used && UUIDOf(r) == id
+            && r.last_seen < expired.time_since_epoch().count()) {
+            EraseLocked(slot);
+            return true;
+        }
+        return false;
+    }
+
+    void Sync() { msync(map, map_size, MS_SYNC); }
+
+  private:
+    static constexpr char g_magic[8] = { 'A', 'B', 'L', 'Y',
+                                         'S', 'E', 'S', 'S' };
+    static const uint32_t g_version = 1;
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t record_size;
+        uint64_t slot_count;
+        uint64_t used;
+        char reserved[32];
+    };
+
+    static string UUIDOf(const SessionRecord& r)
+    {
+        return string(begin(r.uuid), find(begin(r.uuid), end(r.uuid), '\0'));
+    }
+
+    // The same from one build to the next, which a file that outlives the
+    // server needs.
+    static uint64_t Hash(const string& id) { return Common::Fnv1a(id); }
+
+    // The slot holding id, or g_no_slot. free_slot, if given, gets the first
+    // slot an insert could use.
+    int64_t Probe(const string& id, int64_t* free_slot)
+    {
+        auto count = header->slot_count;
+        auto start = Hash(id) % count;
+        for (uint64_t n = 0; n < count; ++n) {
+            auto i  = static_cast<int64_t>((start + n) % count);
+            auto& r = slots[i];
+            if (r.state == SessionRecord::Empty) {
+                if (free_slot && *free_slot == g_no_slot) {
+                    *free_slot = i;
+                }
+                return g_no_slot;
+            }
+            if (r.state == SessionRecord::Erased) {
+                if (free_slot && *free_slot == g_no_slot) {
+                    *free_slot = i;
+                }
+                continue;
+            }
+            if (UUIDOf(r) == id) {
+                if (r.check != r.Check()) {
+                    LogError("(" + id + ")",
+                             "Session store record is corrupt, ignoring it");
+                    EraseLocked(i);
+                    if (free_slot && *free_slot == g_no_slot) {
+                        *free_slot = i;
+                    }
+                    continue;
+                }
+                return i;
+            }
+        }
+        return g_no_slot;
+    }
+
+    // Leaves a tombstone, unless the next slot is Empty. Then no probe goes
+    // past slot, so it and the tombstones before it are made Empty again,
+    // the last first, or churn would fill the table with tombstones and
+    // every miss would walk all of it.
+    void EraseLocked(int64_t slot)
+    {
+        --header->used;
+
+        auto count = static_cast<int64_t>(header->slot_count);
+        if (slots[(slot + 1) % count].state != SessionRecord::Empty) {
+            slots[slot].state = SessionRecord::Erased;
+            return;
+        }
+        auto i = slot;
+        do {
+            slots[i].state = SessionRecord::Empty;
+            i              = (i + count - 1) % count;
+        } while (i != slot && slots[i].state == SessionRecord::Erased);
+    }
+
+    int file_handle;
+    void* map;
+    size_t map_size;
+    Header* header;
+    SessionRecord* slots;
+
+    mutex lock;
+    int64_t sweep_at; // the slot the next Sweep starts from.
+
+    mutex sync_lock;
+    condition_variable sync_wake;
+    bool running;
+    thread sync;
+};
+#else
+// No mmap here, so sessions only ever live in memory.
+class SessionStore
+{
+  public:
+    static constexpr size_t g_default_slot_count = 1 << 16;
+    static constexpr int64_t g_no_slot           = -1;
+
+    SessionStore(const string& path, size_t, chrono::milliseconds)
+    {
+        throw runtime_error("A session store is not available on this "
+                            "platform, " + path);
+    }
+
+    int64_t Find(const string&) { return g_no_slot; }
+    SessionRecord Read(int64_t) { return {}; }
+    int64_t Insert(const string&, uint64_t, uint32_t, uint32_t)
+    {
+        return g_no_slot;
+    }
+    void SetLastSent(int64_t, uint32_t, chrono::system_clock::time_point) {}
+    void Erase(int64_t) {}
+    vector<StoredSession> Sweep(size_t, chrono::system_clock::time_point)
+    {
+        return {};
+    }
+    bool EraseIfExpired(int64_t, const string&,
+                        chrono::system_clock::time_point)
+    {
+        return false;
+    }
+};
+#endif // _WIN32
+} // namespace Server
@@ -0,0 +1,414 @@
+#pragma once
+
+namespace Server {
+using Time = std::chrono::time_point<std::chrono::system_clock>;
+using namespace std::chrono_literals; // give me the s suffix for numbers. so 5s
+                                      // = 5 seconds
+
+// How far one session has got. Shared by the SharedState and every
+// connection serving the session, so each burst of packets is recorded with
+// no lock, and no lookup by uuid.
+struct SessionProgress
+{
+    atomic<uint32_t> last_sent;
+    atomic<Time::rep> last_seen;
+
+    // Where the session is in a SessionStore, if it is. Written through to
+    // there as well. Expiry swaps this for g_no_slot before freeing the slot,
+    // so at worst a connection racing it writes one stale last_sent to a
+    // reused slot, and a resume takes the min of that and the clients count.
+    SessionStore* store;
+    atomic<int64_t> slot;
+
+    SessionProgress(uint32_t last_sent, Time last_seen,
+                    SessionStore* store = nullptr,
+                    int64_t slot        = SessionStore::g_no_slot)
+      : last_sent{ last_sent }
+      , last_seen{ last_seen.time_since_epoch().count() }
+      , store{ store }
+      , slot{ slot }
+    {}
+
+    void Set(uint32_t sent)
+    {
+        auto now = chrono::system_clock::now();
+        last_sent.store(sent, memory_order_relaxed);
+        last_seen.store(now.time_since_epoch().count(), memory_order_relaxed);
+
+        auto in_store = slot.load(memory_order_relaxed);
+        if (in_store != SessionStore::g_no_slot) {
+            store->SetLastSent(in_store, sent, now);
+        }
+    }
+
+    Time LastSeen() const
+    {
+        return Time(Time::duration(last_seen.load(memory_order_relaxed)));
+    }
+};
+
+// Where sessions are kept between connections.
+// LocalSharedState keeps them in this process, RemoteSharedState in a
+// state_server that any number of server processes can share.
+class ISharedState
+{
+  public:
+    // Payloads never change once generated, so every session and lookup
+    // shares the one copy. A lazy payload is only its seed and size.
+    using PayloadPtr  = shared_ptr<const Payload>;
+    using ProgressPtr = shared_ptr<SessionProgress>;
+
+    struct ConnectionState
+    {
+        PayloadPtr payload;
+
+        // Where progress sending this session is recorded.
+        ProgressPtr progress;
+
+        // progress->last_sent when it was looked up.
+        uint32_t last_sent;
+
+        ~ConnectionState() {}
+        ConnectionState()
+          : payload{}
+          , last_sent{ 0 } {};
+        ConnectionState(PayloadPtr payload, ProgressPtr progress)
+          : payload(move(payload))
+          , progress(move(progress))
+          , last_sent{ this->progress ? this->progress->last_sent.load()
+                                      : 0 }
+        {}
+
+        // 0 for a transmission that was not found.
+        uint32_t Size() const
+        {
+            return payload ? payload->Size() : 0;
+        }
+    };
+
+    // Returns the session now registered for id. If another connection got
+    // there first that is theirs, and this payload should be dropped.
+    virtual ConnectionState RegisterNewTransmission(const string& id,
+                                                    PayloadPtr payload) = 0;
+
+    // Only copies the handles to the payload and progress, never the
+    // payload.
+    // An empty state, with no payload, if id is not known.
+    virtual ConnectionState GetTransmission(const string& id) = 0;
+
+    // By uuid. Sessions being sent use ConnectionState::progress instead,
+    // which needs no lookup.
+    virtual void SetTransmissionLastSent(const string& id,
+                                         uint32_t last_sent) = 0;
+    virtual void EraseTransmission(const string& id)         = 0;
+    virtual void RemoveExpiredSessions()                     = 0;
+    virtual size_t Size()                                    = 0;
+
+    virtual ~ISharedState() {}
+};
+
+class LocalSharedState : public ISharedState
+{
+  public:
+    // The map is split in to shards, each with its own lock, picked by the
+    // hash of the id. Sessions on different shards never contend.
+    static constexpr size_t g_default_shard_count = 16;
+
+    // Sessions not seen for this long are removed.
+    static constexpr chrono::seconds g_default_session_timeout = 30s;
+
+    // Store slots each RemoveExpiredSessions sweeps for sessions only in the
+    // store. At the default slot count, and once a second, all of them every
+    // 16s.
+    static constexpr size_t g_store_sweep_slots = 4096;
+
+    // With a store, sessions are also kept there, and any not in memory are
+    // looked for there before being treated as new. Nothing is read from it
+    // up front. The store must outlive this.
+    LocalSharedState(size_t shard_count  = g_default_shard_count,
+                     SessionStore* store = nullptr,
+                     chrono::seconds session_timeout = g_default_session_timeout)
+      : shards(max<size_t>(1, shard_count))
+      , store{ store }
+      , session_timeout{ session_timeout }
+    {}
+
+    virtual ConnectionState RegisterNewTransmission(const string& id,
+                                                    PayloadPtr payload) override
+    {
+        auto& shard = ShardFor(id);
+        lock_guard<mutex> scope_guard(shard.lock);
+
+        auto i = shard.client_id_2_state.emplace(id, Session{ payload, {} });
+        auto& session = i.first->second;
+        if (i.second) {
+            auto flags = payload->IsLazy()
+                           ? uint32_t(SessionRecord::Flag_Lazy)
+                           : 0u;
+            auto slot  = store ? store->Insert(id, payload->Seed(),
+                                               payload->Size(), flags)
+                               : SessionStore::g_no_slot;
+            session.progress = make_shared<SessionProgress>(
+              0, chrono::system_clock::now(), store, slot);
+            Index(shard, id, session);
+        }
+        return session.State();
+    }
+
+    virtual ConnectionState GetTransmission(const string& id) override
+    {
+        auto& shard = ShardFor(id);
+        {
+            lock_guard<mutex> scope_guard(shard.lock);
+
+            auto i = shard.client_id_2_state.find(id);
+            if (i != end(shard.client_id_2_state)) {
+                return i->second.State();
+            }
+        }
+
+        // log state not found for this id.
+        // returning an empty transmission.
+        // This will then be treated as a never before seen connection and
+        // the payload will be genorated.
+        if (!store) {
+            return {};
+        }
+        return Restore(shard, id);
+    }
+
+    virtual void SetTransmissionLastSent(const string& id,
+                                         uint32_t last_sent) override
+    {
+        auto& shard = ShardFor(id);
+        lock_guard<mutex> scope_guard(shard.lock);
+
+        auto i = shard.client_id_2_state.find(id);
+        if (i != end(shard.client_id_2_state)) {
+            i->second.progress->Set(last_sent);
+        }
+    }
+
+    virtual void EraseTransmission(const string& id) override
+    {
+        auto& shard = ShardFor(id);
+        lock_guard<mutex> scope_guard(shard.lock);
+
+        auto i = shard.client_id_2_state.find(id);
+        if (i != end(shard.client_id_2_state)) {
+            i->second.Unstore(store);
+            shard.client_id_2_state.erase(i);
+        }
+    }
+
+    // Only looks at sessions whose deadline has passed. last_seen moves
+    // without the lock, so a due session is checked again, and put back with
+    // its new deadline if it has been seen since.
+    // Sessions only in the store, from before a restart and never resumed,
+    // are found by sweeping g_store_sweep_slots of it each time.
+    virtual void RemoveExpiredSessions() override
+    {
+        auto now     = chrono::system_clock::now();
+        auto expired = now - session_timeout;
+
+        vector<string> removed;
+        vector<string> removed_stored;
+        for (auto& shard : shards) {
+            lock_guard<mutex> scope_guard(shard.lock);
+
+            auto& map = shard.client_id_2_state;
+            while (!shard.expiry.empty() && shard.expiry.top().deadline <= now) {
+                auto due = shard.expiry.top();
+                shard.expiry.pop();
+
+                // erased, or erased and registered again, which indexed it
+                // afresh.
+                auto i = map.find(due.id);
+                if (i == end(map) || i->second.progress.get() != due.progress) {
+                    continue;
+                }
+
+                auto deadline = i->second.progress->LastSeen() + session_timeout;
+                if (deadline > now) {
+                    due.deadline = deadline;
+                    shard.expiry.push(move(due));
+                    continue;
+                }
+
+                i->second.Unstore(store);
+                map.erase(i);
+                removed.push_back(move(due.id));
+            }
+        }
+
+        // any session in memory holds its slot, and expires from there.
+        if (store) {
+            for (auto& s : store->Sweep(g_store_sweep_slots, expired)) {
+                auto& shard = ShardFor(s.uuid);
+                lock_guard<mutex> scope_guard(shard.lock);
+                if (shard.client_id_2_state.count(s.uuid) == 0
+                    && store->EraseIfExpired(s.slot, s.uuid, expired)) {
+                    removed_stored.push_back(move(s.uuid));
+                }
+            }
+        }
+
+        Metrics::Add(Metrics::Expiries, removed.size() + removed_stored.size());
+        for (auto& id : removed) {
+            LogInfo("(" + id + ")", "Session expried, removing");
+        }
+        for (auto& id : removed_stored) {
+            LogInfo("(" + id + ")", "Stored session expried, removing");
+        }
+    }
+
+    virtual size_t Size() override
+    {
+        size_t total = 0;
+        for (auto& shard : shards) {
+            lock_guard<mutex> scope_guard(shard.lock);
+            total += shard.client_id_2_state.size();
+        }
+        return total;
+    }
+
+    // Picks id's shard, modulo the shard count.
+    static size_t Hash(const string& id) { return hash<string>{}(id); }
+
+  private:
+    struct Session
+    {
+        PayloadPtr payload;
+        ProgressPtr progress;
+
+        ConnectionState State() const { return { payload, progress }; }
+
+        // Frees its SessionStore slot, if it has one.
+        void Unstore(SessionStore* store)
+        {
+            auto slot = progress->slot.exchange(SessionStore::g_no_slot);
+            if (slot != SessionStore::g_no_slot) {
+                store->Erase(slot);
+            }
+        }
+    };
+
+    // When a session is next due to be looked at for expiry.
+    struct Deadline
+    {
+        Time deadline;
+        string id;
+
+        // Which session for id this is, so one erased and registered again
+        // is told apart.
+        const SessionProgress* progress;
+
+        bool operator>(const Deadline& other) const
+        {
+            return deadline > other.deadline;
+        }
+    };
+
+    // Each on its own cache line, so neighbouring locks don't false share.
+    struct alignas(64) Shard
+    {
+        unordered_map<string, Session> client_id_2_state;
+
+        // Soonest first. Every session in the map has an entry, and erased
+        // ones linger until they are due. Only sessions registered or
+        // restored by this process, never ones only in the store.
+        priority_queue<Deadline, vector<Deadline>, greater<Deadline>> expiry;
+        mutex lock;
+    };
+
+    Shard& ShardFor(const string& id)
+    {
+        return shards[Hash(id) % shards.size()];
+    }
+
+    // With the shard lock held.
+    void Index(Shard& shard, const string& id, const Session& session)
+    {
+        shard.expiry.push({ session.progress->LastSeen() + session_timeout, id,
+                            session.progress.get() });
+    }
+
+    // Brings a session back from the store, made the same way it was first
+    // made. The payload is made outside the lock, and if another login for
+    // id got there first, theirs is used.
+    ConnectionState Restore(Shard& shard, const string& id)
+    {
+        auto slot = store->Find(id);
+        if (slot == SessionStore::g_no_slot) {
+            return {};
+        }
+
+        auto r = store->Read(slot);
+        Session restored{ (r.flags & SessionRecord::Flag_Lazy)
+                            ? Payload::Lazy(r.seed, r.size)
+                            : Payload::Stored(r.seed, r.size),
+                          {} };
+        LogInfo("(" + id + ")", "restored from the session store");
+
+        lock_guard<mutex> scope_guard(shard.lock);
+        auto i = shard.client_id_2_state.emplace(id, move(restored));
+        auto& session = i.first->second;
+        if (i.second) {
+            auto last_seen = Time(Time::duration(r.last_seen));
+            if (store->Find(id) != slot) {
+                // expired from the store while the payload was being made,
+                // so the session is stored afresh.
+                slot = store->Insert(id, r.seed, r.size, r.flags);
+                if (slot != SessionStore::g_no_slot) {
+                    store->SetLastSent(slot, r.last_sent, last_seen);
+                }
+            }
+            session.progress = make_shared<SessionProgress>(
+              r.last_sent, last_seen, store, slot);
+            Index(shard, id, session);
+        }
+        return session.State();
+    }
+
+    vector<Shard> shards;
+    SessionStore* store;
+    chrono::seconds session_timeout;
+};
+
+// Calls RemoveExpiredSessions every interval, on a thread of its own, so
+// sessions expire however busy the listener is.
+class ExpiryThread
+{
+  public:
+    ExpiryThread(ISharedState* shared, chrono::milliseconds interval)
+      : running{ true }
+      , worker([this, shared, interval] {
+          unique_lock<mutex> wait_lock(lock);
+          while (running) {
+              wake.wait_for(wait_lock, interval);
+              if (running) {
+                  wait_lock.unlock();
+                  shared->RemoveExpiredSessions();
+                  wait_lock.lock();
+              }
+          }
+      })
+    {}
+
+    ~ExpiryThread()
+    {
+        {
+            lock_guard<mutex> scope_guard(lock);
+            running = false;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+  private:
+    mutex lock;
+    condition_variable wake;
+    bool running;
+    thread worker;
+};
+} // namespace Server
@@ -0,0 +1,202 @@
+#pragma once
+
+namespace Client {
+// Where a streamed download's ints go, rather than a payload held in memory,
+// so memory use stays the same however large N is. Ints are written in
+// order, each once, and only once any chunk they are in has passed its
+// checksum.
+class ISink
+{
+  public:
+    virtual ~ISink() {}
+
+    // How many ints it holds, including any from before this run, which the
+    // download carries on after.
+    virtual uint64_t Committed() const = 0;
+
+    // Feeds each every int it holds, in order, in blocks, so the checksum
+    // can be brought up to date with ints from before this run.
+    virtual void Replay(const function<void(const uint32_t*, size_t)>& each)
+    {
+        (void)each;
+    }
+
+    // The next n ints.
+    virtual void Write(const uint32_t* ints, size_t n) = 0;
+
+    // Pushes out anything it is holding on to.
+    virtual void Flush() {}
+};
+
+// Hands each block of ints to a callback, with where it starts.
+class CallbackSink : public ISink
+{
+  public:
+    using Callback = function<void(uint64_t at, const uint32_t*, size_t)>;
+
+    CallbackSink(Callback callback)
+      : callback{ move(callback) }
+      , count{ 0 }
+    {}
+
+    virtual uint64_t Committed() const override { return count; }
+
+    virtual void Write(const uint32_t* ints, size_t n) override
+    {
+        callback(count, ints, n);
+        count += n;
+    }
+
+  private:
+    Callback callback;
+    uint64_t count;
+};
+
+#ifndef _WIN32
+// Writes to a file descriptor, g_block_size bytes at a time. A regular file
+// is appended to, and what it already holds is where the download carries
+// on from, so a restarted client resumes from the file. That needs it open
+// for reading as well, to bring the checksum up to date. Anything else, such
+// as a pipe, starts from 0.
+class FileSink : public ISink
+{
+  public:
+    static constexpr size_t g_block_size = 1 << 20;
+
+    // Takes ownership of handle.
+    FileSink(int handle)
+      : handle{ handle }
+      , count{ 0 }
+      , written{ 0 }
+      , seekable{ false }
+      , flushed{ 0 }
+    {
+        block.reserve(g_block_size / sizeof(uint32_t));
+        auto end = lseek(handle, 0, SEEK_END);
+        if (end < 0) {
+            return;
+        }
+        seekable = true;
+        count    = static_cast<uint64_t>(end) / sizeof(uint32_t);
+        // a part written int is dropped.
+        if (end % sizeof(uint32_t)
+            && (ftruncate(handle, count * sizeof(uint32_t)) != 0
+                || lseek(handle, 0, SEEK_END) < 0)) {
+            throw runtime_error("Could not drop part of an int");
+        }
+        written = count;
+    }
+
+    // Opens path for uuid's download of N ints. What a regular file holds is
+    // only kept if it is from that same download, as noted in path.download
+    // alongside it, otherwise it is started over.
+    static unique_ptr<FileSink> Open(const string& path, const string& uuid,
+                                     uint32_t N)
+    {
+        auto handle = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (handle < 0) {
+            throw runtime_error("Could not open " + path);
+        }
+
+        auto owner_path = path + ".download";
+        auto owner      = uuid + " " + to_string(N);
+        if (lseek(handle, 0, SEEK_END) >= 0) {
+            string held;
+            getline(ifstream(owner_path), held);
+            if (held != owner) {
+                if (ftruncate(handle, 0) != 0) {
+                    close(handle);
+                    throw runtime_error("Could not start over " + path);
+                }
+                ofstream noted(owner_path);
+                if (!(noted << owner << "\n")) {
+                    close(handle);
+                    throw runtime_error("Could not write " + owner_path);
+                }
+                LogInfo("Output", path, "started for", owner);
+            }
+        }
+        return make_unique<FileSink>(handle);
+    }
+
+    ~FileSink()
+    {
+        try {
+            Flush();
+        } catch (runtime_error& e) {
+            LogError(e.what());
+        }
+        close(handle);
+    }
+
+    FileSink(const FileSink&) = delete;
+    FileSink& operator=(const FileSink&) = delete;
+
+    virtual uint64_t Committed() const override { return count; }
+
+    virtual void Replay(
+      const function<void(const uint32_t*, size_t)>& each) override
+    {
+        if (!seekable) {
+            return;
+        }
+        Flush();
+        vector<uint32_t> ints(g_block_size / sizeof(uint32_t));
+        uint64_t at = 0;
+        while (at < written) {
+            auto n = min<uint64_t>(ints.size(), written - at);
+            auto r = pread(handle, ints.data(), n * sizeof(uint32_t),
+                           at * sizeof(uint32_t));
+            if (r != static_cast<ssize_t>(n * sizeof(uint32_t))) {
+                throw runtime_error("Could not read back the output");
+            }
+            each(ints.data(), n);
+            at += n;
+        }
+    }
+
+    virtual void Write(const uint32_t* ints, size_t n) override
+    {
+        while (n) {
+            auto take = min(n, block.capacity() - block.size());
+            block.insert(block.end(), ints, ints + take);
+            ints += take;
+            n -= take;
+            count += take;
+            if (block.size() == block.capacity()) {
+                Flush();
+            }
+        }
+    }
+
+    // If a write fails part way, what it did write is not written again by
+    // the next Flush.
+    virtual void Flush() override
+    {
+        auto data = reinterpret_cast<const char*>(block.data());
+        auto size = block.size() * sizeof(uint32_t);
+        while (flushed < size) {
+            auto r = write(handle, data + flushed, size - flushed);
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            if (r <= 0) {
+                throw runtime_error("Could not write the output");
+            }
+            flushed += r;
+        }
+        written += block.size();
+        block.clear();
+        flushed = 0;
+    }
+
+  private:
+    int handle;
+    uint64_t count;   // ints given to it
+    uint64_t written; // ints in the file
+    bool seekable;
+    vector<uint32_t> block;
+    size_t flushed; // bytes of block already in the file
+};
+#endif // _WIN32
+} // namespace Client
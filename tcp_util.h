@@ -8,14 +8,60 @@ struct socket_close_exception : public runtime_error
     ~socket_close_exception() {}
 };
 
+// How many connections each listener queues before they are accepted. A
+// reconnect storm arrives all at once, so it is as many as the system allows.
+int g_listen_backlog = SOMAXCONN;
+
+// Sockets handed to an event loop must never block it.
+void SetNonBlocking(SOCKET s)
+{
+#ifdef _WIN32
+    u_long mode = 1;
+    ioctlsocket(s, FIONBIO, &mode);
+#else
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+#endif
+}
+
+// One piece of a gathered send.
+struct IoSlice
+{
+    const void* data;
+    size_t size;
+};
+
 struct INetStream
 {
     virtual void SendN(size_t n, const void* data)         = 0;
     virtual void RecvN(size_t n, void* dst)                = 0;
     virtual int WaitForDataToRecv(chrono::seconds timeout) = 0;
     virtual void Close()                                   = 0;
+
+    // Sends each slice, in order, as if by SendN.
+    // The slices only need to stay valid until this returns.
+    virtual void SendV(const IoSlice* slices, size_t count)
+    {
+        for (size_t i = 0; i < count; ++i) {
+            SendN(slices[i].size, slices[i].data);
+        }
+    }
+
+    // Receives at least 1 and at most max bytes, returning how many.
+    virtual size_t RecvSome(size_t max, void* dst)
+    {
+        (void)max;
+        RecvN(1, dst);
+        return 1;
+    }
+
+    // Pushes out anything a stream is holding on to.
+    virtual void Flush() {}
+
+    virtual ~INetStream() {}
 };
 
+// Any connected or listening stream socket. Mostly TCP, but unix sockets
+// (see local_stream.h) are sent and received on the same way.
 class TCPStream : public INetStream
 {
     SOCKET handle;
@@ -23,6 +69,14 @@ class TCPStream : public INetStream
     TCPStream() {}
 
   public:
+    // Takes ownership of an already open socket.
+    static TCPStream FromHandle(SOCKET handle)
+    {
+        TCPStream stream;
+        stream.handle = handle;
+        return stream;
+    }
+
     TCPStream(const char* host, int port)
     {
         auto portstr = to_string(port);
@@ -30,6 +84,8 @@ class TCPStream : public INetStream
         {};
         struct addrinfo *r, *res = nullptr;
 
+        // or the datagram results connect, with nothing listening.
+        hints.ai_socktype = SOCK_STREAM;
         if (getaddrinfo(host, portstr.c_str(), &hints, &res) != 0) {
             throw std::runtime_error("Cannot resolve hostname");
         }
@@ -49,7 +105,9 @@ class TCPStream : public INetStream
         }
     }
 
-    TCPStream(int port)
+    // Listens on port. With reuse_port, other sockets can listen on it as
+    // well, and each new connection goes to one of them.
+    TCPStream(int port, bool reuse_port = false)
     {
         auto portstr = to_string(port);
         struct addrinfo hints
@@ -68,13 +126,23 @@ class TCPStream : public INetStream
                        reinterpret_cast<char*>(&opt), sizeof(opt))) {
             throw std::runtime_error("setsockopt");
         }
+        if (reuse_port) {
+#ifdef SO_REUSEPORT
+            if (setsockopt(handle, SOL_SOCKET, SO_REUSEPORT,
+                           reinterpret_cast<char*>(&opt), sizeof(opt))) {
+                throw std::runtime_error("setsockopt SO_REUSEPORT");
+            }
+#else
+            throw std::runtime_error("SO_REUSEPORT is not available");
+#endif
+        }
 
         if (::bind(handle, res->ai_addr, (int)res->ai_addrlen) < 0) {
             throw std::runtime_error("bind failed");
         }
         freeaddrinfo(res);
 
-        if (listen(handle, 10) == SOCKET_ERROR) {
+        if (listen(handle, g_listen_backlog) == SOCKET_ERROR) {
             closesocket(handle);
             throw std::runtime_error("Could not listen to socket");
         }
@@ -112,30 +180,75 @@ class TCPStream : public INetStream
         } while (n);
     }
 
-    virtual int WaitForDataToRecv(chrono::seconds timeout) override
+    virtual size_t RecvSome(size_t max, void* dst) override
+    {
+        auto r = recv(handle, reinterpret_cast<char*>(dst), (int)max, 0);
+        if (r <= 0) {
+            LogError("Recv result", r);
+            throw socket_close_exception();
+        }
+        return r;
+    }
+
+#ifndef _WIN32
+    // All the slices in as few syscalls as the socket allows.
+    virtual void SendV(const IoSlice* slices, size_t count) override
     {
-        fd_set fds;
-        struct timeval tv;
-        int result;
+        LogTrace("SendV", count);
+        iovec iov[64];
+        size_t first = 0, offset = 0;
+        while (first < count) {
+            size_t n = 0;
+            for (auto i = first; i < count && n < size(iov); ++i, ++n) {
+                auto skip       = (i == first) ? offset : 0;
+                iov[n].iov_base = const_cast<char*>(
+                  reinterpret_cast<const char*>(slices[i].data) + skip);
+                iov[n].iov_len = slices[i].size - skip;
+            }
 
-        FD_ZERO(&fds);
-        FD_SET(handle, &fds);
+            msghdr msg{};
+            msg.msg_iov    = iov;
+            msg.msg_iovlen = n;
+            auto r         = sendmsg(handle, &msg, MSG_NOSIGNAL);
+            if (r <= 0) {
+                LogError("Send result", r);
+                throw socket_close_exception();
+            }
 
-        tv.tv_sec  = (int)timeout.count();
-        tv.tv_usec = 0;
-        result     = select(handle + 1, &fds, NULL, NULL, &tv);
-        if (result > 0) {
-            if (FD_ISSET(handle, &fds)) {
-                return 1;
+            // step over whatever was sent, which may end mid slice.
+            size_t sent = r;
+            while (first < count && sent >= slices[first].size - offset) {
+                sent -= slices[first].size - offset;
+                offset = 0;
+                ++first;
             }
-        } else if (result == SOCKET_ERROR) {
-            throw std::runtime_error("Error on select()");
+            offset += sent;
+        }
+    }
+#endif
+
+    // poll rather than select, as connections can be past FD_SETSIZE.
+    virtual int WaitForDataToRecv(chrono::seconds timeout) override
+    {
+        pollfd fd{};
+        fd.fd     = handle;
+        fd.events = POLLIN;
+        auto ms   = (int)chrono::milliseconds(timeout).count();
+#ifdef _WIN32
+        auto result = WSAPoll(&fd, 1, ms);
+#else
+        auto result = poll(&fd, 1, ms);
+#endif
+        if (result == SOCKET_ERROR) {
+            throw std::runtime_error("Error on poll()");
         }
-        return 0;
+        return result > 0 ? 1 : 0;
     }
 
     virtual void Close() override { closesocket(handle); }
 
+    SOCKET Handle() const { return handle; }
+
     TCPStream Accept()
     {
         struct addrinfo address;
@@ -152,6 +265,165 @@ class TCPStream : public INetStream
     }
 };
 
+// The index of a listener with a connection waiting to be accepted, or -1 if
+// none has one within timeout.
+int WaitForAccept(const vector<TCPStream*>& listeners, chrono::seconds timeout)
+{
+    fd_set fds;
+    FD_ZERO(&fds);
+    SOCKET highest = 0;
+    for (auto l : listeners) {
+        FD_SET(l->Handle(), &fds);
+        highest = max(highest, l->Handle());
+    }
+
+    struct timeval tv;
+    tv.tv_sec  = (int)timeout.count();
+    tv.tv_usec = 0;
+    auto result = select((int)highest + 1, &fds, NULL, NULL, &tv);
+    if (result == SOCKET_ERROR) {
+        throw std::runtime_error("Error on select()");
+    }
+    for (size_t i = 0; result > 0 && i < listeners.size(); ++i) {
+        if (FD_ISSET(listeners[i]->Handle(), &fds)) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// Buffers both ways over another stream.
+// Reads fill a buffer with as much as the socket has, up to its capacity, and
+// RecvN's are then served from memory. Sends gather in to a buffer until it is
+// full or Flush is called, and then go out in one gathered send.
+// Whoever owns one must Flush at the points data has to be on the wire, such
+// as the end of a pacing tick, or before waiting on the other end.
+class BufferedStream : public INetStream
+{
+  public:
+    static constexpr size_t g_default_capacity = 64 * 1024;
+    static constexpr size_t g_in_place_min     = 4 * 1024;
+
+    explicit BufferedStream(INetStream& inner,
+                            size_t capacity = g_default_capacity)
+      : inner{ inner }
+      , recv_buffer(capacity)
+      , recv_begin{ 0 }
+      , recv_end{ 0 }
+    {
+        send_buffer.reserve(capacity);
+    }
+
+    virtual void SendN(size_t n, const void* data) override
+    {
+        auto c = reinterpret_cast<const char*>(data);
+        if (send_buffer.size() + n <= send_buffer.capacity()) {
+            send_buffer.insert(end(send_buffer), c, c + n);
+            return;
+        }
+
+        // too big to gather, it goes with whatever is buffered in one send.
+        IoSlice slices[2] = { { send_buffer.data(), send_buffer.size() },
+                              { data, n } };
+        inner.SendV(slices + (send_buffer.empty() ? 1 : 0),
+                    send_buffer.empty() ? 1 : 2);
+        send_buffer.clear();
+    }
+
+    // Large slices are not copied. They go straight to the inner stream,
+    // after anything already buffered, so it can send them in place.
+    virtual void SendV(const IoSlice* slices, size_t count) override
+    {
+        auto large = any_of(slices, slices + count, [](auto& s) {
+            return s.size >= g_in_place_min;
+        });
+        if (!large) {
+            for (size_t i = 0; i < count; ++i) {
+                SendN(slices[i].size, slices[i].data);
+            }
+            return;
+        }
+
+        gathered.clear();
+        if (!send_buffer.empty()) {
+            gathered.push_back({ send_buffer.data(), send_buffer.size() });
+        }
+        gathered.insert(end(gathered), slices, slices + count);
+        inner.SendV(gathered.data(), gathered.size());
+        send_buffer.clear();
+    }
+
+    virtual void Flush() override
+    {
+        if (!send_buffer.empty()) {
+            inner.SendN(send_buffer.size(), send_buffer.data());
+            send_buffer.clear();
+        }
+        inner.Flush();
+    }
+
+    virtual void RecvN(size_t n, void* dst) override
+    {
+        auto c = reinterpret_cast<char*>(dst);
+        while (n) {
+            if (recv_begin == recv_end) {
+                if (n >= recv_buffer.size()) {
+                    // not worth the copy, read straight in to dst.
+                    inner.RecvN(n, c);
+                    return;
+                }
+                recv_begin = 0;
+                recv_end =
+                  inner.RecvSome(recv_buffer.size(), recv_buffer.data());
+            }
+            auto take = min(n, recv_end - recv_begin);
+            memcpy(c, recv_buffer.data() + recv_begin, take);
+            recv_begin += take;
+            c += take;
+            n -= take;
+        }
+    }
+
+    virtual size_t RecvSome(size_t max, void* dst) override
+    {
+        if (recv_begin == recv_end) {
+            return inner.RecvSome(max, dst);
+        }
+        auto take = min(max, recv_end - recv_begin);
+        RecvN(take, dst);
+        return take;
+    }
+
+    virtual int WaitForDataToRecv(chrono::seconds timeout) override
+    {
+        if (recv_begin != recv_end) {
+            return 1;
+        }
+        return inner.WaitForDataToRecv(timeout);
+    }
+
+    // Anything still buffered is sent first. If that fails the stream is
+    // closed all the same.
+    virtual void Close() override
+    {
+        try {
+            Flush();
+        } catch (socket_close_exception&) {
+        }
+        inner.Close();
+    }
+
+  private:
+    INetStream& inner;
+
+    vector<char> send_buffer;
+    vector<IoSlice> gathered;
+
+    vector<char> recv_buffer;
+    size_t recv_begin;
+    size_t recv_end;
+};
+
 struct TSerialToStream
 {
     INetStream& stream;
@@ -175,5 +447,7 @@ struct TSerialToStream
         return tmp;
     }
 
+    void Flush() { stream.Flush(); }
+
     void Close() { stream.Close(); }
 };
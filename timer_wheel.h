@@ -0,0 +1,116 @@
+#pragma once
+
+// Hashed timer wheel.
+// Timers are bucketed by the tick they fall due in, so scheduling is O(1) and
+// advancing only touches the slots that have passed, no matter how many
+// sessions are waiting on their next packet.
+// Timers further out than one revolution share a slot with nearer ones, and
+// are skipped until their tick comes around.
+template<typename T>
+class TimerWheel
+{
+  public:
+    using Clock = chrono::steady_clock;
+
+    TimerWheel(chrono::milliseconds tick_length, size_t slot_count)
+      : tick_length{ tick_length }
+      , origin{ Clock::now() }
+      , current_tick{ 0 }
+      , scheduled{ 0 }
+      , slots(slot_count)
+    {}
+
+    void Schedule(Clock::time_point when, T value)
+    {
+        // round up, so timers never fire early, and never schedule in to a
+        // slot we have already processed.
+        auto tick = TickOf(when);
+        if (origin + tick_length * tick < when) {
+            ++tick;
+        }
+        tick = max(tick, current_tick + 1);
+        slots[tick % slots.size()].push_back({ tick, move(value) });
+        ++scheduled;
+    }
+
+    // Calls on_expire for every timer that is due by now.
+    // on_expire is free to Schedule more timers.
+    template<typename F>
+    void Advance(Clock::time_point now, F&& on_expire)
+    {
+        auto target = TickOf(now);
+        if (target <= current_tick) {
+            return;
+        }
+
+        // if we have fallen more than a revolution behind, each slot only
+        // needs visiting once.
+        auto steps = min<uint64_t>(target - current_tick, slots.size());
+        for (uint64_t t = target - steps + 1; t <= target; ++t) {
+            auto& slot = slots[t % slots.size()];
+            for (size_t i = 0; i < slot.size();) {
+                if (slot[i].tick <= target) {
+                    due.push_back(move(slot[i].value));
+                    slot[i] = move(slot.back());
+                    slot.pop_back();
+                } else {
+                    ++i;
+                }
+            }
+        }
+        current_tick = target;
+        scheduled -= due.size();
+
+        // callbacks may schedule, so only call out once the slots are settled.
+        for (auto& v : due) {
+            on_expire(v);
+        }
+        due.clear();
+    }
+
+    // How long until the next non empty slot.
+    // This can be early, for timers a revolution or more away, which is fine
+    // as Advance will then just find nothing due.
+    chrono::milliseconds TimeToNext(Clock::time_point now,
+                                    chrono::milliseconds idle) const
+    {
+        if (!scheduled) {
+            return idle;
+        }
+        for (uint64_t t = current_tick + 1; t <= current_tick + slots.size();
+             ++t) {
+            if (!slots[t % slots.size()].empty()) {
+                auto when = origin + tick_length * t;
+                if (when <= now) {
+                    return chrono::milliseconds(0);
+                }
+                return chrono::ceil<chrono::milliseconds>(when - now);
+            }
+        }
+        return idle;
+    }
+
+    size_t Size() const { return scheduled; }
+
+  private:
+    struct Entry
+    {
+        uint64_t tick;
+        T value;
+    };
+
+    uint64_t TickOf(Clock::time_point when) const
+    {
+        if (when <= origin) {
+            return 0;
+        }
+        return (when - origin) / tick_length;
+    }
+
+    chrono::milliseconds tick_length;
+    Clock::time_point origin;
+    uint64_t current_tick;
+    size_t scheduled;
+    vector<vector<Entry>> slots;
+    vector<T> due;
+};
@@ -0,0 +1,484 @@
+#pragma once
+
+#ifdef __linux__
+// Just enough of io_uring, over the raw syscalls, for UringStream.
+// There is no liburing dependency, only the kernel header.
+class Uring
+{
+  public:
+    explicit Uring(unsigned entries)
+    {
+        io_uring_params p{};
+        ring_handle = (int)syscall(__NR_io_uring_setup, entries, &p);
+        if (ring_handle < 0) {
+            throw std::runtime_error("io_uring_setup failed");
+        }
+
+        sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        auto single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single) {
+            sq_map_size = cq_map_size = max(sq_map_size, cq_map_size);
+        }
+
+        sq_map = Map(sq_map_size, IORING_OFF_SQ_RING);
+        cq_map = single ? sq_map : Map(cq_map_size, IORING_OFF_CQ_RING);
+        sqes   = reinterpret_cast<io_uring_sqe*>(
+          Map(p.sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES));
+        sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+
+        auto sq   = reinterpret_cast<char*>(sq_map);
+        sq_head   = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+        sq_tail   = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        sq_mask   = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        sq_array  = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+        sq_size   = p.sq_entries;
+        next_tail = *sq_tail;
+
+        auto cq = reinterpret_cast<char*>(cq_map);
+        cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        cqes    = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+    }
+
+    ~Uring()
+    {
+        munmap(sqes, sqes_size);
+        if (cq_map != sq_map) {
+            munmap(cq_map, cq_map_size);
+        }
+        munmap(sq_map, sq_map_size);
+        close(ring_handle);
+    }
+
+    Uring(const Uring&) = delete;
+    Uring& operator=(const Uring&) = delete;
+
+    // How many more sqes can be queued before a Submit.
+    unsigned Space() const
+    {
+        auto head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        return sq_size - (next_tail - head);
+    }
+
+    // A zeroed sqe to fill in. Check Space first.
+    io_uring_sqe* Queue()
+    {
+        auto index = next_tail & sq_mask;
+        auto sqe   = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[index] = index;
+        ++next_tail;
+        return sqe;
+    }
+
+    // Hands everything queued to the kernel, in one syscall, and waits for
+    // at least wait_for completions.
+    void Submit(unsigned wait_for)
+    {
+        auto to_submit = next_tail - *sq_tail;
+        __atomic_store_n(sq_tail, next_tail, __ATOMIC_RELEASE);
+        for (;;) {
+            ++enter_calls;
+            auto r = syscall(__NR_io_uring_enter, ring_handle, to_submit,
+                             wait_for, wait_for ? IORING_ENTER_GETEVENTS : 0,
+                             nullptr, 0);
+            if (r >= 0) {
+                return;
+            }
+            if (errno != EINTR) {
+                throw std::runtime_error("io_uring_enter failed");
+            }
+            // on EINTR anything not taken is still in the ring.
+            to_submit = 0;
+        }
+    }
+
+    // The next completion, waiting for one if there are none.
+    io_uring_cqe Reap()
+    {
+        for (;;) {
+            auto head = *cq_head;
+            if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                auto cqe = cqes[head & cq_mask];
+                __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+                return cqe;
+            }
+            Submit(1);
+        }
+    }
+
+    bool RegisterBuffers(const iovec* buffers, unsigned count)
+    {
+        return syscall(__NR_io_uring_register, ring_handle,
+                       IORING_REGISTER_BUFFERS, buffers, count)
+               == 0;
+    }
+
+    bool Supports(unsigned op)
+    {
+        // io_uring_probe ends in a flexible array, one entry per op.
+        vector<char> buffer(sizeof(io_uring_probe)
+                            + 256 * sizeof(io_uring_probe_op));
+        auto probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+        if (syscall(__NR_io_uring_register, ring_handle,
+                    IORING_REGISTER_PROBE, probe, 256)
+            != 0) {
+            return false;
+        }
+        return op <= probe->last_op
+               && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    uint64_t EnterCalls() const { return enter_calls; }
+
+  private:
+    void* Map(size_t size, uint64_t offset)
+    {
+        auto p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_handle, offset);
+        if (p == MAP_FAILED) {
+            throw std::runtime_error("io_uring mmap failed");
+        }
+        return p;
+    }
+
+    int ring_handle;
+
+    void* sq_map;
+    size_t sq_map_size;
+    void* cq_map;
+    size_t cq_map_size;
+    io_uring_sqe* sqes;
+    size_t sqes_size;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned* sq_array;
+    unsigned sq_size;
+    unsigned next_tail;
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe* cqes;
+
+    uint64_t enter_calls = 0;
+};
+
+// INetStream on io_uring.
+// Small sends are gathered in to a registered buffer and go out as one fixed
+// write. Sends of at least g_zero_copy_min bytes go straight from the
+// callers memory, zero copy where the kernel supports IORING_OP_SEND_ZC.
+// All the pieces of a SendV are linked and submitted in one syscall.
+// Receives fill a registered buffer with as much as is available, so a run of
+// small RecvN's costs one syscall.
+class UringStream : public INetStream
+{
+  public:
+    static constexpr size_t g_buffer_size   = 64 * 1024;
+    static constexpr size_t g_zero_copy_min = 16 * 1024;
+
+    explicit UringStream(SOCKET handle)
+      : handle{ handle }
+      , ring{ 64 }
+      , send_buffer(g_buffer_size)
+      , recv_buffer(g_buffer_size)
+      , recv_begin{ 0 }
+      , recv_end{ 0 }
+    {
+        iovec buffers[2] = { { send_buffer.data(), send_buffer.size() },
+                             { recv_buffer.data(), recv_buffer.size() } };
+        // registering needs locked memory, without it the same ops are used
+        // unregistered.
+        fixed_buffers = ring.RegisterBuffers(buffers, 2);
+#ifdef IORING_CQE_F_NOTIF
+        // unix sockets don't do zero copy sends.
+        sockaddr_storage address{};
+        socklen_t size = sizeof(address);
+        getsockname(handle, reinterpret_cast<sockaddr*>(&address), &size);
+        zero_copy = ring.Supports(IORING_OP_SEND_ZC)
+                    && address.ss_family != AF_UNIX;
+#else
+        zero_copy = false;
+#endif
+        LogTrace("io_uring stream, registered buffers", fixed_buffers,
+                 "zero copy", zero_copy);
+    }
+
+    virtual void SendN(size_t n, const void* data) override
+    {
+        IoSlice slice{ data, n };
+        SendV(&slice, 1);
+    }
+
+    virtual void SendV(const IoSlice* slices, size_t count) override
+    {
+        LogTrace("SendV", count);
+
+        // Each op sends one contiguous run: either a part of the registered
+        // buffer, or a large slice in place.
+        ops.clear();
+        size_t used = 0;
+        for (size_t i = 0; i < count; ++i) {
+            auto& s = slices[i];
+            if (s.size >= g_zero_copy_min) {
+                ops.push_back({ reinterpret_cast<const char*>(s.data), s.size,
+                                true });
+                continue;
+            }
+
+            auto c = reinterpret_cast<const char*>(s.data);
+            for (auto left = s.size; left;) {
+                if (used == send_buffer.size()) {
+                    // out of buffer. Send what is gathered so far.
+                    Send();
+                    ops.clear();
+                    used = 0;
+                }
+                auto n = min(left, send_buffer.size() - used);
+                memcpy(send_buffer.data() + used, c, n);
+                if (!ops.empty() && !ops.back().in_place
+                    && ops.back().data + ops.back().size
+                         == send_buffer.data() + used) {
+                    ops.back().size += n;
+                } else {
+                    ops.push_back({ send_buffer.data() + used, n, false });
+                }
+                used += n;
+                c += n;
+                left -= n;
+            }
+        }
+        Send();
+        bytes_sent += accumulate(slices, slices + count, size_t(0),
+                                 [](auto a, auto& s) { return a + s.size; });
+    }
+
+    virtual void RecvN(size_t n, void* dst) override
+    {
+        LogTrace("Recv", n);
+        auto c = reinterpret_cast<char*>(dst);
+        while (n) {
+            if (recv_begin == recv_end) {
+                if (n >= recv_buffer.size()) {
+                    // too big to be worth buffering, straight in to dst.
+                    auto r = Recv(c, n, false);
+                    c += r;
+                    n -= r;
+                    continue;
+                }
+                recv_begin = 0;
+                recv_end   = Recv(recv_buffer.data(), recv_buffer.size(),
+                                fixed_buffers);
+            }
+            auto take = min(n, recv_end - recv_begin);
+            memcpy(c, recv_buffer.data() + recv_begin, take);
+            recv_begin += take;
+            c += take;
+            n -= take;
+        }
+    }
+
+    virtual size_t RecvSome(size_t max, void* dst) override
+    {
+        if (recv_begin == recv_end) {
+            return Recv(reinterpret_cast<char*>(dst), max, false);
+        }
+        auto take = min(max, recv_end - recv_begin);
+        RecvN(take, dst);
+        return take;
+    }
+
+    virtual int WaitForDataToRecv(chrono::seconds timeout) override
+    {
+        if (recv_begin != recv_end) {
+            return 1;
+        }
+
+        __kernel_timespec ts{ timeout.count(), 0 };
+        auto poll           = ring.Queue();
+        poll->opcode        = IORING_OP_POLL_ADD;
+        poll->fd            = handle;
+        poll->poll32_events = POLLIN;
+        poll->flags         = IOSQE_IO_LINK;
+        poll->user_data     = 1;
+
+        auto limit       = ring.Queue();
+        limit->opcode    = IORING_OP_LINK_TIMEOUT;
+        limit->addr      = reinterpret_cast<uint64_t>(&ts);
+        limit->len       = 1;
+        limit->user_data = 2;
+
+        ring.Submit(2);
+        int result = 0;
+        for (int i = 0; i < 2; ++i) {
+            auto cqe = ring.Reap();
+            if (cqe.user_data == 1 && cqe.res > 0) {
+                result = 1;
+            }
+        }
+        return result;
+    }
+
+    virtual void Close() override
+    {
+        LogInfo("io_uring stream closing. bytes sent", bytes_sent,
+                 "zero copy", bytes_zero_copy, "io_uring_enter calls",
+                 ring.EnterCalls());
+        closesocket(handle);
+    }
+
+  private:
+    struct SendOp
+    {
+        const char* data;
+        size_t size;
+        bool in_place;
+    };
+
+    // Sends every op in ops, in order, linked so the kernel keeps them so.
+    void Send()
+    {
+        size_t first = 0;
+        while (first < ops.size()) {
+            auto batch = min<size_t>(ops.size() - first, ring.Space());
+            for (size_t i = first; i < first + batch; ++i) {
+                QueueSend(i, i + 1 < first + batch);
+            }
+            ring.Submit(batch);
+
+            // a zero copy send completes twice, once when sent and again
+            // when the kernel is done with the memory.
+            size_t results = 0, notifications = 0;
+            auto done = first;
+            auto short_send = false;
+            while (results < batch || notifications) {
+                auto cqe = ring.Reap();
+#ifdef IORING_CQE_F_NOTIF
+                if (cqe.flags & IORING_CQE_F_NOTIF) {
+                    --notifications;
+                    continue;
+                }
+                if (cqe.flags & IORING_CQE_F_MORE) {
+                    ++notifications;
+                }
+#endif
+                ++results;
+
+                auto& op = ops[cqe.user_data];
+                if (cqe.res < 0 && cqe.res != -ECANCELED) {
+                    LogError("Send result", cqe.res);
+                    throw socket_close_exception();
+                }
+                if (cqe.res >= 0 && (size_t)cqe.res < op.size) {
+                    // a short send breaks the link. Whatever is left of this
+                    // one, and anything cancelled after it, is sent again.
+                    op.data += cqe.res;
+                    op.size -= cqe.res;
+                    short_send = true;
+                } else if (cqe.res >= 0) {
+                    op.size = 0;
+                }
+            }
+
+            while (done < first + batch && ops[done].size == 0) {
+                ++done;
+            }
+            if (!short_send && done != first + batch) {
+                throw std::runtime_error("io_uring send lost an op");
+            }
+            first = done;
+        }
+    }
+
+    void QueueSend(size_t index, bool link)
+    {
+        auto& op       = ops[index];
+        auto sqe       = ring.Queue();
+        sqe->fd        = handle;
+        sqe->addr      = reinterpret_cast<uint64_t>(op.data);
+        sqe->len       = (uint32_t)op.size;
+        sqe->user_data = index;
+        sqe->flags     = link ? IOSQE_IO_LINK : 0;
+
+        if (!op.in_place) {
+            if (fixed_buffers) {
+                sqe->opcode    = IORING_OP_WRITE_FIXED;
+                sqe->buf_index = 0;
+            } else {
+                sqe->opcode    = IORING_OP_SEND;
+                sqe->msg_flags = MSG_NOSIGNAL;
+            }
+            return;
+        }
+
+#ifdef IORING_CQE_F_NOTIF
+        if (zero_copy) {
+            sqe->opcode    = IORING_OP_SEND_ZC;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            bytes_zero_copy += op.size;
+            return;
+        }
+#endif
+        sqe->opcode    = IORING_OP_SEND;
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+
+    size_t Recv(char* dst, size_t n, bool fixed)
+    {
+        auto sqe       = ring.Queue();
+        sqe->fd        = handle;
+        sqe->addr      = reinterpret_cast<uint64_t>(dst);
+        sqe->len       = (uint32_t)min<size_t>(n, UINT32_MAX);
+        sqe->user_data = 0;
+        if (fixed) {
+            sqe->opcode    = IORING_OP_READ_FIXED;
+            sqe->buf_index = 1;
+        } else {
+            sqe->opcode = IORING_OP_RECV;
+        }
+        ring.Submit(1);
+
+        auto cqe = ring.Reap();
+        if (cqe.res <= 0) {
+            LogError("Recv result", cqe.res);
+            throw socket_close_exception();
+        }
+        return cqe.res;
+    }
+
+    SOCKET handle;
+    Uring ring;
+    bool fixed_buffers;
+    bool zero_copy;
+
+    vector<char> send_buffer;
+    vector<SendOp> ops;
+
+    vector<char> recv_buffer;
+    size_t recv_begin;
+    size_t recv_end;
+
+    uint64_t bytes_sent      = 0;
+    uint64_t bytes_zero_copy = 0;
+};
+#endif // __linux__
+
+// The stream a connection runs over, as picked by -io.
+// Anything but uring is a plain TCPStream.
+unique_ptr<INetStream> MakeStream(const string& io, TCPStream connection)
+{
+#ifdef __linux__
+    if (io == "uring") {
+        try {
+            return make_unique<UringStream>(connection.Handle());
+        } catch (runtime_error& e) {
+            LogError("Could not start io_uring,", e.what(), ", using blocking");
+        }
+    }
+#endif
+    return make_unique<TCPStream>(connection);
+}